@@ -0,0 +1,250 @@
+// ==========================================================================
+// Camera Path Animation Support Code
+//
+// Frames go through two stages: the calling thread traces each frame on a
+// thread pool, then an encoder thread tonemaps it and writes it to disk.
+// A bounded queue between them lets tracing run up to queueLength frames
+// ahead of the encoder, so neither waits for the other unless one stage is
+// consistently slower. The packed scene is shared by every frame, only the
+// camera moves.
+// ==========================================================================
+
+#include "Animation.h"
+#include "RayTracer.h"
+#include "FrameWriter.h"
+#include "Parallel.h"
+#include "TraceStats.h"
+#include "Timeline.h"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <deque>
+#include <chrono>
+#include <cstdio>
+#include <cmath>
+
+using namespace std;
+using namespace glm;
+
+typedef chrono::steady_clock Clock;
+
+static double Seconds(Clock::duration duration)
+{
+    return chrono::duration<double>(duration).count();
+}
+
+// --------------------------------------------------------------------------
+// Camera Path
+
+bool CameraPath::Load(const string &fileName)
+{
+    ifstream file(fileName.c_str());
+    if (!file)
+    {
+        cout << "CameraPath ERROR: Could not open " << fileName << endl;
+        return false;
+    }
+
+    m_times.clear();
+    m_positions.clear();
+
+    string line;
+    for (int number = 1; getline(file, line); ++number)
+    {
+        size_t first = line.find_first_not_of(" \t\r");
+        if (first == string::npos || line[first] == '#')
+            continue;
+
+        istringstream fields(line);
+        float time;
+        vec3 position;
+        if (!(fields >> time >> position.x >> position.y >> position.z) ||
+            (!m_times.empty() && time <= m_times.back()))
+        {
+            cout << "CameraPath ERROR: Bad keyframe on line " << number << " of "
+                 << fileName << endl;
+            return false;
+        }
+        m_times.push_back(time);
+        m_positions.push_back(position);
+    }
+
+    if (m_times.empty())
+    {
+        cout << "CameraPath ERROR: No keyframes in " << fileName << endl;
+        return false;
+    }
+    return true;
+}
+
+vec3 CameraPath::Position(float time) const
+{
+    int last = int(m_times.size()) - 1;
+    if (last < 0) return vec3(0.f);
+    if (time <= m_times.front()) return m_positions.front();
+    if (time >= m_times.back()) return m_positions.back();
+
+    // segment from keyframe i to i+1, with the keyframes either side of it
+    // shaping the curve
+    int i = 0;
+    while (i + 1 < last && m_times[i + 1] <= time)
+        ++i;
+    float u = (time - m_times[i]) / (m_times[i + 1] - m_times[i]);
+
+    vec3 p0 = m_positions[std::max(i - 1, 0)];
+    vec3 p1 = m_positions[i];
+    vec3 p2 = m_positions[i + 1];
+    vec3 p3 = m_positions[std::min(i + 2, last)];
+
+    return 0.5f * (2.f * p1 + (p2 - p0) * u + (2.f * p0 - 5.f * p1 + 4.f * p2 - p3) * u * u +
+                   (3.f * p1 - p0 - 3.f * p2 + p3) * u * u * u);
+}
+
+// --------------------------------------------------------------------------
+// Rendering
+
+// a traced frame waiting for the encoder
+struct TracedFrame
+{
+    int             index;
+    vector<vec3>    colours;
+};
+
+int RenderAnimation(const SceneBlock &scene, const CameraPath &path,
+                    const AnimationSettings &settings, const volatile sig_atomic_t *stop)
+{
+    int width = settings.width, height = settings.height;
+    int frameCount = int(floor((path.EndTime() - path.StartTime()) * settings.framesPerSecond + 1e-3f)) + 1;
+
+    deque<TracedFrame> queue;
+    mutex queueMutex;
+    condition_variable frameReady, spaceFree;
+    bool tracingDone = false;
+    bool encodeFailed = false;
+
+    // time each stage spent working and waiting on the other
+    Clock::duration encodeTime = Clock::duration::zero(), encoderIdle = Clock::duration::zero();
+    Clock::duration traceTime = Clock::duration::zero(), tracerStalled = Clock::duration::zero();
+
+    thread encoder([&]
+    {
+        SetTimelineThreadName("encoder");
+        vector<char> name(settings.framePattern.size() + 32);
+        unique_lock<mutex> lock(queueMutex);
+        for (;;)
+        {
+            Clock::time_point waiting = Clock::now();
+            frameReady.wait(lock, [&] { return !queue.empty() || tracingDone; });
+            encoderIdle += Clock::now() - waiting;
+            if (queue.empty())
+                break;
+
+            TracedFrame frame = std::move(queue.front());
+            queue.pop_front();
+            lock.unlock();
+            spaceFree.notify_one();
+
+            Clock::time_point start = Clock::now();
+            bool saved;
+            {
+                TimelineScope scope("encode frame", "frame", frame.index);
+                snprintf(&name[0], name.size(), settings.framePattern.c_str(), frame.index);
+                saved = SaveFrame(&name[0], width, height, &frame.colours[0]);
+            }
+
+            lock.lock();
+            encodeTime += Clock::now() - start;
+            if (!saved)
+            {
+                encodeFailed = true;
+                spaceFree.notify_one();
+            }
+        }
+    });
+
+    ThreadPool pool;
+    RayTracer tracer(scene, path.Position(path.StartTime()));
+    Clock::time_point start = Clock::now();
+    int traced = 0;
+    vector<TraceStats> frameStats;
+    vector<double> frameSeconds;
+    CollectTraceStats(true);
+
+    for (int i = 0; i < frameCount && !*stop; ++i)
+    {
+        Clock::time_point frameStart = Clock::now();
+        tracer.SetEye(path.Position(path.StartTime() + i / settings.framesPerSecond));
+
+        TracedFrame frame;
+        frame.index = i;
+        frame.colours.resize(size_t(width) * height);
+        {
+            TimelineScope scope("trace frame", "frame", i);
+            pool.ParallelFor(height, 4, [&](int begin, int end)
+            {
+                tracer.RenderTile(0, begin, width, end - begin, width, height,
+                                  &frame.colours[size_t(begin) * width], settings.samples);
+            });
+        }
+        Clock::time_point traceEnd = Clock::now();
+
+        // the pool is idle between frames, so the counters can be read
+        frameStats.push_back(CollectTraceStats(true));
+        frameSeconds.push_back(Seconds(traceEnd - frameStart));
+
+        unique_lock<mutex> lock(queueMutex);
+        traceTime += traceEnd - frameStart;
+        {
+            TimelineScope scope("wait for encoder", "frame", i);
+            spaceFree.wait(lock, [&] { return int(queue.size()) < settings.queueLength || encodeFailed; });
+        }
+        tracerStalled += Clock::now() - traceEnd;
+        if (encodeFailed)
+            break;
+
+        queue.push_back(std::move(frame));
+        lock.unlock();
+        frameReady.notify_one();
+
+        ++traced;
+        cout << "\rTraced frame " << traced << " of " << frameCount << flush;
+    }
+
+    {
+        lock_guard<mutex> lock(queueMutex);
+        tracingDone = true;
+    }
+    frameReady.notify_one();
+    encoder.join();
+    cout << endl;
+
+    double total = Seconds(Clock::now() - start);
+    cout << "Rendered " << traced << " frames in " << total << " s ("
+         << traced / std::max(total, 1e-6) << " frames/s)" << endl
+         << "  tracing " << Seconds(traceTime) << " s, stalled on a full queue "
+         << Seconds(tracerStalled) << " s" << endl
+         << "  encoding " << Seconds(encodeTime) << " s, idle waiting for frames "
+         << Seconds(encoderIdle) << " s" << endl;
+
+    if (TRACE_STATS_ENABLED)
+    {
+        TraceStats total;
+        for (size_t i = 0; i < frameStats.size(); ++i)
+            total += frameStats[i];
+        PrintTraceStats(cout, total, Seconds(traceTime));
+        if (!settings.statsFile.empty())
+            SaveTraceStats(settings.statsFile, frameStats, frameSeconds);
+    }
+    else if (!settings.statsFile.empty())
+        cout << "Trace statistics are only counted by builds with TRACE_STATS" << endl;
+
+    if (encodeFailed)
+    {
+        cout << "Stopped, a frame could not be saved" << endl;
+        return -1;
+    }
+    return traced == frameCount ? 0 : 1;
+}
+
+// --------------------------------------------------------------------------
@@ -0,0 +1,65 @@
+// ==========================================================================
+// Camera Path Animation Support Code
+//  - renders a sequence of frames with the camera following a keyframed
+//    path, tracing new frames while earlier ones are still being encoded
+// ==========================================================================
+#ifndef ANIMATION_H
+#define ANIMATION_H
+
+#include <string>
+#include <vector>
+#include <csignal>
+#include <glm/vec3.hpp>
+#include "Scene.h"
+
+// --------------------------------------------------------------------------
+// Camera positions at increasing times, read from a text file with one
+// "time x y z" keyframe per line; blank lines and lines starting with # are
+// skipped. Positions in between follow a Catmull-Rom spline through the
+// keyframes.
+
+class CameraPath
+{
+    std::vector<float>      m_times;
+    std::vector<glm::vec3>  m_positions;
+
+public:
+    // returns false if the file can't be read, has a malformed line or has
+    // keyframe times that don't increase
+    bool Load(const std::string &fileName);
+
+    float StartTime() const { return m_times.empty() ? 0.f : m_times.front(); }
+    float EndTime() const { return m_times.empty() ? 0.f : m_times.back(); }
+
+    // camera position at a time, held at the first or last keyframe outside
+    // the path
+    glm::vec3 Position(float time) const;
+};
+
+// --------------------------------------------------------------------------
+
+struct AnimationSettings
+{
+    int         width, height;
+    int         samples;
+    float       framesPerSecond;
+
+    // frame file names, a printf pattern with one integer such as
+    // frames/shot_%04d.png
+    std::string framePattern;
+
+    // how many traced frames may wait for the encoder before tracing stalls
+    int         queueLength;
+
+    // JSON file for the trace statistics of each frame, none if empty
+    std::string statsFile;
+};
+
+// render a frame at every 1/framesPerSecond from the start of the path to
+// its end, stopping early if *stop becomes non-zero, returns the process
+// exit code
+int RenderAnimation(const SceneBlock &scene, const CameraPath &path,
+                    const AnimationSettings &settings, const volatile std::sig_atomic_t *stop);
+
+// --------------------------------------------------------------------------
+#endif // ANIMATION_H
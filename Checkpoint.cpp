@@ -0,0 +1,237 @@
+// ==========================================================================
+// Render Checkpoint Support Code
+//
+// Layout, all little endian: the magic "RTCK", a version, the render
+// parameters, the tile count and one bit per tile, the pixel, tile and
+// active tile counts and passes of the path traced state followed by its
+// arrays (counts of 0 when there is none), then a CRC-32 of all of it.
+// Floats are stored as their bits, so a resumed render adds to exactly the
+// sums it stopped with. A checkpoint is only ever written after the image
+// file has been flushed, so every tile it marks done is already on disk.
+// ==========================================================================
+
+#include "Checkpoint.h"
+#include "Deflate.h"
+
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+
+#ifdef _WIN32
+	#include <windows.h>
+	#include <io.h>
+#else
+	#include <unistd.h>
+#endif
+
+using namespace std;
+
+static const uint32_t CHECKPOINT_VERSION = 2;
+
+// --------------------------------------------------------------------------
+
+static void PutLittleEndian(vector<unsigned char> &out, uint32_t value)
+{
+    for (int i = 0; i < 4; ++i)
+        out.push_back((unsigned char) (value >> (8 * i)));
+}
+
+static uint32_t GetLittleEndian(const unsigned char *in)
+{
+    return uint32_t(in[0]) | uint32_t(in[1]) << 8 | uint32_t(in[2]) << 16 | uint32_t(in[3]) << 24;
+}
+
+static void PutFloats(vector<unsigned char> &out, const float *values, size_t count)
+{
+    for (size_t i = 0; i < count; ++i)
+    {
+        uint32_t bits;
+        memcpy(&bits, &values[i], 4);
+        PutLittleEndian(out, bits);
+    }
+}
+
+static const unsigned char *GetFloats(const unsigned char *in, float *values, size_t count)
+{
+    for (size_t i = 0; i < count; ++i, in += 4)
+    {
+        uint32_t bits = GetLittleEndian(in);
+        memcpy(&values[i], &bits, 4);
+    }
+    return in;
+}
+
+static void PutInts(vector<unsigned char> &out, const vector<int> &values)
+{
+    for (size_t i = 0; i < values.size(); ++i)
+        PutLittleEndian(out, uint32_t(values[i]));
+}
+
+static const unsigned char *GetInts(const unsigned char *in, vector<int> &values)
+{
+    for (size_t i = 0; i < values.size(); ++i, in += 4)
+        values[i] = int(GetLittleEndian(in));
+    return in;
+}
+
+RenderCheckpoint::RenderCheckpoint()
+    : scene(0), width(0), height(0), tileSize(0), sceneHash(0)
+{
+}
+
+bool RenderCheckpoint::Matches(const RenderCheckpoint &other) const
+{
+    return scene == other.scene && width == other.width && height == other.height &&
+           tileSize == other.tileSize && sceneHash == other.sceneHash &&
+           tileDone.size() == other.tileDone.size() &&
+           path.tilePasses.size() == other.path.tilePasses.size();
+}
+
+// --------------------------------------------------------------------------
+
+bool SaveCheckpoint(const string &fileName, const RenderCheckpoint &checkpoint)
+{
+    vector<unsigned char> data;
+    data.insert(data.end(), "RTCK", "RTCK" + 4);
+    PutLittleEndian(data, CHECKPOINT_VERSION);
+    PutLittleEndian(data, uint32_t(checkpoint.scene));
+    PutLittleEndian(data, uint32_t(checkpoint.width));
+    PutLittleEndian(data, uint32_t(checkpoint.height));
+    PutLittleEndian(data, uint32_t(checkpoint.tileSize));
+    PutLittleEndian(data, checkpoint.sceneHash);
+
+    size_t tiles = checkpoint.tileDone.size();
+    PutLittleEndian(data, uint32_t(tiles));
+    size_t bits = data.size();
+    data.resize(bits + (tiles + 7) / 8, 0);
+    for (size_t i = 0; i < tiles; ++i)
+        if (checkpoint.tileDone[i])
+            data[bits + i / 8] |= (unsigned char) (1 << (i % 8));
+
+    const PathTraceState &path = checkpoint.path;
+    size_t pixels = path.sum.size();
+    PutLittleEndian(data, uint32_t(pixels));
+    PutLittleEndian(data, uint32_t(path.tilePasses.size()));
+    PutLittleEndian(data, uint32_t(path.activeTiles.size()));
+    PutLittleEndian(data, uint32_t(path.passes));
+    if (pixels > 0)
+    {
+        data.reserve(data.size() + pixels * 44 + path.tilePasses.size() * 8 +
+                     path.activeTiles.size() * 4 + 4);
+        PutFloats(data, &path.sum[0].x, pixels * 3);
+        PutFloats(data, &path.sumSquares[0], pixels);
+        PutFloats(data, &path.normalSum[0].x, pixels * 3);
+        PutFloats(data, &path.depthSum[0], pixels);
+        PutFloats(data, &path.albedoSum[0].x, pixels * 3);
+    }
+    PutInts(data, path.tilePasses);
+    if (!path.tileError.empty())
+        PutFloats(data, &path.tileError[0], path.tileError.size());
+    PutInts(data, path.activeTiles);
+
+    PutLittleEndian(data, UpdateCrc(0, &data[0], data.size()));
+
+    // the old checkpoint stays in place until the new one is complete
+    string temporary = fileName + ".tmp";
+    FILE *file = fopen(temporary.c_str(), "wb");
+    if (!file)
+    {
+        cout << "Checkpoint ERROR: Could not create " << temporary << endl;
+        return false;
+    }
+    bool written = fwrite(&data[0], 1, data.size(), file) == data.size() && fflush(file) == 0;
+#ifdef _WIN32
+    written = written && _commit(_fileno(file)) == 0;
+#else
+    written = written && fsync(fileno(file)) == 0;
+#endif
+    written = fclose(file) == 0 && written;
+
+#ifdef _WIN32
+    written = written && MoveFileExA(temporary.c_str(), fileName.c_str(),
+                                     MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH);
+#else
+    written = written && rename(temporary.c_str(), fileName.c_str()) == 0;
+#endif
+    if (!written)
+    {
+        cout << "Checkpoint ERROR: Failed to write " << fileName << endl;
+        remove(temporary.c_str());
+    }
+    return written;
+}
+
+bool LoadCheckpoint(const string &fileName, RenderCheckpoint &checkpoint)
+{
+    FILE *file = fopen(fileName.c_str(), "rb");
+    if (!file)
+        return false;
+
+    vector<unsigned char> data;
+    unsigned char buffer[4096];
+    size_t count;
+    while ((count = fread(buffer, 1, sizeof(buffer), file)) > 0)
+        data.insert(data.end(), buffer, buffer + count);
+    fclose(file);
+
+    // fixed fields, the tile bits, the path traced counts and arrays, then
+    // the CRC
+    const size_t FIXED = 32, PATH_FIXED = 16;
+    if (data.size() < FIXED + 4 || memcmp(&data[0], "RTCK", 4) != 0 ||
+        GetLittleEndian(&data[4]) != CHECKPOINT_VERSION)
+        return false;
+
+    size_t tiles = GetLittleEndian(&data[28]);
+    size_t pathStart = FIXED + (tiles + 7) / 8;
+    uint64_t length = uint64_t(pathStart) + PATH_FIXED;
+    size_t pixels = 0, pathTiles = 0, activeTiles = 0;
+    if (data.size() >= length + 4)
+    {
+        pixels = GetLittleEndian(&data[pathStart]);
+        pathTiles = GetLittleEndian(&data[pathStart + 4]);
+        activeTiles = GetLittleEndian(&data[pathStart + 8]);
+        length += 44 * uint64_t(pixels) + 8 * uint64_t(pathTiles) + 4 * uint64_t(activeTiles);
+    }
+    if (data.size() != length + 4 ||
+        UpdateCrc(0, &data[0], size_t(length)) != GetLittleEndian(&data[size_t(length)]))
+    {
+        cout << "Checkpoint ERROR: " << fileName << " is damaged, ignoring it" << endl;
+        return false;
+    }
+
+    checkpoint.scene = int(GetLittleEndian(&data[8]));
+    checkpoint.width = int(GetLittleEndian(&data[12]));
+    checkpoint.height = int(GetLittleEndian(&data[16]));
+    checkpoint.tileSize = int(GetLittleEndian(&data[20]));
+    checkpoint.sceneHash = GetLittleEndian(&data[24]);
+    checkpoint.tileDone.resize(tiles);
+    for (size_t i = 0; i < tiles; ++i)
+        checkpoint.tileDone[i] = (data[FIXED + i / 8] >> (i % 8)) & 1;
+
+    PathTraceState &path = checkpoint.path;
+    path.passes = int(GetLittleEndian(&data[pathStart + 12]));
+    path.sum.resize(pixels);
+    path.sumSquares.resize(pixels);
+    path.normalSum.resize(pixels);
+    path.depthSum.resize(pixels);
+    path.albedoSum.resize(pixels);
+    path.tilePasses.resize(pathTiles);
+    path.tileError.resize(pathTiles);
+    path.activeTiles.resize(activeTiles);
+    const unsigned char *in = &data[pathStart + PATH_FIXED];
+    if (pixels > 0)
+    {
+        in = GetFloats(in, &path.sum[0].x, pixels * 3);
+        in = GetFloats(in, &path.sumSquares[0], pixels);
+        in = GetFloats(in, &path.normalSum[0].x, pixels * 3);
+        in = GetFloats(in, &path.depthSum[0], pixels);
+        in = GetFloats(in, &path.albedoSum[0].x, pixels * 3);
+    }
+    in = GetInts(in, path.tilePasses);
+    if (pathTiles > 0)
+        in = GetFloats(in, &path.tileError[0], pathTiles);
+    GetInts(in, path.activeTiles);
+    return true;
+}
+
+// --------------------------------------------------------------------------
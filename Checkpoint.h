@@ -0,0 +1,66 @@
+// ==========================================================================
+// Render Checkpoint Support Code
+//  - records how far a headless render has got in a small binary file, so
+//    a render that was interrupted can pick up where it left off
+//  - a progressive path traced render also keeps its running sums, which
+//    is everything it needs to carry on as if it had never stopped
+// ==========================================================================
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <glm/vec3.hpp>
+
+// what PathTracer has added up so far, see PathTracer.h; all empty for a
+// tiled render
+struct PathTraceState
+{
+    int                     passes;
+    std::vector<glm::vec3>  sum;
+    std::vector<float>      sumSquares;
+    std::vector<glm::vec3>  normalSum;
+    std::vector<float>      depthSum;
+    std::vector<glm::vec3>  albedoSum;
+    std::vector<int>        tilePasses;
+    std::vector<float>      tileError;
+    std::vector<int>        activeTiles;
+
+    PathTraceState() : passes(0) {}
+};
+
+// everything a resumed render must agree on, plus the tiles already in the
+// output file; the image file itself holds the finished pixels
+struct RenderCheckpoint
+{
+    int         scene;
+    int         width, height;
+    int         tileSize;
+
+    // CRC-32 of the packed scene and camera, so a checkpoint is never
+    // applied to a render of something else
+    uint32_t    sceneHash;
+
+    // one flag per tile, row by row from the bottom-left tile
+    std::vector<unsigned char> tileDone;
+
+    // the sums of a --pathtrace render, which has no tiles done instead
+    PathTraceState path;
+
+    RenderCheckpoint();
+
+    // true if both describe the same render, whatever their progress
+    bool Matches(const RenderCheckpoint &other) const;
+};
+
+// write the checkpoint to a temporary file, flush it and rename it over
+// fileName, so the file on disk is always either the old or the new one
+bool SaveCheckpoint(const std::string &fileName, const RenderCheckpoint &checkpoint);
+
+// read a checkpoint, returns false if the file is missing, truncated or
+// corrupt
+bool LoadCheckpoint(const std::string &fileName, RenderCheckpoint &checkpoint);
+
+// --------------------------------------------------------------------------
+#endif // CHECKPOINT_H
@@ -0,0 +1,521 @@
+// ==========================================================================
+// Deflate Compression Support Code
+//  - a self contained deflate (RFC 1951) compressor with hash chain match
+//    finding and dynamic Huffman blocks, plus the CRC-32 and Adler-32
+//    checksums used around it by PNG, zlib and OpenEXR
+// ==========================================================================
+
+#include "Deflate.h"
+
+#include <algorithm>
+#include <cstring>
+
+using namespace std;
+
+// --------------------------------------------------------------------------
+// Checksums
+
+static uint32_t crcTable[256];
+
+static void InitializeCrcTable()
+{
+    for (uint32_t n = 0; n < 256; ++n)
+    {
+        uint32_t c = n;
+        for (int k = 0; k < 8; ++k)
+            c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+        crcTable[n] = c;
+    }
+}
+
+uint32_t UpdateCrc(uint32_t crc, const unsigned char *data, size_t length)
+{
+    // fill the table once, on whichever thread gets here first
+    static const bool initialized = (InitializeCrcTable(), true);
+    (void) initialized;
+
+    crc = ~crc;
+    for (size_t i = 0; i < length; ++i)
+        crc = crcTable[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+static const uint32_t ADLER_BASE = 65521;
+
+uint32_t Adler32(const unsigned char *data, size_t length)
+{
+    uint32_t a = 1, b = 0;
+    while (length > 0)
+    {
+        // largest run that can't overflow 32 bits before taking the modulus
+        size_t run = std::min<size_t>(length, 5552);
+        for (size_t i = 0; i < run; ++i)
+        {
+            a += data[i];
+            b += a;
+        }
+        a %= ADLER_BASE;
+        b %= ADLER_BASE;
+        data += run;
+        length -= run;
+    }
+    return (b << 16) | a;
+}
+
+uint32_t CombineAdler32(uint32_t first, uint32_t second, size_t secondLength)
+{
+    uint32_t rem = uint32_t(secondLength % ADLER_BASE);
+    uint32_t a = first & 0xffff;
+    uint32_t b = uint32_t((uint64_t(rem) * a) % ADLER_BASE);
+    a += (second & 0xffff) + ADLER_BASE - 1;
+    b += (first >> 16) + (second >> 16) + ADLER_BASE - rem;
+    if (a >= ADLER_BASE) a -= ADLER_BASE;
+    if (a >= ADLER_BASE) a -= ADLER_BASE;
+    if (b >= 2 * ADLER_BASE) b -= 2 * ADLER_BASE;
+    if (b >= ADLER_BASE) b -= ADLER_BASE;
+    return (b << 16) | a;
+}
+
+// --------------------------------------------------------------------------
+// Deflate
+
+// writes bits least significant first, as deflate expects
+struct BitWriter
+{
+    vector<unsigned char> &out;
+    uint64_t bits;
+    int      count;
+
+    BitWriter(vector<unsigned char> &o) : out(o), bits(0), count(0) {}
+
+    void Put(uint32_t value, int length)
+    {
+        bits |= uint64_t(value) << count;
+        count += length;
+        while (count >= 8)
+        {
+            out.push_back((unsigned char) bits);
+            bits >>= 8;
+            count -= 8;
+        }
+    }
+
+    void Align()
+    {
+        if (count > 0)
+            Put(0, 8 - count);
+    }
+};
+
+// base values and extra bits of the length and distance codes
+static const int lengthBase[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27,
+    31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const int lengthExtra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const int distanceBase[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97,
+    129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289,
+    16385, 24577 };
+static const int distanceExtra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+// order the code length code lengths are sent in
+static const int codeLengthOrder[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12,
+    3, 13, 2, 14, 1, 15 };
+
+// length code for each match length, and distance code for each distance
+// up to 256 then for each 128th distance beyond that
+static unsigned char lengthCode[259];
+static unsigned char distanceCodeLow[257], distanceCodeHigh[256];
+
+static void InitializeDeflateTables()
+{
+    for (int code = 0; code < 29; ++code)
+        for (int length = lengthBase[code]; length < lengthBase[code] + (1 << lengthExtra[code])
+                                            && length <= 258; ++length)
+            lengthCode[length] = (unsigned char) code;
+    lengthCode[258] = 28;
+
+    for (int code = 0; code < 30; ++code)
+        for (int d = distanceBase[code]; d < distanceBase[code] + (1 << distanceExtra[code]); ++d)
+        {
+            if (d <= 256)
+                distanceCodeLow[d] = (unsigned char) code;
+            else
+                distanceCodeHigh[(d - 1) >> 7] = (unsigned char) code;
+        }
+}
+
+static inline int DistanceCode(int distance)
+{
+    return distance <= 256 ? distanceCodeLow[distance] : distanceCodeHigh[(distance - 1) >> 7];
+}
+
+// Huffman code lengths for the given symbol frequencies, no longer than
+// limit bits: the tree is rebuilt from halved frequencies until it fits.
+// At least two symbols always get a code so the code is complete.
+static void BuildCodeLengths(const uint32_t *frequencies, int count, int limit,
+                             unsigned char *lengths)
+{
+    vector<uint32_t> weight(frequencies, frequencies + count);
+    int used = 0;
+    for (int i = 0; i < count; ++i)
+        used += weight[i] != 0;
+    for (int i = 0; used < 2 && i < count; ++i)
+        if (!weight[i])
+        {
+            weight[i] = 1;
+            ++used;
+        }
+
+    for (;;)
+    {
+        // leaves sorted by weight, then merged with the usual two queues
+        vector<int> leaves;
+        for (int i = 0; i < count; ++i)
+            if (weight[i])
+                leaves.push_back(i);
+        std::stable_sort(leaves.begin(), leaves.end(),
+                         [&](int a, int b) { return weight[a] < weight[b]; });
+
+        int n = int(leaves.size());
+        vector<uint64_t> nodeWeight(2 * n - 1);
+        vector<int> parent(2 * n - 1, -1);
+        for (int i = 0; i < n; ++i)
+            nodeWeight[i] = weight[leaves[i]];
+
+        int nextLeaf = 0, nextNode = n;
+        for (int node = n; node < 2 * n - 1; ++node)
+        {
+            int pick[2];
+            for (int k = 0; k < 2; ++k)
+            {
+                if (nextLeaf < n && (nextNode >= node ||
+                                     nodeWeight[nextLeaf] <= nodeWeight[nextNode]))
+                    pick[k] = nextLeaf++;
+                else
+                    pick[k] = nextNode++;
+            }
+            nodeWeight[node] = nodeWeight[pick[0]] + nodeWeight[pick[1]];
+            parent[pick[0]] = parent[pick[1]] = node;
+        }
+
+        // depths from the root down, parents always come after children
+        vector<int> depth(2 * n - 1, 0);
+        int longest = 0;
+        for (int node = 2 * n - 3; node >= 0; --node)
+        {
+            depth[node] = depth[parent[node]] + 1;
+            if (node < n)
+                longest = std::max(longest, depth[node]);
+        }
+
+        if (longest <= limit)
+        {
+            memset(lengths, 0, count);
+            for (int i = 0; i < n; ++i)
+                lengths[leaves[i]] = (unsigned char) depth[i];
+            return;
+        }
+
+        for (int i = 0; i < count; ++i)
+            if (weight[i])
+                weight[i] = (weight[i] + 1) / 2;
+    }
+}
+
+// canonical codes for a set of code lengths, bit reversed for the writer
+static void BuildCodes(const unsigned char *lengths, int count, uint16_t *codes)
+{
+    int lengthCount[16] = { 0 };
+    for (int i = 0; i < count; ++i)
+        lengthCount[lengths[i]]++;
+    lengthCount[0] = 0;
+
+    int nextCode[16] = { 0 };
+    for (int bits = 1, code = 0; bits < 16; ++bits)
+    {
+        code = (code + lengthCount[bits - 1]) << 1;
+        nextCode[bits] = code;
+    }
+
+    for (int i = 0; i < count; ++i)
+    {
+        int length = lengths[i];
+        if (!length) continue;
+
+        int code = nextCode[length]++, reversed = 0;
+        for (int k = 0; k < length; ++k)
+            reversed |= ((code >> k) & 1) << (length - 1 - k);
+        codes[i] = (uint16_t) reversed;
+    }
+}
+
+// a literal (distance 0) or a match of length bytes distance back
+struct Symbol
+{
+    uint16_t value;
+    uint16_t distance;
+};
+
+// writes bytes as they are in stored blocks of at most 64 KB
+static void WriteStored(BitWriter &writer, const unsigned char *raw, size_t rawLength)
+{
+    while (rawLength > 0)
+    {
+        size_t length = std::min<size_t>(rawLength, 65535);
+        writer.Put(0, 3);
+        writer.Align();
+        writer.Put(uint32_t(length), 16);
+        writer.Put(uint32_t(~length & 0xffff), 16);
+        writer.out.insert(writer.out.end(), raw, raw + length);
+        raw += length;
+        rawLength -= length;
+    }
+}
+
+// writes the symbols of one block with dynamic Huffman codes, or the raw
+// bytes as stored blocks if that comes out smaller
+static void WriteBlock(BitWriter &writer, const vector<Symbol> &symbols,
+                       const unsigned char *raw, size_t rawLength)
+{
+    uint32_t litFrequency[286] = { 0 }, distFrequency[30] = { 0 };
+    for (size_t i = 0; i < symbols.size(); ++i)
+    {
+        if (symbols[i].distance)
+        {
+            litFrequency[257 + lengthCode[symbols[i].value]]++;
+            distFrequency[DistanceCode(symbols[i].distance)]++;
+        }
+        else
+            litFrequency[symbols[i].value]++;
+    }
+    litFrequency[256] = 1;
+
+    unsigned char lengths[286 + 30];
+    unsigned char *litLengths = lengths, *distLengths = lengths + 286;
+    BuildCodeLengths(litFrequency, 286, 15, litLengths);
+    BuildCodeLengths(distFrequency, 30, 15, distLengths);
+
+    int litCount = 286, distCount = 30;
+    while (litCount > 257 && !litLengths[litCount - 1]) --litCount;
+    while (distCount > 1 && !distLengths[distCount - 1]) --distCount;
+
+    // run length encode the code lengths, both tables as one sequence
+    memmove(lengths + litCount, distLengths, distCount);
+    int total = litCount + distCount;
+    vector<unsigned char> runs, runExtra;
+    uint32_t runFrequency[19] = { 0 };
+    for (int i = 0; i < total; )
+    {
+        int length = lengths[i], run = 1;
+        while (i + run < total && lengths[i + run] == length)
+            ++run;
+        i += run;
+
+        if (length == 0)
+        {
+            while (run >= 11)
+            {
+                int r = std::min(run, 138);
+                runs.push_back(18); runExtra.push_back((unsigned char) (r - 11));
+                run -= r;
+            }
+            if (run >= 3)
+            {
+                runs.push_back(17); runExtra.push_back((unsigned char) (run - 3));
+                run = 0;
+            }
+        }
+        else
+        {
+            runs.push_back((unsigned char) length); runExtra.push_back(0);
+            --run;
+            while (run >= 3)
+            {
+                int r = std::min(run, 6);
+                runs.push_back(16); runExtra.push_back((unsigned char) (r - 3));
+                run -= r;
+            }
+        }
+        for (; run > 0; --run)
+        {
+            runs.push_back((unsigned char) length); runExtra.push_back(0);
+        }
+    }
+    for (size_t i = 0; i < runs.size(); ++i)
+        runFrequency[runs[i]]++;
+
+    unsigned char runLengths[19];
+    BuildCodeLengths(runFrequency, 19, 7, runLengths);
+    int runCount = 19;
+    while (runCount > 4 && !runLengths[codeLengthOrder[runCount - 1]]) --runCount;
+
+    // size of the block in bits, to compare against storing it
+    uint64_t bitCount = 3 + 5 + 5 + 4 + 3 * runCount;
+    for (size_t i = 0; i < runs.size(); ++i)
+        bitCount += runLengths[runs[i]] + (runs[i] == 16 ? 2 : runs[i] == 17 ? 3 : runs[i] == 18 ? 7 : 0);
+    for (int i = 0; i < 286; ++i)
+        bitCount += uint64_t(litFrequency[i]) * litLengths[i];
+    for (int i = 0; i < 29; ++i)
+        bitCount += uint64_t(litFrequency[257 + i]) * lengthExtra[i];
+    for (int i = 0; i < 30; ++i)
+        bitCount += uint64_t(distFrequency[i]) * (distLengths[i] + distanceExtra[i]);
+
+    uint64_t storedBits = (rawLength + 65534) / 65535 * 40 + rawLength * 8 + 7;
+    if (storedBits <= bitCount)
+    {
+        WriteStored(writer, raw, rawLength);
+        return;
+    }
+
+    // distLengths was moved into place behind the literal lengths
+    distLengths = lengths + litCount;
+    uint16_t litCodes[286], distCodes[30], runCodes[19];
+    BuildCodes(litLengths, litCount, litCodes);
+    BuildCodes(distLengths, distCount, distCodes);
+    BuildCodes(runLengths, 19, runCodes);
+
+    writer.Put(2 << 1, 3);
+    writer.Put(litCount - 257, 5);
+    writer.Put(distCount - 1, 5);
+    writer.Put(runCount - 4, 4);
+    for (int i = 0; i < runCount; ++i)
+        writer.Put(runLengths[codeLengthOrder[i]], 3);
+    for (size_t i = 0; i < runs.size(); ++i)
+    {
+        writer.Put(runCodes[runs[i]], runLengths[runs[i]]);
+        if (runs[i] == 16) writer.Put(runExtra[i], 2);
+        if (runs[i] == 17) writer.Put(runExtra[i], 3);
+        if (runs[i] == 18) writer.Put(runExtra[i], 7);
+    }
+
+    for (size_t i = 0; i < symbols.size(); ++i)
+    {
+        const Symbol &s = symbols[i];
+        if (!s.distance)
+        {
+            writer.Put(litCodes[s.value], litLengths[s.value]);
+            continue;
+        }
+
+        int lc = lengthCode[s.value];
+        writer.Put(litCodes[257 + lc], litLengths[257 + lc]);
+        writer.Put(s.value - lengthBase[lc], lengthExtra[lc]);
+
+        int dc = DistanceCode(s.distance);
+        writer.Put(distCodes[dc], distLengths[dc]);
+        writer.Put(s.distance - distanceBase[dc], distanceExtra[dc]);
+    }
+    writer.Put(litCodes[256], litLengths[256]);
+}
+
+void Deflate(const unsigned char *data, size_t length, int chainLength,
+             vector<unsigned char> &out)
+{
+    static const bool initialized = (InitializeDeflateTables(), true);
+    (void) initialized;
+
+    BitWriter writer(out);
+
+    if (chainLength == 0)
+        WriteStored(writer, data, length);
+    else
+    {
+        const int WINDOW = 32768, HASH_BITS = 15, BLOCK_SYMBOLS = 1 << 15;
+        vector<int> head(1 << HASH_BITS, -1), previous(WINDOW, -1);
+        vector<Symbol> symbols;
+        symbols.reserve(BLOCK_SYMBOLS);
+        size_t blockStart = 0;
+
+        for (size_t i = 0; i < length; )
+        {
+            int bestLength = 0, bestDistance = 0;
+            if (i + 3 <= length)
+            {
+                uint32_t hash = ((data[i] << 10) ^ (data[i + 1] << 5) ^ data[i + 2])
+                                & ((1 << HASH_BITS) - 1);
+                int maxLength = int(std::min<size_t>(258, length - i));
+
+                // walk earlier positions with the same hash, newest first
+                int candidate = head[hash];
+                for (int chain = chainLength; candidate >= 0 && chain > 0; --chain)
+                {
+                    int distance = int(i) - candidate;
+                    if (distance > WINDOW) break;
+
+                    const unsigned char *a = data + candidate, *b = data + i;
+                    if (a[bestLength] == b[bestLength])
+                    {
+                        int n = 0;
+                        while (n < maxLength && a[n] == b[n]) ++n;
+                        if (n > bestLength)
+                        {
+                            bestLength = n;
+                            bestDistance = distance;
+                            if (n == maxLength) break;
+                        }
+                    }
+
+                    int next = previous[candidate & (WINDOW - 1)];
+                    if (next >= candidate) break;
+                    candidate = next;
+                }
+                previous[i & (WINDOW - 1)] = head[hash];
+                head[hash] = int(i);
+            }
+
+            if (bestLength >= 3)
+            {
+                Symbol s = { (uint16_t) bestLength, (uint16_t) bestDistance };
+                symbols.push_back(s);
+
+                // enter the positions the match covers into the hash chains
+                for (size_t k = i + 1; k < i + bestLength && k + 3 <= length; ++k)
+                {
+                    uint32_t hash = ((data[k] << 10) ^ (data[k + 1] << 5) ^ data[k + 2])
+                                    & ((1 << HASH_BITS) - 1);
+                    previous[k & (WINDOW - 1)] = head[hash];
+                    head[hash] = int(k);
+                }
+                i += bestLength;
+            }
+            else
+            {
+                Symbol s = { data[i], 0 };
+                symbols.push_back(s);
+                ++i;
+            }
+
+            if (symbols.size() >= size_t(BLOCK_SYMBOLS) || i >= length)
+            {
+                WriteBlock(writer, symbols, data + blockStart, i - blockStart);
+                symbols.clear();
+                blockStart = i;
+            }
+        }
+    }
+
+    // an empty stored block leaves the stream on a byte boundary
+    writer.Put(0, 3);
+    writer.Align();
+    writer.Put(0x0000, 16);
+    writer.Put(0xffff, 16);
+}
+
+void ZlibCompress(const unsigned char *data, size_t length, int chainLength,
+                  vector<unsigned char> &out)
+{
+    // deflate without a preset dictionary and a 32 KB window
+    out.push_back(0x78);
+    out.push_back(0x01);
+    Deflate(data, length, chainLength, out);
+
+    // a final empty stored block, then the checksum big endian
+    uint32_t checksum = Adler32(data, length);
+    static const unsigned char last[5] = { 0x01, 0x00, 0x00, 0xff, 0xff };
+    out.insert(out.end(), last, last + 5);
+    for (int shift = 24; shift >= 0; shift -= 8)
+        out.push_back((unsigned char) (checksum >> shift));
+}
+
+// --------------------------------------------------------------------------
@@ -0,0 +1,36 @@
+// ==========================================================================
+// Deflate Compression Support Code
+//  - a self contained deflate (RFC 1951) compressor with hash chain match
+//    finding and dynamic Huffman blocks, plus the CRC-32 and Adler-32
+//    checksums used around it by PNG, zlib and OpenEXR
+// ==========================================================================
+#ifndef DEFLATE_H
+#define DEFLATE_H
+
+#include <vector>
+#include <cstddef>
+#include <stdint.h>
+
+// CRC-32 of data continuing from crc, start with crc = 0
+uint32_t UpdateCrc(uint32_t crc, const unsigned char *data, size_t length);
+
+// Adler-32 checksum of data
+uint32_t Adler32(const unsigned char *data, size_t length);
+
+// checksum of two pieces of data joined together, given the checksum of each
+// piece and the length of the second, as in zlib's adler32_combine()
+uint32_t CombineAdler32(uint32_t first, uint32_t second, size_t secondLength);
+
+// appends data compressed as non-final deflate blocks ending on a byte
+// boundary, so separately compressed pieces can be joined into one stream:
+//  - chainLength is how many earlier positions are searched for each match,
+//    0 stores the data uncompressed
+void Deflate(const unsigned char *data, size_t length, int chainLength,
+             std::vector<unsigned char> &out);
+
+// appends a complete zlib stream (RFC 1950) holding data
+void ZlibCompress(const unsigned char *data, size_t length, int chainLength,
+                  std::vector<unsigned char> &out);
+
+// --------------------------------------------------------------------------
+#endif // DEFLATE_H
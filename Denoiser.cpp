@@ -0,0 +1,320 @@
+// ==========================================================================
+// Denoiser Support Code
+//
+// Every pass replaces each pixel with a weighted mean of 5 x 5 pixels spaced
+// 2^pass apart. The weight of a neighbour is the B3 spline kernel times how
+// close its colour, normal, depth and albedo are to the pixel's, so noise
+// is averaged away within a surface but not across edges or shadows. The
+// colour tolerance halves every pass as the noise left gets smaller.
+//
+// The channels are split into planes of floats so four neighbouring pixels
+// are one SSE2 load; pixels whose taps would leave the image at the sides
+// take the scalar path, which does the same arithmetic in the same order.
+// ==========================================================================
+
+#include "Denoiser.h"
+#include "Parallel.h"
+#include "Timeline.h"
+
+#include <algorithm>
+#include <cstring>
+#include <cmath>
+#include <stdint.h>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define USE_SSE2
+#endif
+
+using namespace std;
+using namespace glm;
+
+// B3 spline kernel, applied along rows and columns
+static const float KERNEL[5] = { 1 / 16.f, 1 / 4.f, 3 / 8.f, 1 / 4.f, 1 / 16.f };
+
+// colour difference giving a weight of 1/e in the first pass
+static const float COLOUR_SIGMA = 0.6f;
+
+// depth difference, relative to the pixel's depth and per pixel of tap
+// spacing, giving a weight of 1/e
+static const float DEPTH_SIGMA = 0.02f;
+
+// albedo difference giving a weight of 1/e
+static const float ALBEDO_SIGMA = 0.1f;
+
+// the normal weight is the cosine between the normals to the power
+// 2^NORMAL_SQUARINGS
+static const int NORMAL_SQUARINGS = 7;
+
+// side length in pixels of the tiles a pass is split into
+static const int DENOISE_TILE = 64;
+
+enum Plane
+{
+    PLANE_RED, PLANE_GREEN, PLANE_BLUE,
+    PLANE_NORMAL_X, PLANE_NORMAL_Y, PLANE_NORMAL_Z, PLANE_DEPTH,
+    PLANE_ALBEDO_R, PLANE_ALBEDO_G, PLANE_ALBEDO_B, PLANES
+};
+
+// what one pass reads and writes
+struct FilterPass
+{
+    const float *planes[PLANES];
+    float       *output[3];
+    int         width, height, step;
+
+    // 1 / sigma^2 of this pass's colour weight, and the depth weight's
+    // scale before dividing by the pixel's depth
+    float       colourScale, depthScale;
+};
+
+static inline uint32_t FloatBits(float f)
+{
+    uint32_t u;
+    memcpy(&u, &f, sizeof(u));
+    return u;
+}
+
+static inline float BitsFloat(uint32_t u)
+{
+    float f;
+    memcpy(&f, &u, sizeof(f));
+    return f;
+}
+
+// e^-x for x >= 0: 2^f from its Taylor polynomial on (-1,0], about 1e-5
+// relative error, and the integer part of the power added to the exponent
+// bits; the SSE2 version does the same operations lane by lane
+static const float LOG2E = 1.44269504f;
+static const float EXP2_C1 = 0.69314718f, EXP2_C2 = 0.24022651f, EXP2_C3 = 0.05550411f,
+                   EXP2_C4 = 0.00961813f, EXP2_C5 = 0.00133336f;
+
+static inline float NegativeExp(float x)
+{
+    float t = std::max(x * -LOG2E, -100.f);
+    int i = int(t);
+    float f = t - float(i);
+    float p = 1 + f * (EXP2_C1 + f * (EXP2_C2 + f * (EXP2_C3 + f * (EXP2_C4 + f * EXP2_C5))));
+    return BitsFloat(FloatBits(p) + (uint32_t(i) << 23));
+}
+
+// --------------------------------------------------------------------------
+
+static void FilterPixel(const FilterPass &pass, int x, int y)
+{
+    const float *const *planes = pass.planes;
+    size_t p = size_t(y) * pass.width + x;
+    float depthScale = pass.depthScale / std::max(planes[PLANE_DEPTH][p], 1e-4f);
+
+    float sum[3] = { 0.f, 0.f, 0.f }, total = 0.f;
+    for (int dy = -2; dy <= 2; ++dy)
+    {
+        int qy = y + dy * pass.step;
+        if (qy < 0 || qy >= pass.height)
+            continue;
+        for (int dx = -2; dx <= 2; ++dx)
+        {
+            int qx = x + dx * pass.step;
+            if (qx < 0 || qx >= pass.width)
+                continue;
+            size_t q = size_t(qy) * pass.width + qx;
+            float weight = KERNEL[dy + 2] * KERNEL[dx + 2];
+
+            // the centre keeps its kernel weight, so the sum never vanishes
+            if (dx != 0 || dy != 0)
+            {
+                float colour = 0.f, albedo = 0.f, cosine = 0.f;
+                for (int c = 0; c < 3; ++c)
+                {
+                    float dc = planes[PLANE_RED + c][q] - planes[PLANE_RED + c][p];
+                    float da = planes[PLANE_ALBEDO_R + c][q] - planes[PLANE_ALBEDO_R + c][p];
+                    colour += dc * dc;
+                    albedo += da * da;
+                    cosine += planes[PLANE_NORMAL_X + c][q] * planes[PLANE_NORMAL_X + c][p];
+                }
+                float depth = std::abs(planes[PLANE_DEPTH][q] - planes[PLANE_DEPTH][p]);
+
+                cosine = std::max(cosine, 0.f);
+                for (int i = 0; i < NORMAL_SQUARINGS; ++i)
+                    cosine *= cosine;
+                weight *= cosine * NegativeExp(colour * pass.colourScale + depth * depthScale +
+                                               albedo * (1 / (ALBEDO_SIGMA * ALBEDO_SIGMA)));
+            }
+
+            for (int c = 0; c < 3; ++c)
+                sum[c] += weight * planes[PLANE_RED + c][q];
+            total += weight;
+        }
+    }
+
+    for (int c = 0; c < 3; ++c)
+        pass.output[c][p] = sum[c] / total;
+}
+
+#ifdef USE_SSE2
+static inline __m128 NegativeExp4(__m128 x)
+{
+    __m128 t = _mm_max_ps(_mm_mul_ps(x, _mm_set1_ps(-LOG2E)), _mm_set1_ps(-100.f));
+    __m128i i = _mm_cvttps_epi32(t);
+    __m128 f = _mm_sub_ps(t, _mm_cvtepi32_ps(i));
+    __m128 p = _mm_add_ps(_mm_mul_ps(f, _mm_set1_ps(EXP2_C5)), _mm_set1_ps(EXP2_C4));
+    p = _mm_add_ps(_mm_mul_ps(f, p), _mm_set1_ps(EXP2_C3));
+    p = _mm_add_ps(_mm_mul_ps(f, p), _mm_set1_ps(EXP2_C2));
+    p = _mm_add_ps(_mm_mul_ps(f, p), _mm_set1_ps(EXP2_C1));
+    p = _mm_add_ps(_mm_mul_ps(f, p), _mm_set1_ps(1.f));
+    return _mm_castsi128_ps(_mm_add_epi32(_mm_castps_si128(p), _mm_slli_epi32(i, 23)));
+}
+
+// pixels x to x + 3 of row y, whose taps all fall inside the row
+static void FilterPixels4(const FilterPass &pass, int x, int y)
+{
+    const float *const *planes = pass.planes;
+    size_t p = size_t(y) * pass.width + x;
+
+    __m128 centre[PLANES];
+    for (int plane = 0; plane < PLANES; ++plane)
+        centre[plane] = _mm_loadu_ps(planes[plane] + p);
+    __m128 depthScale = _mm_div_ps(_mm_set1_ps(pass.depthScale),
+                                   _mm_max_ps(centre[PLANE_DEPTH], _mm_set1_ps(1e-4f)));
+    __m128 colourScale = _mm_set1_ps(pass.colourScale);
+    __m128 albedoScale = _mm_set1_ps(1 / (ALBEDO_SIGMA * ALBEDO_SIGMA));
+    __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+
+    __m128 sum[3] = { _mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps() };
+    __m128 total = _mm_setzero_ps();
+    for (int dy = -2; dy <= 2; ++dy)
+    {
+        int qy = y + dy * pass.step;
+        if (qy < 0 || qy >= pass.height)
+            continue;
+        for (int dx = -2; dx <= 2; ++dx)
+        {
+            size_t q = size_t(qy) * pass.width + x + dx * pass.step;
+            __m128 weight = _mm_set1_ps(KERNEL[dy + 2] * KERNEL[dx + 2]);
+
+            __m128 colour[3];
+            for (int c = 0; c < 3; ++c)
+                colour[c] = _mm_loadu_ps(planes[PLANE_RED + c] + q);
+
+            if (dx != 0 || dy != 0)
+            {
+                __m128 colourDistance = _mm_setzero_ps(), albedo = _mm_setzero_ps();
+                __m128 cosine = _mm_setzero_ps();
+                for (int c = 0; c < 3; ++c)
+                {
+                    __m128 dc = _mm_sub_ps(colour[c], centre[PLANE_RED + c]);
+                    __m128 da = _mm_sub_ps(_mm_loadu_ps(planes[PLANE_ALBEDO_R + c] + q),
+                                           centre[PLANE_ALBEDO_R + c]);
+                    colourDistance = _mm_add_ps(colourDistance, _mm_mul_ps(dc, dc));
+                    albedo = _mm_add_ps(albedo, _mm_mul_ps(da, da));
+                    cosine = _mm_add_ps(cosine, _mm_mul_ps(_mm_loadu_ps(planes[PLANE_NORMAL_X + c] + q),
+                                                           centre[PLANE_NORMAL_X + c]));
+                }
+                __m128 depth = _mm_and_ps(_mm_sub_ps(_mm_loadu_ps(planes[PLANE_DEPTH] + q),
+                                                     centre[PLANE_DEPTH]), absMask);
+
+                cosine = _mm_max_ps(cosine, _mm_setzero_ps());
+                for (int i = 0; i < NORMAL_SQUARINGS; ++i)
+                    cosine = _mm_mul_ps(cosine, cosine);
+                __m128 exponent = _mm_add_ps(_mm_add_ps(_mm_mul_ps(colourDistance, colourScale),
+                                                        _mm_mul_ps(depth, depthScale)),
+                                             _mm_mul_ps(albedo, albedoScale));
+                weight = _mm_mul_ps(weight, _mm_mul_ps(cosine, NegativeExp4(exponent)));
+            }
+
+            for (int c = 0; c < 3; ++c)
+                sum[c] = _mm_add_ps(sum[c], _mm_mul_ps(weight, colour[c]));
+            total = _mm_add_ps(total, weight);
+        }
+    }
+
+    for (int c = 0; c < 3; ++c)
+        _mm_storeu_ps(pass.output[c] + p, _mm_div_ps(sum[c], total));
+}
+#endif
+
+static void FilterTile(const FilterPass &pass, int x0, int y0, int x1, int y1)
+{
+    for (int y = y0; y < y1; ++y)
+    {
+        int x = x0;
+#ifdef USE_SSE2
+        // the run of pixels of the tile whose taps stay inside the row, four
+        // at a time; wide steps leave no such run and the tile goes scalar
+        int first = std::min(x1, std::max(x0, 2 * pass.step));
+        int last = std::max(first, std::min(x1, pass.width - 2 * pass.step));
+        for (; x < first; ++x)
+            FilterPixel(pass, x, y);
+        for (; x + 4 <= last; x += 4)
+            FilterPixels4(pass, x, y);
+#endif
+        for (; x < x1; ++x)
+            FilterPixel(pass, x, y);
+    }
+}
+
+// --------------------------------------------------------------------------
+
+void Denoise(ThreadPool &pool, int width, int height, const DenoiseFeatures &features,
+             vector<vec3> &colours, int iterations)
+{
+    // a pass whose taps are all further apart than the image is wide and
+    // high leaves it unchanged, so the passes stop before that step
+    int useful = 0;
+    while (useful < iterations && (1 << useful) < std::max(width, height))
+        ++useful;
+    iterations = useful;
+
+    TimelineScope scope("denoise", "passes", iterations);
+    size_t pixels = size_t(width) * height;
+
+    // colours ping-pong between two sets of planes, features stay put
+    vector<float> planes[PLANES], output[3];
+    for (int plane = 0; plane < PLANES; ++plane)
+        planes[plane].resize(pixels);
+    for (int c = 0; c < 3; ++c)
+        output[c].resize(pixels);
+    for (size_t i = 0; i < pixels; ++i)
+        for (int c = 0; c < 3; ++c)
+        {
+            planes[PLANE_RED + c][i] = colours[i][c];
+            planes[PLANE_NORMAL_X + c][i] = features.normals[i][c];
+            planes[PLANE_ALBEDO_R + c][i] = features.albedos[i][c];
+        }
+    std::copy(features.depths.begin(), features.depths.end(), planes[PLANE_DEPTH].begin());
+
+    int tilesAcross = (width + DENOISE_TILE - 1) / DENOISE_TILE;
+    int tiles = tilesAcross * ((height + DENOISE_TILE - 1) / DENOISE_TILE);
+    for (int iteration = 0; iteration < iterations; ++iteration)
+    {
+        FilterPass pass;
+        for (int plane = 0; plane < PLANES; ++plane)
+            pass.planes[plane] = &planes[plane][0];
+        for (int c = 0; c < 3; ++c)
+            pass.output[c] = &output[c][0];
+        pass.width = width;
+        pass.height = height;
+        pass.step = 1 << iteration;
+        float sigma = COLOUR_SIGMA / float(1 << iteration);
+        pass.colourScale = 1 / (sigma * sigma);
+        pass.depthScale = 1 / (DEPTH_SIGMA * pass.step);
+
+        pool.ParallelFor(tiles, 1, [&](int begin, int end)
+        {
+            for (int tile = begin; tile < end; ++tile)
+            {
+                int x0 = (tile % tilesAcross) * DENOISE_TILE, y0 = (tile / tilesAcross) * DENOISE_TILE;
+                FilterTile(pass, x0, y0, std::min(width, x0 + DENOISE_TILE),
+                           std::min(height, y0 + DENOISE_TILE));
+            }
+        });
+
+        for (int c = 0; c < 3; ++c)
+            planes[PLANE_RED + c].swap(output[c]);
+    }
+
+    for (size_t i = 0; i < pixels; ++i)
+        colours[i] = vec3(planes[PLANE_RED][i], planes[PLANE_GREEN][i], planes[PLANE_BLUE][i]);
+}
+
+// --------------------------------------------------------------------------
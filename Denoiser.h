@@ -0,0 +1,36 @@
+// ==========================================================================
+// Denoiser Support Code
+//  - smooths the noise out of a float image with the edge avoiding a-trous
+//    wavelet filter of Dammertz et al. 2010, guided by the normal, depth
+//    and albedo of what each pixel sees so edges stay sharp
+//  - each pass is split into tiles for the thread pool, and four pixels of
+//    a row are filtered at once with SSE2 where it is available
+// ==========================================================================
+#ifndef DENOISER_H
+#define DENOISER_H
+
+#include <vector>
+#include <glm/vec3.hpp>
+
+class ThreadPool;
+
+// what the first hit of each pixel's rays was, averaged over its samples,
+// rows from the bottom up like the image; pixels whose rays miss get a
+// normal facing the camera and DENOISE_MISS_DEPTH
+struct DenoiseFeatures
+{
+    std::vector<glm::vec3>  normals;
+    std::vector<float>      depths;
+    std::vector<glm::vec3>  albedos;
+};
+
+const float DENOISE_MISS_DEPTH = 1e4f;
+
+// filter colours in place with iterations passes, each one spreading over
+// twice the pixels of the one before: 5 passes reach 62 pixels across;
+// passes that would spread wider than the image are skipped
+void Denoise(ThreadPool &pool, int width, int height, const DenoiseFeatures &features,
+             std::vector<glm::vec3> &colours, int iterations);
+
+// --------------------------------------------------------------------------
+#endif // DENOISER_H
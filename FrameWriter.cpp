@@ -0,0 +1,88 @@
+// ==========================================================================
+// Frame Writing Support Code
+// ==========================================================================
+
+#include "FrameWriter.h"
+#include "PngWriter.h"
+#include "HdrWriter.h"
+#include "Timeline.h"
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <algorithm>
+
+using namespace std;
+using namespace glm;
+
+// --------------------------------------------------------------------------
+
+static string Extension(const string &fileName)
+{
+    size_t dot = fileName.find_last_of('.');
+    if (dot == string::npos) return "";
+
+    string extension = fileName.substr(dot + 1);
+    std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+    return extension;
+}
+
+bool IsFrameFileName(const string &fileName)
+{
+    string extension = Extension(fileName);
+    return extension == "png" || extension == "ppm" || IsHdrFileName(fileName);
+}
+
+bool SaveFrame(const string &fileName, int width, int height,
+               const vec3 *colours, float exposure)
+{
+    string extension = Extension(fileName);
+    if (width <= 0 || height <= 0 || !IsFrameFileName(fileName))
+    {
+        cout << "FrameWriter ERROR: Can't save " << fileName << endl;
+        return false;
+    }
+    TimelineScope scope("save frame", "width", width, "height", height);
+
+    // HDR writers take rows from the top down
+    if (IsHdrFileName(fileName))
+    {
+        HdrWriter *writer = CreateHdrWriter(fileName, width, height);
+        if (!writer)
+            return false;
+        bool written = true;
+        for (int y = height - 1; y >= 0; --y)
+            written = writer->WriteRows(colours + size_t(y) * width, 1) && written;
+        written = writer->Close() && written;
+        delete writer;
+        return written;
+    }
+
+    // truncated like the default ImageBuffer quantize, NaN becomes 0
+    vector<unsigned char> pixels(size_t(width) * height * 3);
+    {
+        TimelineScope convert("convert image");
+        for (int y = 0; y < height; ++y)
+        {
+            const float *in = &colours[size_t(height - 1 - y) * width].r;
+            unsigned char *out = &pixels[size_t(y) * width * 3];
+            for (int i = 0; i < 3 * width; ++i)
+                out[i] = (unsigned char) std::min(std::max(0.f, in[i] * exposure * 255.f), 255.f);
+        }
+    }
+
+    if (extension == "png")
+        return WritePng(fileName, width, height, 3, &pixels[0]);
+
+    ofstream file(fileName.c_str(), ios::binary);
+    file << "P6\n" << width << " " << height << "\n255\n";
+    file.write((const char *) &pixels[0], pixels.size());
+    if (!file)
+    {
+        cout << "FrameWriter ERROR: Failed to write " << fileName << endl;
+        return false;
+    }
+    return true;
+}
+
+// --------------------------------------------------------------------------
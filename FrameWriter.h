@@ -0,0 +1,23 @@
+// ==========================================================================
+// Frame Writing Support Code
+//  - saves a rendered frame of float colours to PNG, PPM, PFM or OpenEXR
+//    by file name, for renders that never go through an ImageBuffer
+// ==========================================================================
+#ifndef FRAMEWRITER_H
+#define FRAMEWRITER_H
+
+#include <string>
+#include <glm/vec3.hpp>
+
+// save width x height colours given row by row from the bottom row up:
+//  - PNG and PPM files are truncated to 8 bits after scaling by exposure
+//  - PFM and EXR (zip compressed) files keep the floats as they are
+// returns false for any other extension or if the file can't be written
+bool SaveFrame(const std::string &fileName, int width, int height,
+               const glm::vec3 *colours, float exposure = 1.f);
+
+// returns true if the file name has an extension SaveFrame() handles
+bool IsFrameFileName(const std::string &fileName);
+
+// --------------------------------------------------------------------------
+#endif // FRAMEWRITER_H
@@ -0,0 +1,376 @@
+// ==========================================================================
+// HDR Image Writing Support Code
+//
+// PFM files store rows from the bottom up behind a text header, so rows are
+// seeked into place as they arrive. OpenEXR files get their header and an
+// empty line offset table up front, then one chunk per block of scanlines,
+// and the offsets are filled in on Close().
+// ==========================================================================
+
+#include "HdrWriter.h"
+#include "Deflate.h"
+#include "Parallel.h"
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <stdint.h>
+
+using namespace std;
+using namespace glm;
+
+// --------------------------------------------------------------------------
+// PFM
+
+class PfmWriter : public HdrWriter
+{
+    ofstream    m_file;
+    int         m_width, m_height;
+    int         m_row;
+    streamoff   m_dataStart;
+
+public:
+    PfmWriter(const string &fileName, int width, int height)
+        : m_file(fileName.c_str(), ios::binary), m_width(width), m_height(height), m_row(0)
+    {
+        // a negative scale marks the floats as little endian
+        m_file << "PF\n" << width << " " << height << "\n-1.0\n";
+        m_dataStart = m_file.tellp();
+    }
+
+    bool IsOpen() const { return m_file.is_open() && m_file.good(); }
+
+    bool WriteRows(const vec3 *colours, int count)
+    {
+        count = std::min(count, m_height - m_row);
+        for (int i = 0; i < count; ++i, ++m_row)
+        {
+            streamoff row = m_height - 1 - m_row;
+            m_file.seekp(m_dataStart + row * m_width * streamoff(sizeof(vec3)));
+            m_file.write((const char *) (colours + size_t(i) * m_width), m_width * sizeof(vec3));
+        }
+        return m_file.good();
+    }
+
+    bool Close()
+    {
+        bool complete = m_row == m_height;
+        m_file.close();
+        return complete && !m_file.fail();
+    }
+};
+
+// --------------------------------------------------------------------------
+// OpenEXR
+
+// byte reordering and delta predictor OpenEXR applies before RLE and zlib
+// compression: even bytes first, then odd bytes, then differences
+static void ExrPredict(const unsigned char *raw, size_t length, vector<unsigned char> &out)
+{
+    out.resize(length);
+    size_t half = (length + 1) / 2;
+    for (size_t i = 0; i < length; ++i)
+        out[(i & 1) ? half + i / 2 : i / 2] = raw[i];
+
+    int previous = length ? out[0] : 0;
+    for (size_t i = 1; i < length; ++i)
+    {
+        int current = out[i];
+        out[i] = (unsigned char) (current - previous + 128);
+        previous = current;
+    }
+}
+
+// run length encoding as in OpenEXR's ImfRle: a count byte n >= 0 repeats
+// the next byte n+1 times, a negative count -n copies the next n bytes
+static void ExrRle(const unsigned char *in, size_t length, vector<unsigned char> &out)
+{
+    const size_t MIN_RUN = 3, MAX_RUN = 127;
+    const unsigned char *runStart = in, *runEnd = in + 1, *end = in + length;
+
+    while (runStart < end)
+    {
+        while (runEnd < end && *runStart == *runEnd && size_t(runEnd - runStart - 1) < MAX_RUN)
+            ++runEnd;
+
+        if (size_t(runEnd - runStart) >= MIN_RUN)
+        {
+            out.push_back((unsigned char) ((runEnd - runStart) - 1));
+            out.push_back(*runStart);
+            runStart = runEnd;
+        }
+        else
+        {
+            // copy bytes until the next run of three starts
+            while (runEnd < end &&
+                   ((runEnd + 1 >= end || *runEnd != *(runEnd + 1)) ||
+                    (runEnd + 2 >= end || *(runEnd + 1) != *(runEnd + 2))) &&
+                   size_t(runEnd - runStart) < MAX_RUN)
+                ++runEnd;
+
+            out.push_back((unsigned char) (runStart - runEnd));
+            out.insert(out.end(), runStart, runEnd);
+            runStart = runEnd;
+        }
+        ++runEnd;
+    }
+}
+
+static void PutLittleEndian(vector<unsigned char> &out, uint64_t value, int bytes)
+{
+    for (int i = 0; i < bytes; ++i)
+        out.push_back((unsigned char) (value >> (8 * i)));
+}
+
+static void PutFloat(vector<unsigned char> &out, float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    PutLittleEndian(out, bits, 4);
+}
+
+// header attribute: name, type name, size of the value, then the value
+static void PutAttribute(vector<unsigned char> &out, const char *name, const char *type,
+                         const vector<unsigned char> &value)
+{
+    out.insert(out.end(), name, name + strlen(name) + 1);
+    out.insert(out.end(), type, type + strlen(type) + 1);
+    PutLittleEndian(out, value.size(), 4);
+    out.insert(out.end(), value.begin(), value.end());
+}
+
+void ExrHeader(int width, int height, ExrCompression compression,
+               vector<unsigned char> &header)
+{
+    vector<unsigned char> value;
+    header.clear();
+
+    // magic number, then version 2 for a single part scanline file
+    PutLittleEndian(header, 20000630, 4);
+    PutLittleEndian(header, 2, 4);
+
+    // channels in alphabetical order, each a 32 bit float sampled at every
+    // pixel
+    const char *channels[3] = { "B", "G", "R" };
+    for (int c = 0; c < 3; ++c)
+    {
+        value.insert(value.end(), channels[c], channels[c] + 2);
+        PutLittleEndian(value, 2, 4);   // FLOAT
+        PutLittleEndian(value, 0, 4);   // pLinear and reserved
+        PutLittleEndian(value, 1, 4);   // x sampling
+        PutLittleEndian(value, 1, 4);   // y sampling
+    }
+    value.push_back(0);
+    PutAttribute(header, "channels", "chlist", value);
+
+    value.assign(1, (unsigned char) compression);
+    PutAttribute(header, "compression", "compression", value);
+
+    value.clear();
+    PutLittleEndian(value, 0, 4);
+    PutLittleEndian(value, 0, 4);
+    PutLittleEndian(value, uint32_t(width - 1), 4);
+    PutLittleEndian(value, uint32_t(height - 1), 4);
+    PutAttribute(header, "dataWindow", "box2i", value);
+    PutAttribute(header, "displayWindow", "box2i", value);
+
+    value.assign(1, 0);   // INCREASING_Y
+    PutAttribute(header, "lineOrder", "lineOrder", value);
+
+    value.clear();
+    PutFloat(value, 1.f);
+    PutAttribute(header, "pixelAspectRatio", "float", value);
+
+    value.clear();
+    PutFloat(value, 0.f);
+    PutFloat(value, 0.f);
+    PutAttribute(header, "screenWindowCenter", "v2f", value);
+
+    value.clear();
+    PutFloat(value, 1.f);
+    PutAttribute(header, "screenWindowWidth", "float", value);
+
+    header.push_back(0);
+}
+
+class ExrWriter : public HdrWriter
+{
+    ofstream        m_file;
+    int             m_width, m_height;
+    ExrCompression  m_compression;
+    int             m_blockLines;
+
+    // rows waiting for their block to fill, and the file offset of each
+    // block written so far
+    vector<vec3>    m_pending;
+    int             m_row;
+    vector<uint64_t> m_offsets;
+    streamoff       m_tableStart;
+
+    void WriteBlocks(int firstRow, int rows);
+
+public:
+    ExrWriter(const string &fileName, int width, int height, ExrCompression compression);
+
+    bool IsOpen() const { return m_file.is_open() && m_file.good(); }
+    bool WriteRows(const vec3 *colours, int count);
+    bool Close();
+};
+
+ExrWriter::ExrWriter(const string &fileName, int width, int height, ExrCompression compression)
+    : m_file(fileName.c_str(), ios::binary), m_width(width), m_height(height),
+      m_compression(compression), m_blockLines(compression == EXR_ZIP ? 16 : 1), m_row(0)
+{
+    vector<unsigned char> header;
+    ExrHeader(width, height, compression, header);
+    m_file.write((const char *) &header[0], header.size());
+
+    // room for the line offset table, filled in when the file is closed
+    m_tableStart = m_file.tellp();
+    int blocks = (height + m_blockLines - 1) / m_blockLines;
+    vector<char> table(size_t(blocks) * 8, 0);
+    m_file.write(&table[0], table.size());
+}
+
+// compress and write the blocks of pending rows starting at firstRow, in
+// parallel when there are several of them
+void ExrWriter::WriteBlocks(int firstRow, int rows)
+{
+    int blocks = (rows + m_blockLines - 1) / m_blockLines;
+    vector< vector<unsigned char> > chunks(blocks);
+
+    ParallelFor(blocks, 4, [&](int begin, int end)
+    {
+        vector<unsigned char> raw, predicted;
+        for (int b = begin; b < end; ++b)
+        {
+            int first = b * m_blockLines, lines = std::min(m_blockLines, rows - first);
+
+            // each line holds all of B, then G, then R
+            raw.clear();
+            for (int y = first; y < first + lines; ++y)
+            {
+                const vec3 *row = &m_pending[size_t(y) * m_width];
+                for (int c = 2; c >= 0; --c)
+                    for (int x = 0; x < m_width; ++x)
+                    {
+                        uint32_t bits;
+                        memcpy(&bits, &row[x][c], sizeof(bits));
+                        PutLittleEndian(raw, bits, 4);
+                    }
+            }
+
+            vector<unsigned char> &chunk = chunks[b];
+            PutLittleEndian(chunk, uint32_t(firstRow + first), 4);
+            PutLittleEndian(chunk, 0, 4);
+
+            if (m_compression == EXR_RLE || m_compression == EXR_ZIPS || m_compression == EXR_ZIP)
+            {
+                ExrPredict(&raw[0], raw.size(), predicted);
+                if (m_compression == EXR_RLE)
+                    ExrRle(&predicted[0], predicted.size(), chunk);
+                else
+                    ZlibCompress(&predicted[0], predicted.size(), 16, chunk);
+            }
+
+            // blocks that don't get smaller are stored as they are, which
+            // readers recognise from the size
+            if (m_compression == EXR_NONE || chunk.size() - 8 >= raw.size())
+            {
+                chunk.resize(8);
+                chunk.insert(chunk.end(), raw.begin(), raw.end());
+            }
+
+            uint32_t size = uint32_t(chunk.size() - 8);
+            for (int i = 0; i < 4; ++i)
+                chunk[4 + i] = (unsigned char) (size >> (8 * i));
+        }
+    });
+
+    for (int b = 0; b < blocks; ++b)
+    {
+        m_offsets.push_back(uint64_t(m_file.tellp()));
+        m_file.write((const char *) &chunks[b][0], chunks[b].size());
+    }
+}
+
+bool ExrWriter::WriteRows(const vec3 *colours, int count)
+{
+    count = std::min(count, m_height - m_row - int(m_pending.size() / m_width));
+    m_pending.insert(m_pending.end(), colours, colours + size_t(count) * m_width);
+
+    // write every full block, and the short last one once it is complete
+    int rows = int(m_pending.size() / m_width);
+    int full = rows / m_blockLines * m_blockLines;
+    if (m_row + rows == m_height)
+        full = rows;
+
+    if (full > 0)
+    {
+        WriteBlocks(m_row, full);
+        m_pending.erase(m_pending.begin(), m_pending.begin() + size_t(full) * m_width);
+        m_row += full;
+    }
+    return m_file.good();
+}
+
+bool ExrWriter::Close()
+{
+    bool complete = m_row == m_height;
+
+    vector<unsigned char> table;
+    for (size_t i = 0; i < m_offsets.size(); ++i)
+        PutLittleEndian(table, m_offsets[i], 8);
+    m_file.seekp(m_tableStart);
+    if (!table.empty())
+        m_file.write((const char *) &table[0], table.size());
+
+    m_file.close();
+    return complete && !m_file.fail();
+}
+
+// --------------------------------------------------------------------------
+
+static string Extension(const string &fileName)
+{
+    size_t dot = fileName.find_last_of('.');
+    if (dot == string::npos) return "";
+
+    string extension = fileName.substr(dot + 1);
+    std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+    return extension;
+}
+
+bool IsHdrFileName(const string &fileName)
+{
+    string extension = Extension(fileName);
+    return extension == "pfm" || extension == "exr";
+}
+
+HdrWriter *CreateHdrWriter(const string &fileName, int width, int height,
+                           ExrCompression compression)
+{
+    string extension = Extension(fileName);
+    if (width <= 0 || height <= 0 || !IsHdrFileName(fileName))
+        return 0;
+
+    if (extension == "pfm")
+    {
+        PfmWriter *writer = new PfmWriter(fileName, width, height);
+        if (writer->IsOpen()) return writer;
+        delete writer;
+    }
+    else
+    {
+        ExrWriter *writer = new ExrWriter(fileName, width, height, compression);
+        if (writer->IsOpen()) return writer;
+        delete writer;
+    }
+
+    cout << "HdrWriter ERROR: Could not create " << fileName << endl;
+    return 0;
+}
+
+// --------------------------------------------------------------------------
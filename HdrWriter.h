@@ -0,0 +1,48 @@
+// ==========================================================================
+// HDR Image Writing Support Code
+//  - writes float RGB images as PFM or scanline OpenEXR files a few rows at
+//    a time, so a large render never has to be held in memory at once
+// ==========================================================================
+#ifndef HDRWRITER_H
+#define HDRWRITER_H
+
+#include <string>
+#include <vector>
+#include <glm/vec3.hpp>
+
+// OpenEXR compression methods, ZIPS compresses each scanline on its own and
+// ZIP compresses blocks of 16 scanlines
+enum ExrCompression { EXR_NONE, EXR_RLE, EXR_ZIPS, EXR_ZIP };
+
+// --------------------------------------------------------------------------
+// Base class of the writers, the file is written as rows are passed in
+
+class HdrWriter
+{
+public:
+    virtual ~HdrWriter() {}
+
+    // write the next count rows of width colours each, rows are given from
+    // the top of the image down
+    virtual bool WriteRows(const glm::vec3 *colours, int count) = 0;
+
+    // finish the file once every row has been written, returns false if any
+    // part of it could not be written
+    virtual bool Close() = 0;
+};
+
+// open a writer for a file ending in .pfm or .exr, returning 0 for any other
+// extension or if the file can't be created, delete the writer when done
+HdrWriter *CreateHdrWriter(const std::string &fileName, int width, int height,
+                           ExrCompression compression = EXR_ZIP);
+
+// returns true if the file name has an extension CreateHdrWriter() handles
+bool IsHdrFileName(const std::string &fileName);
+
+// header of a single part scanline OpenEXR file with float B, G and R
+// channels, up to the line offset table that follows it
+void ExrHeader(int width, int height, ExrCompression compression,
+               std::vector<unsigned char> &header);
+
+// --------------------------------------------------------------------------
+#endif // HDRWRITER_H
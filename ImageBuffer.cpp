@@ -18,10 +18,22 @@
 // ==========================================================================
 
 #include "ImageBuffer.h"
+#include "Parallel.h"
+#include "HdrWriter.h"
+#include "Timeline.h"
 
 #include <iostream>
 #include <glm/common.hpp>
+#include <glm/vec4.hpp>
 #include <algorithm>
+#include <cstring>
+#include <cmath>
+#include <stdint.h>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define USE_SSE2
+#endif
 
 // --------------------------------------------------------------------------
 // Set these defines to choose which image library to use for saving image
@@ -52,12 +64,305 @@
 using namespace std;
 using namespace glm;
 
+// --------------------------------------------------------------------------
+// Conversion between float colours and the compact storage formats
+
+// OpenGL format and type each storage format is uploaded with, shared
+// exponent textures can't be attached to the FBO we blit from, so those are
+// unpacked into the equally small packed float format instead
+struct FormatInfo
+{
+    int     size;
+    GLenum  internalFormat, format, type;
+};
+
+static const FormatInfo FORMATS[] =
+{
+    { 12, GL_RGB,            GL_RGB,  GL_FLOAT },
+    { 8,  GL_RGBA16F,        GL_RGBA, GL_HALF_FLOAT },
+    { 4,  GL_R11F_G11F_B10F, GL_RGB, GL_UNSIGNED_INT_5_9_9_9_REV },
+    { 4,  GL_RGBA8,          GL_RGBA, GL_UNSIGNED_BYTE },
+};
+
+int ImageBuffer::PixelSize(PixelFormat format)
+{
+    return FORMATS[format].size;
+}
+
+static inline uint32_t FloatBits(float f)
+{
+    uint32_t u;
+    memcpy(&u, &f, sizeof(u));
+    return u;
+}
+
+static inline float BitsFloat(uint32_t u)
+{
+    float f;
+    memcpy(&f, &u, sizeof(f));
+    return f;
+}
+
+// float to half with round to nearest even, overflow goes to infinity and
+// NaN stays NaN, written without branches on the value so it maps directly
+// onto the SSE2 version below
+static inline uint16_t FloatToHalf(float value)
+{
+    uint32_t x = FloatBits(value);
+    uint32_t sign = x & 0x80000000u;
+    x ^= sign;
+
+    uint32_t result;
+    if (x >= (127u + 16) << 23)
+        result = x > 0x7f800000u ? 0x7e00 : 0x7c00;
+    else if (x < (127u - 14) << 23)
+    {
+        // let the FPU align a subnormal mantissa by adding a magic number
+        const uint32_t magic = ((127u - 15) + (23 - 10) + 1) << 23;
+        result = FloatBits(BitsFloat(x) + BitsFloat(magic)) - magic;
+    }
+    else
+    {
+        uint32_t odd = (x >> 13) & 1;
+        x += 0xfff - ((127u - 15) << 23) + odd;
+        result = x >> 13;
+    }
+    return uint16_t(result | (sign >> 16));
+}
+
+static inline float HalfToFloat(uint16_t h)
+{
+    // shift exponent and mantissa into place and rescale, which handles
+    // subnormals, then fix up infinities and NaNs
+    uint32_t x = uint32_t(h & 0x7fff) << 13;
+    float f = BitsFloat(x) * BitsFloat(0x77800000u);   // 2^112
+    if (x >= 0x7c00u << 13)
+        f = BitsFloat(x | 0x7f800000u);
+    return BitsFloat(FloatBits(f) | (uint32_t(h & 0x8000) << 16));
+}
+
+#ifdef USE_SSE2
+// four floats to halves in the low 16 bits of each lane
+static inline __m128i FloatToHalf4(__m128 value)
+{
+    const __m128i signMask = _mm_set1_epi32(0x80000000u);
+    const __m128i halfMax = _mm_set1_epi32((127 + 16) << 23);
+    const __m128i minNormal = _mm_set1_epi32((127 - 14) << 23);
+    const __m128i magic = _mm_set1_epi32(((127 - 15) + (23 - 10) + 1) << 23);
+    const __m128i bias = _mm_set1_epi32(0xfff - ((127 - 15) << 23));
+
+    __m128i x = _mm_castps_si128(value);
+    __m128i sign = _mm_and_si128(x, signMask);
+    x = _mm_xor_si128(x, sign);
+
+    // infinity, or a quiet NaN
+    __m128i isNan = _mm_cmpgt_epi32(x, _mm_set1_epi32(0x7f800000));
+    __m128i special = _mm_or_si128(_mm_and_si128(isNan, _mm_set1_epi32(0x200)),
+                                   _mm_set1_epi32(0x7c00));
+
+    __m128i subnormal = _mm_sub_epi32(_mm_castps_si128(
+        _mm_add_ps(_mm_castsi128_ps(x), _mm_castsi128_ps(magic))), magic);
+
+    __m128i odd = _mm_and_si128(_mm_srli_epi32(x, 13), _mm_set1_epi32(1));
+    __m128i normal = _mm_srli_epi32(_mm_add_epi32(_mm_add_epi32(x, bias), odd), 13);
+
+    __m128i isSubnormal = _mm_cmpgt_epi32(minNormal, x);
+    __m128i finite = _mm_or_si128(_mm_and_si128(isSubnormal, subnormal),
+                                  _mm_andnot_si128(isSubnormal, normal));
+    __m128i inRange = _mm_cmpgt_epi32(halfMax, x);
+    __m128i result = _mm_or_si128(_mm_and_si128(inRange, finite),
+                                  _mm_andnot_si128(inRange, special));
+    return _mm_or_si128(result, _mm_srli_epi32(sign, 16));
+}
+
+// pack the 16 bit results of two FloatToHalf4() calls into eight shorts,
+// sign extending first so the saturating pack keeps the bits unchanged
+static inline __m128i PackHalves(__m128i a, __m128i b)
+{
+    a = _mm_srai_epi32(_mm_slli_epi32(a, 16), 16);
+    b = _mm_srai_epi32(_mm_slli_epi32(b, 16), 16);
+    return _mm_packs_epi32(a, b);
+}
+#endif
+
+// shared exponent encoding from EXT_texture_shared_exponent, with the
+// floor(log2()) taken straight from the float exponent bits
+static inline uint32_t FloatToRGB9E5(vec3 colour)
+{
+    const float maxValue = 65408.f;   // (2^9-1)/2^9 * 2^16
+    // zero first so a NaN channel compares false and is replaced by it
+    float r = std::min(std::max(0.f, colour.r), maxValue);
+    float g = std::min(std::max(0.f, colour.g), maxValue);
+    float b = std::min(std::max(0.f, colour.b), maxValue);
+    float maxRGB = std::max(r, std::max(g, b));
+
+    int exponent = std::max(-16, int(FloatBits(maxRGB) >> 23) - 127) + 16;
+    float scale = BitsFloat(uint32_t(127 - exponent + 15 + 9) << 23);
+
+    if (int(maxRGB * scale + 0.5f) == 512)
+    {
+        scale *= 0.5f;
+        exponent += 1;
+    }
+
+    uint32_t rm = uint32_t(r * scale + 0.5f);
+    uint32_t gm = uint32_t(g * scale + 0.5f);
+    uint32_t bm = uint32_t(b * scale + 0.5f);
+    return rm | (gm << 9) | (bm << 18) | (uint32_t(exponent) << 27);
+}
+
+static inline vec3 RGB9E5ToFloat(uint32_t packed)
+{
+    float scale = BitsFloat(uint32_t(int(packed >> 27) - 15 - 9 + 127) << 23);
+    return vec3(float(packed & 0x1ff), float((packed >> 9) & 0x1ff),
+                float((packed >> 18) & 0x1ff)) * scale;
+}
+
+static inline unsigned char FloatToByte(float value)
+{
+    return (unsigned char) (std::min(std::max(0.f, value), 1.f) * 255.f + 0.5f);
+}
+
+void ImageBuffer::EncodePixels(PixelFormat format, const vec3 *colours, int count,
+                               unsigned char *pixels)
+{
+    const float *in = &colours[0].r;
+    int i = 0;
+
+    switch (format)
+    {
+    case FORMAT_RGB32F:
+        memcpy(pixels, colours, count * sizeof(vec3));
+        break;
+
+    case FORMAT_RGBA16F:
+    {
+        uint16_t *out = (uint16_t *) pixels;
+#ifdef USE_SSE2
+        // four pixels at a time, twelve floats become sixteen halves
+        for (; i + 4 <= count; i += 4, in += 12, out += 16)
+        {
+            __m128 one = _mm_set1_ps(1.f);
+            __m128 a = _mm_loadu_ps(in), b = _mm_loadu_ps(in + 4), c = _mm_loadu_ps(in + 8);
+            // a = r0 g0 b0 r1, b = g1 b1 r2 g2, c = b2 r3 g3 b3
+            __m128 p0 = _mm_shuffle_ps(a, _mm_unpacklo_ps(_mm_shuffle_ps(a, a, _MM_SHUFFLE(2, 2, 2, 2)), one),
+                                       _MM_SHUFFLE(1, 0, 1, 0));
+            __m128 p1 = _mm_shuffle_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(0, 0, 3, 3)),
+                                       _mm_unpackhi_ps(_mm_shuffle_ps(b, b, _MM_SHUFFLE(1, 1, 1, 1)), one),
+                                       _MM_SHUFFLE(1, 0, 2, 0));
+            __m128 p2 = _mm_shuffle_ps(b, _mm_unpacklo_ps(c, one), _MM_SHUFFLE(1, 0, 3, 2));
+            __m128 p3 = _mm_shuffle_ps(c, _mm_unpackhi_ps(_mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 3, 3, 3)), one),
+                                       _MM_SHUFFLE(1, 0, 2, 1));
+            _mm_storeu_si128((__m128i *) out, PackHalves(FloatToHalf4(p0), FloatToHalf4(p1)));
+            _mm_storeu_si128((__m128i *) (out + 8), PackHalves(FloatToHalf4(p2), FloatToHalf4(p3)));
+        }
+#endif
+        for (; i < count; ++i, in += 3, out += 4)
+        {
+            out[0] = FloatToHalf(in[0]);
+            out[1] = FloatToHalf(in[1]);
+            out[2] = FloatToHalf(in[2]);
+            out[3] = 0x3c00;   // 1.0
+        }
+        break;
+    }
+
+    case FORMAT_RGB9E5:
+    {
+        uint32_t *out = (uint32_t *) pixels;
+        for (; i < count; ++i)
+            out[i] = FloatToRGB9E5(colours[i]);
+        break;
+    }
+
+    case FORMAT_RGBA8:
+    {
+        unsigned char *out = pixels;
+#ifdef USE_SSE2
+        // quantize four pixels at a time, then spread the twelve bytes out
+        // to RGBA
+        for (; i + 4 <= count; i += 4, in += 12, out += 16)
+        {
+            __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.f);
+            __m128 scale = _mm_set1_ps(255.f), half = _mm_set1_ps(0.5f);
+            __m128i q[3];
+            for (int k = 0; k < 3; ++k)
+            {
+                // max before min so NaN comes out as zero
+                __m128 v = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(in + 4*k), zero), one);
+                q[k] = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(v, scale), half));
+            }
+            __m128i bytes = _mm_packus_epi16(_mm_packs_epi32(q[0], q[1]),
+                                             _mm_packs_epi32(q[2], q[2]));
+            unsigned char packed[16];
+            _mm_storeu_si128((__m128i *) packed, bytes);
+            for (int k = 0; k < 4; ++k)
+            {
+                out[4*k]     = packed[3*k];
+                out[4*k + 1] = packed[3*k + 1];
+                out[4*k + 2] = packed[3*k + 2];
+                out[4*k + 3] = 255;
+            }
+        }
+#endif
+        for (; i < count; ++i, in += 3, out += 4)
+        {
+            out[0] = FloatToByte(in[0]);
+            out[1] = FloatToByte(in[1]);
+            out[2] = FloatToByte(in[2]);
+            out[3] = 255;
+        }
+        break;
+    }
+    }
+}
+
+void ImageBuffer::DecodePixels(PixelFormat format, const unsigned char *pixels, int count,
+                               vec3 *colours)
+{
+    switch (format)
+    {
+    case FORMAT_RGB32F:
+        memcpy(colours, pixels, count * sizeof(vec3));
+        break;
+
+    case FORMAT_RGBA16F:
+    {
+        const uint16_t *in = (const uint16_t *) pixels;
+        for (int i = 0; i < count; ++i, in += 4)
+            colours[i] = vec3(HalfToFloat(in[0]), HalfToFloat(in[1]), HalfToFloat(in[2]));
+        break;
+    }
+
+    case FORMAT_RGB9E5:
+    {
+        const uint32_t *in = (const uint32_t *) pixels;
+        for (int i = 0; i < count; ++i)
+            colours[i] = RGB9E5ToFloat(in[i]);
+        break;
+    }
+
+    case FORMAT_RGBA8:
+        for (int i = 0; i < count; ++i, pixels += 4)
+            colours[i] = vec3(pixels[0], pixels[1], pixels[2]) * (1.f / 255.f);
+        break;
+    }
+}
+
 // --------------------------------------------------------------------------
 
 ImageBuffer::ImageBuffer()
     : m_textureName(0), m_framebufferObject(0),
-      m_width(0), m_height(0), m_modified(false), destroyed(false)
+      m_uploadIndex(0), m_width(0), m_height(0), m_format(FORMAT_RGB32F),
+      m_pixelSize(PixelSize(FORMAT_RGB32F)), m_tilesX(0), m_tilesY(0),
+      m_exposure(1.f), m_transfer(TRANSFER_NONE), m_gamma(2.2f),
+      m_pngLevel(PNG_DEFAULT), destroyed(false)
 {
+    for (int i = 0; i < UPLOAD_BUFFERS; ++i)
+    {
+        m_uploadBuffers[i] = 0;
+        m_uploadFences[i] = 0;
+    }
 }
 
 ImageBuffer::~ImageBuffer()
@@ -68,19 +373,53 @@ ImageBuffer::~ImageBuffer()
             glDeleteFramebuffers(1, &m_framebufferObject);
         if (m_textureName)
             glDeleteTextures(1, &m_textureName);
+        DestroyUploadBuffers();
     }
 }
 
+void ImageBuffer::DestroyUploadBuffers()
+{
+    for (int i = 0; i < UPLOAD_BUFFERS; ++i)
+    {
+        if (m_uploadFences[i])
+            glDeleteSync(m_uploadFences[i]);
+        m_uploadFences[i] = 0;
+    }
+    if (m_uploadBuffers[0])
+        glDeleteBuffers(UPLOAD_BUFFERS, m_uploadBuffers);
+    for (int i = 0; i < UPLOAD_BUFFERS; ++i)
+        m_uploadBuffers[i] = 0;
+}
+
+// number of dirty bits packed into each word
+static const int TILE_BITS = 32;
+
 void ImageBuffer::ResetModified()
 {
-    m_modified = false;
-    m_modifiedLower = m_height;
-    m_modifiedUpper = 0;
+    int words = (m_tilesX * m_tilesY + TILE_BITS - 1) / TILE_BITS;
+    for (int i = 0; i < words; ++i)
+        m_dirtyTiles[i].store(0, memory_order_relaxed);
+}
+
+// flag every tile overlapping pixels [x0,x1) x [y0,y1) as modified
+void ImageBuffer::MarkModified(int x0, int y0, int x1, int y1)
+{
+    int tx0 = x0 / TILE_SIZE, tx1 = (x1 - 1) / TILE_SIZE;
+    int ty0 = y0 / TILE_SIZE, ty1 = (y1 - 1) / TILE_SIZE;
+
+    for (int ty = ty0; ty <= ty1; ++ty)
+        for (int tx = tx0; tx <= tx1; ++tx)
+        {
+            // release so that Render() sees the pixels written before this
+            int tile = ty * m_tilesX + tx;
+            m_dirtyTiles[tile / TILE_BITS].fetch_or(1u << (tile % TILE_BITS),
+                                                    memory_order_release);
+        }
 }
 
 // --------------------------------------------------------------------------
 
-bool ImageBuffer::Initialize()
+bool ImageBuffer::Initialize(PixelFormat format)
 {
     // retrieve the current viewport size
     GLint viewport[4];
@@ -89,24 +428,48 @@ bool ImageBuffer::Initialize()
     m_height = viewport[3];
 
     // allocate image data
-    m_imageData.resize(m_width * m_height);
-    for (int i = 0, k = 0; i < m_height; ++i)
-        for (int j = 0; j < m_width; ++j, ++k)
+    m_format = format;
+    m_pixelSize = PixelSize(format);
+    m_imageData.resize(size_t(m_width) * m_height * m_pixelSize);
+    vector<vec3> row(m_width);
+    for (int i = 0, k = 0; i < m_height; ++i, k += m_width)
+    {
+        for (int j = 0; j < m_width; ++j)
         {
             int p = (i >> 4) + (j >> 4);
             float c = 0.2f + ((p & 1) ? 0.1f : 0.0f);
-            m_imageData[k] = vec3(c);
+            row[j] = vec3(c);
         }
+        EncodePixels(m_format, &row[0], m_width, &m_imageData[k * m_pixelSize]);
+    }
+
+    // allocate the dirty bits, one per tile
+    m_tilesX = (m_width + TILE_SIZE - 1) / TILE_SIZE;
+    m_tilesY = (m_height + TILE_SIZE - 1) / TILE_SIZE;
+    int words = (m_tilesX * m_tilesY + TILE_BITS - 1) / TILE_BITS;
+    m_dirtyTiles.reset(new atomic<unsigned>[words]);
 
     // allocate texture object
     if (!m_textureName)
         glGenTextures(1, &m_textureName);
     glBindTexture(GL_TEXTURE_RECTANGLE, m_textureName);
-    glTexImage2D(GL_TEXTURE_RECTANGLE, 0, GL_RGB, m_width, m_height, 0, GL_RGB,
-                 GL_FLOAT, &m_imageData[0]);
+    const FormatInfo &info = FORMATS[m_format];
+    glTexImage2D(GL_TEXTURE_RECTANGLE, 0, info.internalFormat, m_width, m_height, 0,
+                 info.format, info.type, &m_imageData[0]);
     glBindTexture(GL_TEXTURE_RECTANGLE, 0);
     ResetModified();
 
+    // allocate the upload buffers, each big enough to stage the whole image
+    DestroyUploadBuffers();
+    glGenBuffers(UPLOAD_BUFFERS, m_uploadBuffers);
+    for (int i = 0; i < UPLOAD_BUFFERS; ++i)
+    {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, m_uploadBuffers[i]);
+        glBufferData(GL_PIXEL_UNPACK_BUFFER, m_imageData.size(), 0, GL_STREAM_DRAW);
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    m_uploadIndex = 0;
+
     // allocate framebuffer object
     if (!m_framebufferObject)
         glGenFramebuffers(1, &m_framebufferObject);
@@ -131,6 +494,7 @@ bool ImageBuffer::Destroy()
             glDeleteFramebuffers(1, &m_framebufferObject);
         if (m_textureName)
             glDeleteTextures(1, &m_textureName);
+        DestroyUploadBuffers();
         destroyed = true;
     }
     return destroyed;
@@ -141,12 +505,33 @@ bool ImageBuffer::Destroy()
 void ImageBuffer::SetPixel(int x, int y, vec3 colour)
 {
     int index = y * m_width + x;
-    m_imageData[index] = colour;
+    EncodePixels(m_format, &colour, 1, &m_imageData[index * m_pixelSize]);
 
     // mark that something was changed
-    m_modified = true;
-    m_modifiedLower = std::min(m_modifiedLower, y);
-    m_modifiedUpper = std::max(m_modifiedUpper, y+1);
+    MarkModified(x, y, x+1, y+1);
+}
+
+vec3 ImageBuffer::GetPixel(int x, int y) const
+{
+    vec3 colour;
+    DecodePixels(m_format, &m_imageData[(y * m_width + x) * m_pixelSize], 1, &colour);
+    return colour;
+}
+
+void ImageBuffer::SetTile(int x, int y, int width, int height, const vec3 *colours)
+{
+    // clip the block to the image
+    int x0 = std::max(x, 0), x1 = std::min(x + width, m_width);
+    int y0 = std::max(y, 0), y1 = std::min(y + height, m_height);
+    if (x0 >= x1 || y0 >= y1) return;
+
+    for (int j = y0; j < y1; ++j)
+    {
+        const vec3 *row = colours + (j - y) * width + (x0 - x);
+        EncodePixels(m_format, row, x1 - x0, &m_imageData[(j * m_width + x0) * m_pixelSize]);
+    }
+
+    MarkModified(x0, y0, x1, y1);
 }
 
 // --------------------------------------------------------------------------
@@ -155,20 +540,100 @@ void ImageBuffer::Render()
 {
     if (!m_framebufferObject) return;
 
+    // collect and clear the dirty bits, the acquire pairs with the release in
+    // MarkModified() so the pixels of each flagged tile are visible here
+    int tileCount = m_tilesX * m_tilesY;
+    vector<unsigned> dirty((tileCount + TILE_BITS - 1) / TILE_BITS);
+    bool modified = false;
+    for (size_t i = 0; i < dirty.size(); ++i)
+    {
+        dirty[i] = m_dirtyTiles[i].exchange(0, memory_order_acquire);
+        modified = modified || dirty[i];
+    }
+
     // check for modifications to the image data and update texture as needed
-    if (m_modified)
+    if (modified)
     {
-        int sizeY = m_modifiedUpper - m_modifiedLower;
-        int index = m_modifiedLower * m_width;
+        // gather the changed tiles, with runs of neighbouring tiles on a row
+        // merged into one rectangle
+        vector<ivec4> regions;
+        for (int ty = 0; ty < m_tilesY; ++ty)
+            for (int tx = 0; tx < m_tilesX; )
+            {
+                int tile = ty * m_tilesX + tx;
+                if (!(dirty[tile / TILE_BITS] & (1u << (tile % TILE_BITS))))
+                {
+                    ++tx;
+                    continue;
+                }
+
+                int run = tx;
+                for (++tile; run + 1 < m_tilesX &&
+                             (dirty[tile / TILE_BITS] & (1u << (tile % TILE_BITS))); ++tile)
+                    ++run;
+
+                int x0 = tx * TILE_SIZE, x1 = std::min((run + 1) * TILE_SIZE, m_width);
+                int y0 = ty * TILE_SIZE, y1 = std::min((ty + 1) * TILE_SIZE, m_height);
+                regions.push_back(ivec4(x0, y0, x1 - x0, y1 - y0));
+                tx = run + 1;
+            }
+
+        // take the next upload buffer, waiting only if the copy issued from
+        // it UPLOAD_BUFFERS frames ago is somehow still pending
+        GLuint buffer = m_uploadBuffers[m_uploadIndex];
+        GLsync &fence = m_uploadFences[m_uploadIndex];
+        m_uploadIndex = (m_uploadIndex + 1) % UPLOAD_BUFFERS;
+        if (fence)
+        {
+            glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+            glDeleteSync(fence);
+            fence = 0;
+        }
+
+        // pack the regions one after the other into the mapped buffer, the
+        // regions don't overlap so together they never exceed the image
+        size_t bytes = 0;
+        for (size_t i = 0; i < regions.size(); ++i)
+            bytes += size_t(regions[i].z) * regions[i].w * m_pixelSize;
+
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer);
+        unsigned char *staging = (unsigned char *) glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, bytes,
+            GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+        if (staging)
+        {
+            for (size_t i = 0; i < regions.size(); ++i)
+            {
+                const ivec4 &r = regions[i];
+                size_t rowBytes = size_t(r.z) * m_pixelSize;
+                for (int j = 0; j < r.w; ++j, staging += rowBytes)
+                    memcpy(staging, &m_imageData[((r.y + j) * m_width + r.x) * m_pixelSize],
+                           rowBytes);
+            }
+            glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+        }
 
-        // bind texture and copy only the rows that have been changed
+        // bind texture and copy the regions out of the upload buffer, the
+        // pointer argument is an offset into it
+        const FormatInfo &info = FORMATS[m_format];
         glBindTexture(GL_TEXTURE_RECTANGLE, m_textureName);
-        glTexSubImage2D(GL_TEXTURE_RECTANGLE, 0, 0, m_modifiedLower, m_width,
-                        sizeY, GL_RGB, GL_FLOAT, &m_imageData[index]);
+        size_t offset = 0;
+        for (size_t i = 0; staging && i < regions.size(); ++i)
+        {
+            const ivec4 &r = regions[i];
+            glTexSubImage2D(GL_TEXTURE_RECTANGLE, 0, r.x, r.y, r.z, r.w,
+                            info.format, info.type, (const GLvoid *) offset);
+            offset += size_t(r.z) * r.w * m_pixelSize;
+        }
         glBindTexture(GL_TEXTURE_RECTANGLE, 0);
-
-        // mark that we've updated the texture
-        ResetModified();
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+        // a buffer that failed to map leaves its tiles to be sent next time
+        if (!staging)
+            for (size_t i = 0; i < regions.size(); ++i)
+                MarkModified(regions[i].x, regions[i].y,
+                             regions[i].x + regions[i].z, regions[i].y + regions[i].w);
+        else
+            fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
     }
 
     // bind the framebuffer object with our texture in it and copy to screen
@@ -181,6 +646,115 @@ void ImageBuffer::Render()
 
 // --------------------------------------------------------------------------
 
+// resolution of the transfer table, exposed colours are looked up in it
+// after being clamped to [0,1]
+static const int TRANSFER_TABLE_SIZE = 4096;
+
+void ImageBuffer::SetSaveLevel(PngLevel level)
+{
+    m_pngLevel = level;
+}
+
+void ImageBuffer::SetSaveExposure(float stops)
+{
+    m_exposure = exp2(stops);
+}
+
+void ImageBuffer::SetSaveTransfer(Transfer transfer, float gamma)
+{
+    m_transfer = transfer;
+    m_gamma = gamma;
+
+    // without a curve values are scaled to bytes directly
+    m_transferTable.clear();
+    if (transfer == TRANSFER_NONE) return;
+
+    m_transferTable.resize(TRANSFER_TABLE_SIZE);
+    for (int i = 0; i < TRANSFER_TABLE_SIZE; ++i)
+    {
+        float v = i / float(TRANSFER_TABLE_SIZE - 1);
+        if (transfer == TRANSFER_SRGB)
+            v = v <= 0.0031308f ? 12.92f * v : 1.055f * pow(v, 1.f / 2.4f) - 0.055f;
+        else
+            v = pow(v, 1.f / gamma);
+        m_transferTable[i] = (unsigned char) (v * 255.f + 0.5f);
+    }
+}
+
+// scale and clamp count floats, then either truncate them to bytes or round
+// them to an index into the transfer table
+static void QuantizeFloats(const float *in, int count, float exposure,
+                           const unsigned char *table, unsigned char *out)
+{
+    float limit = table ? float(TRANSFER_TABLE_SIZE - 1) : 255.f;
+    float scale = limit * exposure;
+    float bias = table ? 0.5f : 0.f;
+    int i = 0;
+
+#ifdef USE_SSE2
+    __m128 vScale = _mm_set1_ps(scale), vLimit = _mm_set1_ps(limit);
+    __m128 vBias = _mm_set1_ps(bias), zero = _mm_setzero_ps();
+    for (; i + 16 <= count; i += 16)
+    {
+        __m128i q[4];
+        for (int k = 0; k < 4; ++k)
+        {
+            // max before min so NaN comes out as zero
+            __m128 v = _mm_mul_ps(_mm_loadu_ps(in + i + 4*k), vScale);
+            v = _mm_min_ps(_mm_max_ps(v, zero), vLimit);
+            q[k] = _mm_cvttps_epi32(_mm_add_ps(v, vBias));
+        }
+
+        if (table)
+        {
+            int index[16];
+            for (int k = 0; k < 4; ++k)
+                _mm_storeu_si128((__m128i *) (index + 4*k), q[k]);
+            for (int k = 0; k < 16; ++k)
+                out[i + k] = table[index[k]];
+        }
+        else
+            _mm_storeu_si128((__m128i *) (out + i),
+                             _mm_packus_epi16(_mm_packs_epi32(q[0], q[1]),
+                                              _mm_packs_epi32(q[2], q[3])));
+    }
+#endif
+
+    for (; i < count; ++i)
+    {
+        int q = int(std::min(std::max(0.f, in[i] * scale), limit) + bias);
+        out[i] = table ? table[q] : (unsigned char) q;
+    }
+}
+
+// convert the image to 8 bit RGB with the save exposure and transfer curve,
+// rows are split between threads and optionally flipped top to bottom
+void ImageBuffer::Quantize(unsigned char *pixels, bool flip)
+{
+    const unsigned char *table = m_transferTable.empty() ? 0 : &m_transferTable[0];
+
+    ParallelFor(m_height, 64, [&](int begin, int end)
+    {
+        vector<vec3> decoded(m_format == FORMAT_RGB32F ? 0 : m_width);
+        for (int y = begin; y < end; ++y)
+        {
+            const unsigned char *row = &m_imageData[size_t(y) * m_width * m_pixelSize];
+            const float *in = (const float *) row;
+            if (m_format != FORMAT_RGB32F)
+            {
+                DecodePixels(m_format, row, m_width, &decoded[0]);
+                in = &decoded[0].r;
+            }
+
+            int target = flip ? m_height - 1 - y : y;
+            QuantizeFloats(in, 3 * m_width, m_exposure, table,
+                           pixels + size_t(target) * m_width * 3);
+        }
+    });
+}
+
+// --------------------------------------------------------------------------
+
 bool ImageBuffer::SaveToFile(const string &imageFileName)
 {
     if (m_width == 0 || m_height == 0)
@@ -189,6 +763,28 @@ bool ImageBuffer::SaveToFile(const string &imageFileName)
         return false;
     }
     cout << "ImageBuffer saving image to " << imageFileName << "..." << endl;
+    TimelineScope scope("SaveToFile", "width", m_width, "height", m_height);
+
+    // PFM and EXR files keep the float colours, exposure and curves aside
+    if (IsHdrFileName(imageFileName))
+    {
+        HdrWriter *writer = CreateHdrWriter(imageFileName, m_width, m_height);
+        if (!writer) return false;
+
+        vector<vec3> row(m_width);
+        bool written = true;
+        for (int y = m_height - 1; y >= 0 && written; --y)
+        {
+            DecodePixels(m_format, &m_imageData[size_t(y) * m_width * m_pixelSize], m_width, &row[0]);
+            written = writer->WriteRows(&row[0], 1);
+        }
+        written = writer->Close() && written;
+        delete writer;
+
+        if (!written)
+            cout << "Failed to write image " << imageFileName << endl;
+        return written;
+    }
 
 	#ifdef USE_IMAGEMAGICK
 		using namespace Magick;
@@ -197,11 +793,10 @@ bool ImageBuffer::SaveToFile(const string &imageFileName)
 		Image myImage(Geometry(m_width, m_height), "black");
 
 		// copy the image data from our memory buffer into the Magick++ one.
-		int index = 0;
 		for (int i = m_height-1; i >= 0; --i)
 			for (int j = 0; j < m_width; ++j)
 			{
-				vec3 v = m_imageData[index++];
+				vec3 v = GetPixel(j, m_height-1 - i);
 				vec3 c = clamp(v, 0.f, 1.f) * float(MaxRGB);
 				Color colour(c.r, c.g, c.b);
 				myImage.pixelColor(j, i, colour);
@@ -229,11 +824,10 @@ bool ImageBuffer::SaveToFile(const string &imageFileName)
 			return false;
 		}
 		RGBQUAD colour;
-		int index = 0;
 		for (int i = 0; i < m_height; ++i)
 			for (int j = 0; j < m_width; ++j)
 			{
-				vec3 v = m_imageData[index++];
+				vec3 v = GetPixel(j, i);
 				vec3 c = clamp(v, 0.f, 1.f) * 255.0f;
 				colour.rgbRed = (BYTE)c.r;
 				colour.rgbGreen = (BYTE)c.g;
@@ -256,32 +850,21 @@ bool ImageBuffer::SaveToFile(const string &imageFileName)
 
 	#ifdef USE_STB
 	const unsigned numComponents = 3; //RGB
-	unsigned char* pixels = new unsigned char[m_width*m_height*numComponents];
-
-	for (int y = 0; y < m_height; ++y)
-		for (int x = 0; x < m_width; ++x)
-		{
-			glm::vec3& color = m_imageData[y * m_width + x];
-			int i = (m_height - 1 - y) * m_width + x;
-			i *= numComponents;
-
-			pixels[i]     = (unsigned char) (255 * clamp(color.r, 0.f, 1.f));	// red
-			pixels[i + 1] = (unsigned char) (255 * clamp(color.g, 0.f, 1.f));	// green
-			pixels[i + 2] = (unsigned char) (255 * clamp(color.b, 0.f, 1.f));	// blue
-		}
+	m_saveBuffer.resize(size_t(m_width) * m_height * numComponents);
+	{
+		TimelineScope convert("convert image");
+		Quantize(&m_saveBuffer[0], true);
+	}
 
-	// Save the image to disk
-	int stride = 0;
-	if (!stbi_write_png(imageFileName.data(), m_width, m_height, numComponents, pixels, stride))
+	// Save the image to disk, compressing bands of rows in parallel
+	if (!WritePng(imageFileName, m_width, m_height, numComponents, &m_saveBuffer[0], m_pngLevel))
 	{
-		// Fail! delete and exit
-		cout << "STB failed to write image " << imageFileName << endl;
-		delete[] pixels;
+		// Fail! exit
+		cout << "Failed to write image " << imageFileName << endl;
 		return false;
 	}
 
-	//success, delete and exit
-	delete[] pixels;
+	//success, exit
 	return true;
 	#endif
 
@@ -17,7 +17,10 @@
 
 #include <vector>
 #include <string>
+#include <atomic>
+#include <memory>
 #include <glm/vec3.hpp>
+#include "PngWriter.h"
 
 // Specify that we want the OpenGL core profile before including GLFW headers
 #ifndef LAB_LINUX
@@ -35,22 +38,76 @@
 
 class ImageBuffer
 {
+public:
+    // storage formats for the pixel data, each uploaded to the texture as
+    // stored so the upload moves no more bytes than the buffer holds:
+    //  - RGB32F keeps full floats, 12 bytes per pixel
+    //  - RGBA16F stores half floats, 8 bytes per pixel
+    //  - RGB9E5 stores HDR colour with a shared exponent, 4 bytes per pixel
+    //  - RGBA8 quantizes the display values to bytes for previews, the
+    //    colours are already gamma encoded so no sRGB transform is applied
+    enum PixelFormat { FORMAT_RGB32F, FORMAT_RGBA16F, FORMAT_RGB9E5, FORMAT_RGBA8 };
+
+    // convert count colours to or from a storage format, packed tightly
+    static void EncodePixels(PixelFormat format, const glm::vec3 *colours, int count,
+                             unsigned char *pixels);
+    static void DecodePixels(PixelFormat format, const unsigned char *pixels, int count,
+                             glm::vec3 *colours);
+
+    // bytes taken by a single pixel in a storage format
+    static int PixelSize(PixelFormat format);
+
+    // curves applied to colours when they are saved as 8 bit images:
+    //  - NONE writes the values as they are, like the screen shows them
+    //  - SRGB and GAMMA encode linear colours for display
+    enum Transfer { TRANSFER_NONE, TRANSFER_SRGB, TRANSFER_GAMMA };
+
+private:
     // OpenGL texture corresponding to our image, and an FBO to render it
     GLuint  m_textureName;
     GLuint  m_framebufferObject;
 
-    // dimensions of our image, and the pixel colour data array
+    // pixel buffer objects the changed tiles are staged in, used in turn so
+    // the driver can copy one into the texture while the next is filled,
+    // each with a fence marking when its last copy has finished
+    static const int UPLOAD_BUFFERS = 3;
+    GLuint  m_uploadBuffers[UPLOAD_BUFFERS];
+    GLsync  m_uploadFences[UPLOAD_BUFFERS];
+    int     m_uploadIndex;
+
+    // dimensions of our image, and the pixel data array in m_format
     int     m_width, m_height;
-    std::vector<glm::vec3> m_imageData;
+    PixelFormat m_format;
+    int     m_pixelSize;
+    std::vector<unsigned char> m_imageData;
+
+    // one dirty bit per TILE_SIZE square tile, packed into words that render
+    // threads set with an atomic OR and Render() swaps back to zero
+    int     m_tilesX, m_tilesY;
+    std::unique_ptr<std::atomic<unsigned> []> m_dirtyTiles;
 
-    // state variables to keep track of modified region
-    bool    m_modified;
-    int     m_modifiedLower, m_modifiedUpper;
+    // exposure and transfer curve used when saving, with the table that maps
+    // exposed colours to bytes under that curve
+    float   m_exposure;
+    Transfer m_transfer;
+    float   m_gamma;
+    std::vector<unsigned char> m_transferTable;
+    PngLevel m_pngLevel;
+
+    // 8 bit RGB copy of the image kept between saves so it is only allocated
+    // when the size changes
+    std::vector<unsigned char> m_saveBuffer;
 
     void ResetModified();
+    void MarkModified(int x0, int y0, int x1, int y1);
+    void Quantize(unsigned char *pixels, bool flip);
+    void DestroyUploadBuffers();
     bool destroyed;
 
 public:
+    // side length in pixels of the tiles that are tracked and uploaded
+    static const int TILE_SIZE = 32;
+
     ImageBuffer();
     ~ImageBuffer();
 
@@ -58,9 +115,12 @@ public:
     int Width() const  { return m_width; }
     int Height() const { return m_height; }
 
+    // returns the storage format of the image
+    PixelFormat Format() const { return m_format; }
+
     // call this after your OpenGL context is all set up to create an image
     // buffer that matches the size of your viewport
-    bool Initialize();
+    bool Initialize(PixelFormat format = FORMAT_RGB32F);
     bool Destroy();
 
     // set a pixel in this image buffer to a specified colour:
@@ -68,10 +128,30 @@ public:
     //  - colour is RGB given as floating point numbers in the range [0,1]
     void SetPixel(int x, int y, glm::vec3 colour);
 
-    // call this in your render function to copy this image onto your screen
+    // read back a pixel, decoded from the storage format
+    glm::vec3 GetPixel(int x, int y) const;
+
+    // copy a width x height block of colours, stored row by row from its
+    // bottom-left pixel, into the image with that pixel at (x,y):
+    //  - threads may call this and SetPixel at once on pixels that don't
+    //    overlap, without any locking
+    void SetTile(int x, int y, int width, int height, const glm::vec3 *colours);
+
+    // call this in your render function to copy this image onto your screen,
+    // only the tiles written since the last call are uploaded
     void Render();
 
-    // call this at the end of your render to save the image to file
+    // set how hard saved PNG files are compressed
+    void SetSaveLevel(PngLevel level);
+
+    // set how colours are converted to bytes when saving with STB:
+    //  - exposure is in stops, each one doubles the brightness
+    //  - gamma is only used by TRANSFER_GAMMA
+    void SetSaveExposure(float stops);
+    void SetSaveTransfer(Transfer transfer, float gamma = 2.2f);
+
+    // call this at the end of your render to save the image to file, names
+    // ending in .pfm or .exr are saved as float images, anything else as PNG
     bool SaveToFile(const std::string &imageFileName);
 };
 
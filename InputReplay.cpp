@@ -0,0 +1,263 @@
+// ==========================================================================
+// Input Replay Support Code
+//
+// The replay runs as an interactive session would: each batch of events is
+// shown first as a small one ray per pixel preview, then traced again at
+// full size and quality band by band. Latency is measured from the time an
+// event was due to the moment the frame showing it is finished.
+// ==========================================================================
+
+#include "InputReplay.h"
+#include "RayTracer.h"
+#include "FrameWriter.h"
+#include "Parallel.h"
+
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <thread>
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+using namespace glm;
+
+typedef chrono::steady_clock Clock;
+
+// rows of a refined frame traced between checks for new events
+static const int REFINE_BAND = 16;
+
+static double Seconds(Clock::duration duration)
+{
+    return chrono::duration<double>(duration).count();
+}
+
+// --------------------------------------------------------------------------
+// Recording
+
+bool InputRecorder::Open(const string &fileName)
+{
+    m_file.open(fileName.c_str());
+    if (!m_file)
+    {
+        cout << "InputReplay ERROR: Could not create " << fileName << endl;
+        return false;
+    }
+    m_file << "# time key scancode action mods" << endl;
+    m_file << fixed << setprecision(6);
+    m_start = Clock::now();
+    return true;
+}
+
+void InputRecorder::Record(int key, int scancode, int action, int mods)
+{
+    if (!m_file.is_open())
+        return;
+    m_file << Seconds(Clock::now() - m_start) << " " << key << " " << scancode << " "
+           << action << " " << mods << endl;
+}
+
+bool LoadInputEvents(const string &fileName, vector<InputEvent> &events)
+{
+    ifstream file(fileName.c_str());
+    if (!file)
+    {
+        cout << "InputReplay ERROR: Could not open " << fileName << endl;
+        return false;
+    }
+
+    events.clear();
+    string line;
+    for (int number = 1; getline(file, line); ++number)
+    {
+        if (line.empty() || line[0] == '#')
+            continue;
+
+        istringstream fields(line);
+        InputEvent event;
+        if (!(fields >> event.time >> event.key >> event.scancode >> event.action >> event.mods))
+        {
+            cout << "InputReplay ERROR: Bad event on line " << number << " of " << fileName << endl;
+            return false;
+        }
+        events.push_back(event);
+    }
+
+    stable_sort(events.begin(), events.end(), [](const InputEvent &a, const InputEvent &b)
+    {
+        return a.time < b.time;
+    });
+    return true;
+}
+
+// --------------------------------------------------------------------------
+// Report
+
+// nearest rank percentile of sorted values
+static double Percentile(const vector<double> &sorted, double percent)
+{
+    size_t rank = size_t(ceil(percent / 100 * sorted.size()));
+    return sorted[std::max<size_t>(rank, 1) - 1];
+}
+
+// percentiles and a histogram with power of two millisecond buckets
+static void PrintLatencies(const char *label, vector<double> latencies)
+{
+    cout << label << ": ";
+    if (latencies.empty())
+    {
+        cout << "no events" << endl;
+        return;
+    }
+
+    sort(latencies.begin(), latencies.end());
+    cout << latencies.size() << " events, p50 " << 1000 * Percentile(latencies, 50)
+         << " ms, p95 " << 1000 * Percentile(latencies, 95)
+         << " ms, p99 " << 1000 * Percentile(latencies, 99)
+         << " ms, max " << 1000 * latencies.back() << " ms" << endl;
+
+    // bucket b holds latencies below 2^b ms, the last one everything above
+    const int BUCKETS = 14;
+    int counts[BUCKETS] = {};
+    for (size_t i = 0; i < latencies.size(); ++i)
+    {
+        int bucket = 0;
+        while (bucket < BUCKETS - 1 && 1000 * latencies[i] >= double(1 << bucket))
+            ++bucket;
+        counts[bucket]++;
+    }
+
+    int first = 0, last = BUCKETS - 1;
+    while (counts[first] == 0) ++first;
+    while (counts[last] == 0) --last;
+    int most = *max_element(counts, counts + BUCKETS);
+    for (int b = first; b <= last; ++b)
+    {
+        ostringstream range;
+        if (b == BUCKETS - 1)
+            range << ">= " << (1 << (b - 1)) << " ms";
+        else
+            range << "< " << (1 << b) << " ms";
+        cout << "  " << setw(10) << left << range.str() << right << setw(6) << counts[b] << " "
+             << string(size_t(40.0 * counts[b] / most + 0.5), '#') << endl;
+    }
+}
+
+// --------------------------------------------------------------------------
+// Replay
+
+int ReplayInput(const vector<InputEvent> &events, const EventApplier &apply,
+                const ReplaySettings &settings)
+{
+    int width = settings.width, height = settings.height;
+    int previewWidth = std::max(1, width / settings.previewScale);
+    int previewHeight = std::max(1, height / settings.previewScale);
+
+    ThreadPool pool;
+    SceneBlock scene;
+    vec3 eye(0.f);
+    vector<vec3> preview(size_t(previewWidth) * previewHeight), refined(size_t(width) * height);
+    bool refinedAny = false;
+
+    // due times of the events applied but not yet shown in a preview and in
+    // a refined frame
+    vector<Clock::time_point> awaitingPreview, awaitingRefined;
+    vector<double> previewLatency, refinedLatency;
+    int abandoned = 0;
+
+    Clock::time_point start = Clock::now();
+    double firstTime = events.empty() ? 0 : events[0].time;
+    auto due = [&](size_t i)
+    {
+        return start + chrono::duration_cast<Clock::duration>(
+                           chrono::duration<double>(events[i].time - firstTime));
+    };
+
+    size_t next = 0;
+    while (next < events.size() || !awaitingRefined.empty())
+    {
+        // nothing left to draw, so wait for the next event
+        if (awaitingRefined.empty() && settings.recordedPace)
+            this_thread::sleep_until(due(next));
+
+        // apply the events that are due, or just the next one that changes
+        // something when events are not paced
+        Clock::time_point now = Clock::now();
+        bool taken = false;
+        while (next < events.size() && !(settings.recordedPace ? due(next) > now : taken))
+        {
+            if (apply(events[next], scene, eye))
+            {
+                Clock::time_point delivered = settings.recordedPace ? due(next) : now;
+                awaitingPreview.push_back(delivered);
+                awaitingRefined.push_back(delivered);
+                taken = true;
+            }
+            ++next;
+        }
+        if (awaitingRefined.empty())
+            continue;
+
+        RayTracer tracer(scene, eye);
+        if (!awaitingPreview.empty())
+        {
+            pool.ParallelFor(previewHeight, 4, [&](int begin, int end)
+            {
+                tracer.RenderTile(0, begin, previewWidth, end - begin, previewWidth, previewHeight,
+                                  &preview[size_t(begin) * previewWidth]);
+            });
+
+            Clock::time_point shown = Clock::now();
+            for (size_t i = 0; i < awaitingPreview.size(); ++i)
+                previewLatency.push_back(Seconds(shown - awaitingPreview[i]));
+            awaitingPreview.clear();
+        }
+
+        // refine band by band, giving up as soon as another event is due
+        bool interrupted = false;
+        for (int y = 0; y < height && !interrupted; y += REFINE_BAND)
+        {
+            int rows = std::min(REFINE_BAND, height - y);
+            pool.ParallelFor(rows, 1, [&](int begin, int end)
+            {
+                tracer.RenderTile(0, y + begin, width, end - begin, width, height,
+                                  &refined[size_t(y + begin) * width], settings.samples);
+            });
+            interrupted = settings.recordedPace && next < events.size() && due(next) <= Clock::now();
+        }
+        if (interrupted)
+        {
+            abandoned++;
+            continue;
+        }
+
+        Clock::time_point shown = Clock::now();
+        for (size_t i = 0; i < awaitingRefined.size(); ++i)
+            refinedLatency.push_back(Seconds(shown - awaitingRefined[i]));
+        awaitingRefined.clear();
+        refinedAny = true;
+    }
+
+    cout << "Replayed " << events.size() << " events in " << Seconds(Clock::now() - start)
+         << " s, " << previewLatency.size() << " changed the image, " << abandoned
+         << " refinements given up for newer events" << endl;
+    cout << fixed << setprecision(2);
+    PrintLatencies("Latency to first frame", previewLatency);
+    PrintLatencies("Latency to refined frame", refinedLatency);
+    cout.unsetf(ios::floatfield);
+
+    if (!settings.outputFile.empty())
+    {
+        if (!refinedAny)
+        {
+            cout << "No frame was rendered, " << settings.outputFile << " not saved" << endl;
+            return -1;
+        }
+        if (!SaveFrame(settings.outputFile, width, height, &refined[0]))
+            return -1;
+        cout << "Saved the last refined frame to " << settings.outputFile << endl;
+    }
+    return 0;
+}
+
+// --------------------------------------------------------------------------
@@ -0,0 +1,87 @@
+// ==========================================================================
+// Input Replay Support Code
+//  - records the key events the window receives to a text file, one
+//    "time key scancode action mods" line per event
+//  - replays them against the CPU renderer without a window and reports how
+//    long each event took to reach the screen, first as a quick preview
+//    frame and then as a fully refined one
+// ==========================================================================
+#ifndef INPUTREPLAY_H
+#define INPUTREPLAY_H
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <functional>
+#include <chrono>
+#include <glm/vec3.hpp>
+#include "Scene.h"
+
+// one call of the window's key callback, time is in seconds from the start
+// of the recording
+struct InputEvent
+{
+    double  time;
+    int     key, scancode, action, mods;
+};
+
+// --------------------------------------------------------------------------
+// Writes events as they happen, each line is flushed so a recording
+// survives the program being killed
+
+class InputRecorder
+{
+    std::ofstream                           m_file;
+    std::chrono::steady_clock::time_point   m_start;
+
+public:
+    // start a new recording, returns false if the file can't be created
+    bool Open(const std::string &fileName);
+    bool IsOpen() const { return m_file.is_open(); }
+
+    void Record(int key, int scancode, int action, int mods);
+};
+
+// read a recording, returns false if it can't be read or a line is not an
+// event; events are sorted by time
+bool LoadInputEvents(const std::string &fileName, std::vector<InputEvent> &events);
+
+// --------------------------------------------------------------------------
+// Replay
+
+// applies an event to the program's state the way the window does, and
+// returns true if it changes the image, with the packed scene and camera to
+// render it from
+typedef std::function<bool(const InputEvent &event, SceneBlock &scene, glm::vec3 &eye)>
+    EventApplier;
+
+struct ReplaySettings
+{
+    int         width, height;
+
+    // rays per pixel of a refined frame, see RayTracer::RenderTile()
+    int         samples;
+
+    // the preview frame is traced at 1/previewScale of the width and height
+    // with one ray per pixel
+    int         previewScale;
+
+    // deliver events at their recorded times, otherwise each one as soon as
+    // the frames of the one before are finished
+    bool        recordedPace;
+
+    // file the last refined frame is saved to, none if empty
+    std::string outputFile;
+};
+
+// replay the events, returns the process exit code:
+//  - events due while a frame is traced wait for it, then all of them are
+//    applied before the next preview
+//  - refinement is given up when another event is due, so an event's
+//    refined latency runs to the first refined frame that includes it
+//  - events that change nothing on screen are left out of the report
+int ReplayInput(const std::vector<InputEvent> &events, const EventApplier &apply,
+                const ReplaySettings &settings);
+
+// --------------------------------------------------------------------------
+#endif // INPUTREPLAY_H
@@ -0,0 +1,201 @@
+// ==========================================================================
+// Local Socket Support Code
+//
+// A message is a 32 bit type and a 32 bit payload length followed by the
+// payload. Both ends are the same program on the same machine, so headers
+// and payload structures are sent in native byte order.
+// ==========================================================================
+
+#include "LocalSocket.h"
+
+#include <cstring>
+#include <cerrno>
+
+#ifndef _WIN32
+	#include <unistd.h>
+	#include <fcntl.h>
+	#include <signal.h>
+	#include <sys/socket.h>
+	#include <sys/time.h>
+	#include <sys/un.h>
+#endif
+
+using namespace std;
+
+#ifdef _WIN32
+
+// --------------------------------------------------------------------------
+
+int ListenLocal(const string &, int) { return -1; }
+int ConnectLocal(const string &) { return -1; }
+int AcceptLocal(int) { return -1; }
+void CloseLocal(int) {}
+bool SetLocalTimeouts(int, int, int) { return false; }
+int LocalPeerProcess(int) { return -1; }
+
+bool SendMessage(int, uint32_t, const void *, size_t, const void *, size_t, uint32_t)
+{
+    return false;
+}
+
+bool ReceiveMessage(int, uint32_t &, vector<unsigned char> &, uint32_t)
+{
+    return false;
+}
+
+#else
+
+// --------------------------------------------------------------------------
+
+static bool SocketAddress(const string &socketName, sockaddr_un &address)
+{
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (socketName.size() >= sizeof(address.sun_path))
+        return false;
+    strcpy(address.sun_path, socketName.c_str());
+    return true;
+}
+
+// a peer that has gone away shows up as a failed send rather than SIGPIPE,
+// and sockets are not inherited by child processes
+static int NewSocket()
+{
+    signal(SIGPIPE, SIG_IGN);
+    int socket = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (socket >= 0)
+        fcntl(socket, F_SETFD, FD_CLOEXEC);
+    return socket;
+}
+
+int ListenLocal(const string &socketName, int backlog)
+{
+    sockaddr_un address;
+    if (!SocketAddress(socketName, address))
+        return -1;
+
+    int socket = NewSocket();
+    unlink(socketName.c_str());
+    if (socket >= 0 && (::bind(socket, (sockaddr *) &address, sizeof(address)) != 0 ||
+                        listen(socket, backlog) != 0))
+    {
+        close(socket);
+        return -1;
+    }
+    return socket;
+}
+
+int ConnectLocal(const string &socketName)
+{
+    sockaddr_un address;
+    if (!SocketAddress(socketName, address))
+        return -1;
+
+    int socket = NewSocket();
+    if (socket >= 0 && connect(socket, (sockaddr *) &address, sizeof(address)) != 0)
+    {
+        close(socket);
+        return -1;
+    }
+    return socket;
+}
+
+int AcceptLocal(int listener)
+{
+    int socket = accept(listener, 0, 0);
+    if (socket >= 0)
+        fcntl(socket, F_SETFD, FD_CLOEXEC);
+    return socket;
+}
+
+void CloseLocal(int socket)
+{
+    if (socket >= 0)
+        close(socket);
+}
+
+static timeval Timeout(int milliseconds)
+{
+    timeval timeout;
+    timeout.tv_sec = milliseconds / 1000;
+    timeout.tv_usec = (milliseconds % 1000) * 1000;
+    return timeout;
+}
+
+bool SetLocalTimeouts(int socket, int receiveMilliseconds, int sendMilliseconds)
+{
+    timeval receive = Timeout(receiveMilliseconds), send = Timeout(sendMilliseconds);
+    return setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &receive, sizeof(receive)) == 0 &&
+           setsockopt(socket, SOL_SOCKET, SO_SNDTIMEO, &send, sizeof(send)) == 0;
+}
+
+int LocalPeerProcess(int socket)
+{
+#ifdef SO_PEERCRED
+    ucred credentials;
+    socklen_t length = sizeof(credentials);
+    if (getsockopt(socket, SOL_SOCKET, SO_PEERCRED, &credentials, &length) == 0)
+        return credentials.pid;
+#else
+    (void) socket;
+#endif
+    return -1;
+}
+
+static bool SendAll(int socket, const void *data, size_t length)
+{
+    const char *bytes = (const char *) data;
+    while (length > 0)
+    {
+        ssize_t sent = send(socket, bytes, length, 0);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent <= 0) return false;
+        bytes += sent;
+        length -= size_t(sent);
+    }
+    return true;
+}
+
+static bool ReceiveAll(int socket, void *data, size_t length)
+{
+    char *bytes = (char *) data;
+    while (length > 0)
+    {
+        ssize_t received = recv(socket, bytes, length, 0);
+        if (received < 0 && errno == EINTR) continue;
+        if (received <= 0) return false;
+        bytes += received;
+        length -= size_t(received);
+    }
+    return true;
+}
+
+bool SendMessage(int socket, uint32_t type, const void *payload, size_t length,
+                 const void *extra, size_t extraLength, uint32_t maxLength)
+{
+    // a longer payload would not fit the header's 32 bit length or would be
+    // refused by the receiver, either way the peer would lose track of where
+    // messages start
+    if (length > maxLength || extraLength > maxLength - length)
+        return false;
+
+    uint32_t header[2] = { type, uint32_t(length + extraLength) };
+    return SendAll(socket, header, sizeof(header)) &&
+           SendAll(socket, payload, length) &&
+           SendAll(socket, extra, extraLength);
+}
+
+bool ReceiveMessage(int socket, uint32_t &type, vector<unsigned char> &payload,
+                    uint32_t maxLength)
+{
+    uint32_t header[2];
+    if (!ReceiveAll(socket, header, sizeof(header)) || header[1] > maxLength)
+        return false;
+    type = header[0];
+    payload.resize(header[1]);
+    return payload.empty() || ReceiveAll(socket, &payload[0], payload.size());
+}
+
+#endif
+
+// --------------------------------------------------------------------------
@@ -0,0 +1,50 @@
+// ==========================================================================
+// Local Socket Support Code
+//  - Unix domain stream sockets carrying typed, length-prefixed messages,
+//    shared by the render farm and the render server
+// ==========================================================================
+#ifndef LOCALSOCKET_H
+#define LOCALSOCKET_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+// largest payload ReceiveMessage() accepts unless told otherwise, well above
+// a 256 x 256 tile of float colours
+const uint32_t MAX_MESSAGE_PAYLOAD = 64u << 20;
+
+// listen on a socket file, replacing a stale one, returns -1 on failure
+int ListenLocal(const std::string &socketName, int backlog);
+
+// connect to a socket file, returns -1 on failure
+int ConnectLocal(const std::string &socketName);
+
+// accept a connection on a listening socket, returns -1 on failure
+int AcceptLocal(int listener);
+
+void CloseLocal(int socket);
+
+// make sends and receives on a socket fail once they have made no progress
+// for the given time, so a stalled peer can't block its end for good
+bool SetLocalTimeouts(int socket, int receiveMilliseconds, int sendMilliseconds);
+
+// process id of the other end of a connected socket, -1 where the system
+// can't tell
+int LocalPeerProcess(int socket);
+
+// send a message: its type and payload length, then the payload, which may
+// come in two pieces so a header struct and a pixel array need no copy;
+// fails without sending anything if the payload is longer than maxLength,
+// which should match what the receiver accepts
+bool SendMessage(int socket, uint32_t type, const void *payload, size_t length,
+                 const void *extra = 0, size_t extraLength = 0,
+                 uint32_t maxLength = MAX_MESSAGE_PAYLOAD);
+
+// receive a whole message, returns false if the connection closed or failed
+// or the payload is longer than maxLength
+bool ReceiveMessage(int socket, uint32_t &type, std::vector<unsigned char> &payload,
+                    uint32_t maxLength = MAX_MESSAGE_PAYLOAD);
+
+// --------------------------------------------------------------------------
+#endif // LOCALSOCKET_H
@@ -0,0 +1,311 @@
+// ==========================================================================
+// Memory Mapped Image Output
+//
+// The file is created at its final size with the header in place, then
+// mapped whole. Tiles are converted straight into the mapping, and finished
+// bands are flushed and dropped from the process with msync() and
+// madvise(), so only the band being rendered stays resident however large
+// the image is. OpenEXR files are written without compression so every
+// scanline chunk has a fixed size and the line offset table can be filled
+// in before any pixel is rendered.
+// ==========================================================================
+
+#include "MappedImage.h"
+#include "HdrWriter.h"
+#include "Timeline.h"
+
+#include <iostream>
+#include <sstream>
+#include <algorithm>
+#include <cstring>
+#include <stdint.h>
+
+#ifdef _WIN32
+	#include <windows.h>
+#else
+	#include <fcntl.h>
+	#include <unistd.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+#endif
+
+using namespace std;
+using namespace glm;
+
+// --------------------------------------------------------------------------
+
+static void PutLittleEndian(unsigned char *out, uint64_t value, int bytes)
+{
+    for (int i = 0; i < bytes; ++i)
+        out[i] = (unsigned char) (value >> (8 * i));
+}
+
+static string Extension(const string &fileName)
+{
+    size_t dot = fileName.find_last_of('.');
+    if (dot == string::npos) return "";
+
+    string extension = fileName.substr(dot + 1);
+    std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+    return extension;
+}
+
+static size_t PageSize()
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwAllocationGranularity;
+#else
+    return size_t(sysconf(_SC_PAGESIZE));
+#endif
+}
+
+// --------------------------------------------------------------------------
+
+MappedImage::MappedImage()
+    : m_width(0), m_height(0), m_format(FORMAT_PPM), m_data(0), m_size(0), m_pixelStart(0)
+#ifdef _WIN32
+    , m_file(INVALID_HANDLE_VALUE), m_mapping(0)
+#else
+    , m_file(-1)
+#endif
+{
+}
+
+MappedImage::~MappedImage()
+{
+    Close();
+}
+
+bool MappedImage::IsMappedFileName(const string &fileName)
+{
+    string extension = Extension(fileName);
+    return extension == "ppm" || extension == "pfm" || extension == "exr";
+}
+
+size_t MappedImage::RowBytes() const
+{
+    // EXR lines start with their y coordinate and data size
+    if (m_format == FORMAT_PPM) return size_t(m_width) * 3;
+    if (m_format == FORMAT_PFM) return size_t(m_width) * 12;
+    return 8 + size_t(m_width) * 12;
+}
+
+size_t MappedImage::RowOffset(int row) const
+{
+    // PFM stores rows from the bottom up, the others from the top down
+    size_t line = m_format == FORMAT_PFM ? row : m_height - 1 - row;
+    return m_pixelStart + line * RowBytes();
+}
+
+bool MappedImage::Map(const string &fileName, bool existing)
+{
+#ifdef _WIN32
+    m_file = CreateFileA(fileName.c_str(), GENERIC_READ | GENERIC_WRITE, 0, 0,
+                         existing ? OPEN_EXISTING : CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, 0);
+    if (m_file == INVALID_HANDLE_VALUE)
+        return false;
+
+    LARGE_INTEGER size;
+    if (existing && (!GetFileSizeEx(m_file, &size) || uint64_t(size.QuadPart) != m_size))
+        return false;
+
+    // creating the mapping extends a new file to its full size
+    m_mapping = CreateFileMappingA(m_file, 0, PAGE_READWRITE,
+                                   DWORD(uint64_t(m_size) >> 32), DWORD(m_size), 0);
+    if (!m_mapping)
+        return false;
+    m_data = (unsigned char *) MapViewOfFile(m_mapping, FILE_MAP_WRITE, 0, 0, m_size);
+    return m_data != 0;
+#else
+    m_file = open(fileName.c_str(), existing ? O_RDWR : O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (m_file < 0)
+        return false;
+
+    struct stat status;
+    if (existing ? fstat(m_file, &status) != 0 || uint64_t(status.st_size) != m_size
+                 : ftruncate(m_file, off_t(m_size)) != 0)
+        return false;
+
+    void *data = mmap(0, m_size, PROT_READ | PROT_WRITE, MAP_SHARED, m_file, 0);
+    if (data == MAP_FAILED)
+        return false;
+    m_data = (unsigned char *) data;
+    return true;
+#endif
+}
+
+void MappedImage::Unmap()
+{
+#ifdef _WIN32
+    if (m_data) UnmapViewOfFile(m_data);
+    if (m_mapping) CloseHandle(m_mapping);
+    if (m_file != INVALID_HANDLE_VALUE) CloseHandle(m_file);
+    m_mapping = 0;
+    m_file = INVALID_HANDLE_VALUE;
+#else
+    if (m_data) munmap(m_data, m_size);
+    if (m_file >= 0) close(m_file);
+    m_file = -1;
+#endif
+    m_data = 0;
+}
+
+bool MappedImage::Create(const string &fileName, int width, int height)
+{
+    return Open(fileName, width, height, false);
+}
+
+bool MappedImage::Reopen(const string &fileName, int width, int height)
+{
+    return Open(fileName, width, height, true);
+}
+
+bool MappedImage::Open(const string &fileName, int width, int height, bool existing)
+{
+    Close();
+
+    string extension = Extension(fileName);
+    if (width <= 0 || height <= 0 || !IsMappedFileName(fileName))
+    {
+        cout << "MappedImage ERROR: Unsupported image " << fileName << endl;
+        return false;
+    }
+
+    m_width = width;
+    m_height = height;
+    m_format = extension == "ppm" ? FORMAT_PPM : extension == "pfm" ? FORMAT_PFM : FORMAT_EXR;
+
+    vector<unsigned char> header;
+    if (m_format == FORMAT_EXR)
+        ExrHeader(width, height, EXR_NONE, header);
+    else
+    {
+        // a negative PFM scale marks the floats as little endian
+        stringstream text;
+        if (m_format == FORMAT_PPM)
+            text << "P6\n" << width << " " << height << "\n255\n";
+        else
+            text << "PF\n" << width << " " << height << "\n-1.0\n";
+        string s = text.str();
+        header.assign(s.begin(), s.end());
+    }
+
+    // EXR line offsets follow the header, every line has the same size
+    if (m_format == FORMAT_EXR)
+    {
+        size_t table = header.size();
+        header.resize(table + size_t(height) * 8);
+        m_pixelStart = header.size();
+        for (int y = 0; y < height; ++y)
+            PutLittleEndian(&header[table + size_t(y) * 8], m_pixelStart + size_t(y) * RowBytes(), 8);
+    }
+    m_pixelStart = header.size();
+    m_size = m_pixelStart + size_t(height) * RowBytes();
+
+    if (!Map(fileName, existing) || (existing && memcmp(m_data, &header[0], header.size()) != 0))
+    {
+        cout << "MappedImage ERROR: Could not map " << m_size << " bytes of "
+             << fileName << (existing ? " with a matching header" : "") << endl;
+        Unmap();
+        return false;
+    }
+
+    if (!existing)
+        memcpy(m_data, &header[0], header.size());
+    ReleaseBytes(0, m_pixelStart);
+    return true;
+}
+
+void MappedImage::WriteTile(int x, int y, int tileWidth, int tileHeight, const vec3 *colours)
+{
+    TimelineScope scope("convert tile", "x", x, "y", y);
+    for (int j = 0; j < tileHeight; ++j)
+    {
+        int row = y + j;
+        unsigned char *line = m_data + RowOffset(row);
+        const vec3 *in = colours + size_t(j) * tileWidth;
+
+        if (m_format == FORMAT_PPM)
+        {
+            // truncated like the default ImageBuffer quantize, NaN becomes 0
+            unsigned char *out = line + size_t(x) * 3;
+            for (int i = 0; i < tileWidth; ++i)
+                for (int c = 0; c < 3; ++c)
+                    out[3*i + c] = (unsigned char) std::min(std::max(0.f, in[i][c] * 255.f), 255.f);
+        }
+        else if (m_format == FORMAT_PFM)
+            memcpy(line + size_t(x) * 12, in, size_t(tileWidth) * 12);
+        else
+        {
+            // the tile holding the first column fills in the line's y and
+            // data size, the pixels are stored as planes of B, G then R
+            if (x == 0)
+            {
+                PutLittleEndian(line, uint32_t(m_height - 1 - row), 4);
+                PutLittleEndian(line + 4, uint32_t(m_width) * 12, 4);
+            }
+            for (int c = 0; c < 3; ++c)
+            {
+                unsigned char *plane = line + 8 + size_t(2 - c) * m_width * 4 + size_t(x) * 4;
+                for (int i = 0; i < tileWidth; ++i)
+                    memcpy(plane + size_t(i) * 4, &in[i][c], 4);
+            }
+        }
+    }
+}
+
+void MappedImage::Release(int firstRow, int lastRow)
+{
+    TimelineScope scope("release rows", "first", firstRow, "last", lastRow);
+    if (!m_data || firstRow >= lastRow)
+        return;
+
+    // the rows cover one byte range whichever way the format stores them
+    size_t begin = std::min(RowOffset(firstRow), RowOffset(lastRow - 1));
+    size_t end = std::max(RowOffset(firstRow), RowOffset(lastRow - 1)) + RowBytes();
+    ReleaseBytes(begin, end);
+}
+
+void MappedImage::ReleaseBytes(size_t begin, size_t end)
+{
+    // grown out to whole pages, neighbouring rows lose nothing since the
+    // pages stay in the file
+    size_t page = PageSize();
+    begin -= begin % page;
+    end = std::min(m_size, (end + page - 1) / page * page);
+
+#ifdef _WIN32
+    FlushViewOfFile(m_data + begin, end - begin);
+    VirtualUnlock(m_data + begin, end - begin);
+#else
+    // dirty pages of a shared mapping stay in the page cache for the kernel
+    // to write back, dropping them here only unmaps them from the process
+    msync(m_data + begin, end - begin, MS_ASYNC);
+    madvise(m_data + begin, end - begin, MADV_DONTNEED);
+#endif
+}
+
+bool MappedImage::Flush()
+{
+    if (!m_data)
+        return false;
+#ifdef _WIN32
+    return FlushViewOfFile(m_data, 0) && FlushFileBuffers(m_file);
+#else
+    return msync(m_data, m_size, MS_SYNC) == 0;
+#endif
+}
+
+bool MappedImage::Close()
+{
+    if (!m_data)
+        return false;
+
+    bool flushed = Flush();
+    Unmap();
+    return flushed;
+}
+
+// --------------------------------------------------------------------------
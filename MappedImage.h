@@ -0,0 +1,75 @@
+// ==========================================================================
+// Memory Mapped Image Output
+//  - maps a PPM, PFM or uncompressed OpenEXR file of the final size and lets
+//    tiles be written straight to their place in it, so an image far larger
+//    than memory can be rendered a band of tiles at a time
+// ==========================================================================
+#ifndef MAPPEDIMAGE_H
+#define MAPPEDIMAGE_H
+
+#include <string>
+#include <glm/vec3.hpp>
+
+class MappedImage
+{
+    int             m_width, m_height;
+
+    // format picked from the file name
+    enum Format { FORMAT_PPM, FORMAT_PFM, FORMAT_EXR };
+    Format          m_format;
+
+    // whole file mapped into memory, and where the pixels start in it
+    unsigned char  *m_data;
+    size_t          m_size;
+    size_t          m_pixelStart;
+
+#ifdef _WIN32
+    void           *m_file, *m_mapping;
+#else
+    int             m_file;
+#endif
+
+    // bytes of one row in the file, and the offset of a row counted from
+    // the bottom of the image
+    size_t RowBytes() const;
+    size_t RowOffset(int row) const;
+
+    bool Open(const std::string &fileName, int width, int height, bool existing);
+    bool Map(const std::string &fileName, bool existing);
+    void ReleaseBytes(size_t begin, size_t end);
+    void Unmap();
+
+public:
+    MappedImage();
+    ~MappedImage();
+
+    // create the file, sized for width x height pixels, the extension picks
+    // the format: .ppm (8 bit), .pfm or .exr (32 bit float)
+    bool Create(const std::string &fileName, int width, int height);
+
+    // map a file an earlier Create() made for the same image, keeping the
+    // pixels already in it; fails if its size or header don't match
+    bool Reopen(const std::string &fileName, int width, int height);
+
+    // store a tile with (x,y) as its bottom-left pixel, the colours are given
+    // row by row from the bottom row up, as RayTracer::RenderTile() makes them
+    // tiles may be written from several threads at once if they don't overlap
+    void WriteTile(int x, int y, int tileWidth, int tileHeight, const glm::vec3 *colours);
+
+    // hand rows [firstRow, lastRow) counted from the bottom back to the
+    // operating system once they are finished, so the pages they were
+    // written through stop counting against the process
+    void Release(int firstRow, int lastRow);
+
+    // wait until every tile written so far is on disk
+    bool Flush();
+
+    // flush everything and unmap the file
+    bool Close();
+
+    // returns true if the file name has an extension Create() handles
+    static bool IsMappedFileName(const std::string &fileName);
+};
+
+// --------------------------------------------------------------------------
+#endif // MAPPEDIMAGE_H
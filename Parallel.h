@@ -0,0 +1,140 @@
+// ==========================================================================
+// Parallel Loop Support Code
+//  - splits a range of work items into contiguous chunks and runs them on
+//    one std::thread per hardware thread
+//  - ThreadPool keeps its threads between loops, for long running processes
+//    that run many small ones
+// ==========================================================================
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+// number of threads ParallelFor() spreads work over
+inline int ThreadCount()
+{
+    unsigned n = std::thread::hardware_concurrency();
+    return n ? int(n) : 1;
+}
+
+// calls body(begin, end) over [0, count) in chunks of at least minChunk
+// items, on the calling thread when there is only enough work for one chunk
+template <class Body>
+void ParallelFor(int count, int minChunk, Body body)
+{
+    if (count <= 0) return;
+
+    int chunks = std::min(ThreadCount(), (count + minChunk - 1) / std::max(minChunk, 1));
+    if (chunks <= 1)
+    {
+        body(0, count);
+        return;
+    }
+
+    std::vector<std::thread> threads;
+    threads.reserve(chunks - 1);
+    for (int i = 1; i < chunks; ++i)
+    {
+        int begin = int(static_cast<long long>(count) * i / chunks);
+        int end = int(static_cast<long long>(count) * (i + 1) / chunks);
+        threads.push_back(std::thread(body, begin, end));
+    }
+    body(0, int(count / chunks));
+
+    for (size_t i = 0; i < threads.size(); ++i)
+        threads[i].join();
+}
+
+// --------------------------------------------------------------------------
+// Threads that wait between loops instead of being started for each one.
+// Chunks are handed out as threads ask for them, so uneven work evens out.
+
+class ThreadPool
+{
+    std::vector<std::thread>    m_threads;
+    std::mutex                  m_mutex;
+    std::condition_variable     m_wake, m_finished;
+
+    // the loop being run, bumping the generation wakes the threads for it
+    std::function<void()>       m_task;
+    unsigned                    m_generation;
+    int                         m_busy;
+    bool                        m_quit;
+
+    void Worker()
+    {
+        unsigned seen = 0;
+        std::unique_lock<std::mutex> lock(m_mutex);
+        for (;;)
+        {
+            m_wake.wait(lock, [&] { return m_quit || m_generation != seen; });
+            if (m_quit) return;
+            seen = m_generation;
+
+            lock.unlock();
+            m_task();
+            lock.lock();
+            if (--m_busy == 0)
+                m_finished.notify_one();
+        }
+    }
+
+public:
+    // the calling thread joins in each loop, so the pool starts one thread
+    // less than there are hardware threads
+    explicit ThreadPool(int threads = ThreadCount())
+        : m_generation(0), m_busy(0), m_quit(false)
+    {
+        for (int i = 1; i < threads; ++i)
+            m_threads.push_back(std::thread(&ThreadPool::Worker, this));
+    }
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_quit = true;
+        }
+        m_wake.notify_all();
+        for (size_t i = 0; i < m_threads.size(); ++i)
+            m_threads[i].join();
+    }
+
+    // calls body(begin, end) over [0, count) in chunks of chunkSize items and
+    // returns once every chunk is done, one loop at a time
+    template <class Body>
+    void ParallelFor(int count, int chunkSize, Body body)
+    {
+        if (count <= 0) return;
+        chunkSize = std::max(chunkSize, 1);
+
+        std::atomic<int> next(0);
+        std::function<void()> task = [&]
+        {
+            for (int begin; (begin = next.fetch_add(chunkSize)) < count; )
+                body(begin, std::min(count, begin + chunkSize));
+        };
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_task = task;
+        m_busy = int(m_threads.size());
+        ++m_generation;
+        lock.unlock();
+        m_wake.notify_all();
+
+        task();
+
+        lock.lock();
+        m_finished.wait(lock, [&] { return m_busy == 0; });
+        m_task = std::function<void()>();
+    }
+};
+
+// --------------------------------------------------------------------------
+#endif // PARALLEL_H
@@ -0,0 +1,327 @@
+// ==========================================================================
+// CPU Path Tracer
+//
+// Paths are traced with the intersection tests of RayTracer. The sample
+// points of a path come from the pixel's Sampler at the tile's pass
+// number, so a pass gives the same result whichever thread traces which
+// tile.
+// ==========================================================================
+
+#include "PathTracer.h"
+#include "Checkpoint.h"
+#include "Denoiser.h"
+#include "Parallel.h"
+#include "Sampler.h"
+#include "Timeline.h"
+
+#include <glm/common.hpp>
+#include <glm/geometric.hpp>
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+using namespace glm;
+
+static const float PI = 3.14159265359f;
+
+// bounce rays start this far off the surface so they don't hit it again
+static const float SURFACE_OFFSET = 1e-3f;
+
+// bounces every path makes before Russian roulette may end it
+static const int MIN_BOUNCES = 2;
+
+// added to a pixel's mean luminance before dividing its error by it, so
+// near black pixels don't need an exact zero to converge
+static const float ERROR_LUMINANCE_OFFSET = 0.05f;
+
+// --------------------------------------------------------------------------
+
+// direction about the normal with a density proportional to the cosine of
+// its angle to it, in the orthonormal basis of Duff et al. 2017
+static vec3 CosineDirection(vec3 normal, vec2 u)
+{
+    float r = std::sqrt(u.x), phi = 2 * PI * u.y;
+    float x = r * std::cos(phi), y = r * std::sin(phi), z = std::sqrt(std::max(0.f, 1 - u.x));
+
+    float sign = normal.z >= 0 ? 1.f : -1.f;
+    float a = -1 / (sign + normal.z);
+    float b = normal.x * normal.y * a;
+    vec3 tangent(1 + sign * normal.x * normal.x * a, sign * b, -sign * normal.x);
+    vec3 bitangent(b, sign + normal.y * normal.y * a, -normal.y);
+    return x * tangent + y * bitangent + z * normal;
+}
+
+static inline float Luminance(vec3 colour)
+{
+    return 0.2126f * colour.r + 0.7152f * colour.g + 0.0722f * colour.b;
+}
+
+// --------------------------------------------------------------------------
+
+PathTracer::PathTracer(const SceneBlock &scene, vec3 eye, int width, int height)
+    : m_tracer(scene, eye), m_width(width), m_height(height),
+      m_tilesAcross((width + TILE_SIZE - 1) / TILE_SIZE), m_passes(0),
+      m_sum(size_t(width) * height, vec3(0.f)), m_sumSquares(size_t(width) * height, 0.f),
+      m_normalSum(size_t(width) * height, vec3(0.f)), m_depthSum(size_t(width) * height, 0.f),
+      m_albedoSum(size_t(width) * height, vec3(0.f)), m_targetError(0.f)
+{
+    int tiles = m_tilesAcross * ((height + TILE_SIZE - 1) / TILE_SIZE);
+    m_tilePasses.assign(tiles, 0);
+    m_tileError.assign(tiles, 1.f);
+    for (int tile = 0; tile < tiles; ++tile)
+        m_activeTiles.push_back(tile);
+}
+
+vec3 PathTracer::Albedo(const Hit &hit) const
+{
+    const SceneBlock &s = m_tracer.Scene();
+    vec4 colour, material;
+    if (hit.kind == KIND_PLANE)
+    {
+        colour = s.planeColor[hit.index];
+        material = s.planeLight[hit.index];
+    }
+    else if (hit.kind == KIND_SPHERE)
+    {
+        colour = s.sphereColor[hit.index];
+        material = s.sphereLight[hit.index];
+    }
+    else
+    {
+        colour = s.triangleColor[hit.index];
+        material = s.triangleLight[hit.index];
+    }
+    return clamp(vec3(colour) * material.y, 0.f, 1.f);
+}
+
+void PathTracer::TileRect(int tile, int &x0, int &y0, int &x1, int &y1) const
+{
+    x0 = (tile % m_tilesAcross) * TILE_SIZE;
+    y0 = (tile / m_tilesAcross) * TILE_SIZE;
+    x1 = std::min(m_width, x0 + TILE_SIZE);
+    y1 = std::min(m_height, y0 + TILE_SIZE);
+}
+
+vec3 PathTracer::TracePath(int x, int y, Sampler &sampler, vec3 &firstNormal, float &firstDepth,
+                           vec3 &firstAlbedo) const
+{
+    // a different point in the pixel each pass, which anti-aliases as
+    // passes add up
+    vec2 jitter = sampler.Get2D();
+    vec2 coordinates((x + jitter.x) / m_width * 2 - 1,
+                     (y + jitter.y) / m_height * 2 - 1);
+    vec3 origin = m_tracer.Eye(), direction = m_tracer.Direction(coordinates);
+    vec3 light = vec3(m_tracer.Scene().light);
+
+    firstNormal = -direction;
+    firstDepth = DENOISE_MISS_DEPTH;
+    firstAlbedo = vec3(0.f);
+
+    vec3 radiance(0.f), throughput(1.f);
+    for (int bounce = 0; ; ++bounce)
+    {
+        Hit hit = m_tracer.ClosestHit(origin, direction);
+        if (hit.kind == KIND_NONE)
+            break;
+
+        vec3 point = origin + hit.t * direction;
+        vec3 normal = normalize(hit.normal);
+        if (dot(normal, direction) > 0)
+            normal = -normal;
+        vec3 albedo = Albedo(hit);
+        vec3 offset = point + SURFACE_OFFSET * normal;
+        if (bounce == 0)
+        {
+            firstNormal = normal;
+            firstDepth = hit.t;
+            firstAlbedo = albedo;
+        }
+
+        // next event estimation: only a shadow ray can reach the point
+        // light, and it brings the Lambertian term with it
+        float cosine = dot(normal, normalize(light - point));
+        if (cosine > 0 && (hit.backdrop || !m_tracer.Shadowed(offset)))
+            radiance += throughput * albedo * cosine;
+
+        // a cosine weighted bounce off a Lambertian surface carries the
+        // albedo, the cosine and the density cancel
+        throughput *= albedo;
+
+        // Russian roulette, survivors are weighted up so the estimate
+        // stays unbiased
+        if (bounce + 1 >= MIN_BOUNCES)
+        {
+            float survival = std::min(0.95f, std::max(throughput.r, std::max(throughput.g, throughput.b)));
+            if (sampler.Get1D() >= survival)
+                break;
+            throughput /= survival;
+        }
+
+        direction = CosineDirection(normal, sampler.Get2D());
+        origin = offset;
+    }
+    return radiance;
+}
+
+void PathTracer::RenderTile(int tile)
+{
+    int x0, y0, x1, y1;
+    TileRect(tile, x0, y0, x1, y1);
+    TimelineScope scope("path tile", "x", x0, "y", y0);
+
+    for (int y = y0; y < y1; ++y)
+        for (int x = x0; x < x1; ++x)
+        {
+            size_t pixel = size_t(y) * m_width + x;
+            Sampler sampler(uint32_t(pixel), uint32_t(m_tilePasses[tile]));
+            vec3 normal, albedo;
+            float depth;
+            vec3 colour = TracePath(x, y, sampler, normal, depth, albedo);
+            m_sum[pixel] += colour;
+            m_sumSquares[pixel] += Luminance(colour) * Luminance(colour);
+            m_normalSum[pixel] += normal;
+            m_depthSum[pixel] += depth;
+            m_albedoSum[pixel] += albedo;
+        }
+
+    m_tilePasses[tile]++;
+    if (m_targetError > 0 && m_tilePasses[tile] >= MIN_ADAPTIVE_PASSES)
+        m_tileError[tile] = TileError(tile);
+}
+
+// mean over the tile's pixels of the standard error of their mean
+// luminance, relative to that mean
+float PathTracer::TileError(int tile) const
+{
+    int x0, y0, x1, y1;
+    TileRect(tile, x0, y0, x1, y1);
+    float n = float(m_tilePasses[tile]);
+
+    float sum = 0.f;
+    for (int y = y0; y < y1; ++y)
+        for (int x = x0; x < x1; ++x)
+        {
+            size_t pixel = size_t(y) * m_width + x;
+            float mean = Luminance(m_sum[pixel]) / n;
+            float variance = std::max(0.f, (m_sumSquares[pixel] - n * mean * mean) / (n - 1));
+            sum += std::sqrt(variance / n) / (mean + ERROR_LUMINANCE_OFFSET);
+        }
+    return sum / ((x1 - x0) * (y1 - y0));
+}
+
+double PathTracer::MeanPasses() const
+{
+    double paths = 0;
+    for (int tile = 0; tile < Tiles(); ++tile)
+    {
+        int x0, y0, x1, y1;
+        TileRect(tile, x0, y0, x1, y1);
+        paths += double(m_tilePasses[tile]) * (x1 - x0) * (y1 - y0);
+    }
+    return paths / (double(m_width) * m_height);
+}
+
+void PathTracer::RenderPass(ThreadPool &pool)
+{
+    // threads take tiles in turn as they finish, so with the noisiest ones
+    // handed out first no thread is left with a slow tile at the end
+    if (m_targetError > 0)
+        std::stable_sort(m_activeTiles.begin(), m_activeTiles.end(), [&](int a, int b)
+        {
+            return m_tileError[a] > m_tileError[b];
+        });
+
+    pool.ParallelFor(int(m_activeTiles.size()), 1, [&](int begin, int end)
+    {
+        for (int i = begin; i < end; ++i)
+            RenderTile(m_activeTiles[i]);
+    });
+    m_passes++;
+
+    // drop the tiles that have converged
+    if (m_targetError > 0)
+        m_activeTiles.erase(std::remove_if(m_activeTiles.begin(), m_activeTiles.end(), [&](int tile)
+        {
+            return m_tilePasses[tile] >= MIN_ADAPTIVE_PASSES && m_tileError[tile] < m_targetError;
+        }), m_activeTiles.end());
+}
+
+void PathTracer::Resolve(vector<vec3> &colours) const
+{
+    colours.resize(m_sum.size());
+    for (int tile = 0; tile < Tiles(); ++tile)
+    {
+        int x0, y0, x1, y1;
+        TileRect(tile, x0, y0, x1, y1);
+        float scale = 1.f / std::max(1, m_tilePasses[tile]);
+        for (int y = y0; y < y1; ++y)
+            for (int x = x0; x < x1; ++x)
+                colours[size_t(y) * m_width + x] = m_sum[size_t(y) * m_width + x] * scale;
+    }
+}
+
+void PathTracer::ResolveFeatures(DenoiseFeatures &features) const
+{
+    features.normals.resize(m_sum.size());
+    features.depths.resize(m_sum.size());
+    features.albedos.resize(m_sum.size());
+    for (int tile = 0; tile < Tiles(); ++tile)
+    {
+        int x0, y0, x1, y1;
+        TileRect(tile, x0, y0, x1, y1);
+        float scale = 1.f / std::max(1, m_tilePasses[tile]);
+        for (int y = y0; y < y1; ++y)
+            for (int x = x0; x < x1; ++x)
+            {
+                size_t pixel = size_t(y) * m_width + x;
+                vec3 normal = m_normalSum[pixel];
+                features.normals[pixel] = dot(normal, normal) > 0 ? normalize(normal) : normal;
+                features.depths[pixel] = m_depthSum[pixel] * scale;
+                features.albedos[pixel] = m_albedoSum[pixel] * scale;
+            }
+    }
+}
+
+void PathTracer::SaveState(PathTraceState &state) const
+{
+    state.passes = m_passes;
+    state.sum = m_sum;
+    state.sumSquares = m_sumSquares;
+    state.normalSum = m_normalSum;
+    state.depthSum = m_depthSum;
+    state.albedoSum = m_albedoSum;
+    state.tilePasses = m_tilePasses;
+    state.tileError = m_tileError;
+    state.activeTiles = m_activeTiles;
+}
+
+bool PathTracer::RestoreState(const PathTraceState &state)
+{
+    // the sampler of each pixel is seeded by its tile's passes, so those
+    // and the sums are all a pass needs
+    size_t pixels = m_sum.size(), tiles = m_tilePasses.size();
+    if (state.sum.size() != pixels || state.sumSquares.size() != pixels ||
+        state.normalSum.size() != pixels || state.depthSum.size() != pixels ||
+        state.albedoSum.size() != pixels || state.tilePasses.size() != tiles ||
+        state.tileError.size() != tiles || state.activeTiles.size() > tiles || state.passes < 0)
+        return false;
+    for (size_t tile = 0; tile < tiles; ++tile)
+        if (state.tilePasses[tile] < 0 || state.tilePasses[tile] > state.passes)
+            return false;
+    for (size_t i = 0; i < state.activeTiles.size(); ++i)
+        if (state.activeTiles[i] < 0 || size_t(state.activeTiles[i]) >= tiles)
+            return false;
+
+    m_passes = state.passes;
+    m_sum = state.sum;
+    m_sumSquares = state.sumSquares;
+    m_normalSum = state.normalSum;
+    m_depthSum = state.depthSum;
+    m_albedoSum = state.albedoSum;
+    m_tilePasses = state.tilePasses;
+    m_tileError = state.tileError;
+    m_activeTiles = state.activeTiles;
+    return true;
+}
+
+// --------------------------------------------------------------------------
@@ -0,0 +1,118 @@
+// ==========================================================================
+// CPU Path Tracer
+//  - a global illumination alternative to the Whitted shading of RayTracer:
+//    diffuse interreflection with cosine weighted bounces, the light
+//    sampled directly at every vertex and paths ended by Russian roulette
+//  - renders progressively, each pass adding one path to every pixel, so
+//    the image can be looked at or saved at any point
+//  - tiles can stop early once the variance of their pixels shows they
+//    have converged, leaving the passes to the noisy ones
+//  - keeps the normal, depth and albedo of each pixel's first hits for the
+//    denoiser
+// ==========================================================================
+#ifndef PATHTRACER_H
+#define PATHTRACER_H
+
+#include <vector>
+#include <glm/vec2.hpp>
+#include <glm/vec3.hpp>
+#include "RayTracer.h"
+
+class ThreadPool;
+class Sampler;
+struct DenoiseFeatures;
+struct PathTraceState;
+
+// --------------------------------------------------------------------------
+// Surfaces are Lambertian with the albedo colour * cL of their Phong
+// material, so the direct light matches the diffuse term of the Whitted
+// shading; the ambient term is replaced by the light bounced around the
+// scene. Like in the shader, the point light doesn't fall off with
+// distance, and scene 3's back wall is never in shadow.
+
+class PathTracer
+{
+    RayTracer               m_tracer;
+    int                     m_width, m_height;
+    int                     m_tilesAcross;
+    int                     m_passes;
+
+    // sum of the paths traced through each pixel and of the squares of
+    // their luminance, for its variance, rows from the bottom up
+    std::vector<glm::vec3>  m_sum;
+    std::vector<float>      m_sumSquares;
+
+    // sums of the first hit features of the paths, see DenoiseFeatures
+    std::vector<glm::vec3>  m_normalSum;
+    std::vector<float>      m_depthSum;
+    std::vector<glm::vec3>  m_albedoSum;
+
+    // paths per pixel and estimated error of each tile, and the tiles
+    // that are still traced
+    std::vector<int>        m_tilePasses;
+    std::vector<float>      m_tileError;
+    std::vector<int>        m_activeTiles;
+    float                   m_targetError;
+
+    glm::vec3 Albedo(const Hit &hit) const;
+
+    // one path through the pixel, with the sample points of sampler, also
+    // giving the features of its first hit
+    glm::vec3 TracePath(int x, int y, Sampler &sampler, glm::vec3 &firstNormal, float &firstDepth,
+                        glm::vec3 &firstAlbedo) const;
+
+    // pixels of a tile, from (x0,y0) up to but not including (x1,y1)
+    void TileRect(int tile, int &x0, int &y0, int &x1, int &y1) const;
+
+    void RenderTile(int tile);
+    float TileError(int tile) const;
+
+public:
+    // side length in pixels of the tiles handed to threads
+    static const int TILE_SIZE = 16;
+
+    // paths per pixel a tile gets before it may be found converged
+    static const int MIN_ADAPTIVE_PASSES = 16;
+
+    PathTracer(const SceneBlock &scene, glm::vec3 eye, int width, int height);
+
+    int Width() const  { return m_width; }
+    int Height() const { return m_height; }
+
+    // passes run so far, the most paths any pixel has
+    int Passes() const { return m_passes; }
+
+    // stop tracing a tile once the mean relative standard error of its
+    // pixels' luminance falls below targetError, 0 (the default) traces
+    // every tile in every pass
+    void SetTargetError(float targetError) { m_targetError = targetError; }
+
+    // tiles in the image, and those not converged yet
+    int Tiles() const { return int(m_tilePasses.size()); }
+    int ActiveTiles() const { return int(m_activeTiles.size()); }
+
+    // paths per pixel averaged over the image
+    double MeanPasses() const;
+
+    // add one path to every pixel of the tiles still traced, shared between
+    // the pool's threads noisiest tile first; the image depends only on the
+    // number of passes, not on which thread traced what
+    void RenderPass(ThreadPool &pool);
+
+    // the mean of the paths of each pixel, rows from the bottom up
+    void Resolve(std::vector<glm::vec3> &colours) const;
+
+    // the mean first hit features of each pixel, for Denoise()
+    void ResolveFeatures(DenoiseFeatures &features) const;
+
+    // copy out the sums and passes so far, for a checkpoint
+    void SaveState(PathTraceState &state) const;
+
+    // carry on from a saved state of a tracer of the same size, the next
+    // passes giving exactly what they would have without the break; false,
+    // leaving the tracer as it was, if the state doesn't fit
+    bool RestoreState(const PathTraceState &state);
+};
+
+// --------------------------------------------------------------------------
+#endif // PATHTRACER_H
@@ -0,0 +1,203 @@
+// ==========================================================================
+// Parallel PNG Writing Support Code
+//
+// The image is cut into bands of rows. Each band is filtered and deflated
+// on its own, with no matches reaching back into the band before it, and
+// ends on a byte boundary with an empty stored block. That lets the bands
+// be compressed in parallel and simply concatenated. Each band becomes its
+// own IDAT chunk so its CRC is computed by the same thread, and the Adler-32
+// checksums of the bands are combined at the end.
+// ==========================================================================
+
+#include "PngWriter.h"
+#include "Deflate.h"
+#include "Parallel.h"
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <stdint.h>
+
+using namespace std;
+
+// --------------------------------------------------------------------------
+// Filtering
+
+static inline unsigned char Paeth(int a, int b, int c)
+{
+    int p = a + b - c;
+    int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+    if (pa <= pb && pa <= pc) return (unsigned char) a;
+    if (pb <= pc) return (unsigned char) b;
+    return (unsigned char) c;
+}
+
+// filter one row into out, which starts with the filter type byte
+static void FilterRow(int type, const unsigned char *row, const unsigned char *above,
+                      int length, int bpp, unsigned char *out)
+{
+    out[0] = (unsigned char) type;
+    ++out;
+    for (int i = 0; i < length; ++i)
+    {
+        int a = i >= bpp ? row[i - bpp] : 0;
+        int b = above ? above[i] : 0;
+        int c = above && i >= bpp ? above[i - bpp] : 0;
+        switch (type)
+        {
+        case 0: out[i] = row[i]; break;
+        case 1: out[i] = (unsigned char) (row[i] - a); break;
+        case 2: out[i] = (unsigned char) (row[i] - b); break;
+        case 3: out[i] = (unsigned char) (row[i] - ((a + b) >> 1)); break;
+        case 4: out[i] = (unsigned char) (row[i] - Paeth(a, b, c)); break;
+        }
+    }
+}
+
+// filtered rows of a band, each row prefixed by its filter type
+static void FilterBand(const unsigned char *pixels, int stride, int bpp, int first, int last,
+                       PngLevel level, vector<unsigned char> &out)
+{
+    out.resize(size_t(last - first) * (stride + 1));
+    vector<unsigned char> trial(stride + 1);
+
+    for (int y = first; y < last; ++y)
+    {
+        const unsigned char *row = pixels + size_t(y) * stride;
+        const unsigned char *above = y > 0 ? row - stride : 0;
+        unsigned char *target = &out[size_t(y - first) * (stride + 1)];
+
+        if (level == PNG_STORE)
+            FilterRow(0, row, above, stride, bpp, target);
+        else if (level == PNG_FAST)
+            FilterRow(1, row, above, stride, bpp, target);
+        else
+        {
+            // keep the filter whose output is smallest as signed bytes
+            long best = -1;
+            for (int type = 0; type < 5; ++type)
+            {
+                FilterRow(type, row, above, stride, bpp, &trial[0]);
+                long sum = 0;
+                for (int i = 1; i <= stride; ++i)
+                    sum += abs((signed char) trial[i]);
+                if (best < 0 || sum < best)
+                {
+                    best = sum;
+                    std::copy(trial.begin(), trial.end(), target);
+                }
+            }
+        }
+    }
+}
+
+// --------------------------------------------------------------------------
+
+static void PutBigEndian(vector<unsigned char> &out, uint32_t value)
+{
+    out.push_back((unsigned char) (value >> 24));
+    out.push_back((unsigned char) (value >> 16));
+    out.push_back((unsigned char) (value >> 8));
+    out.push_back((unsigned char) value);
+}
+
+// wrap data in a PNG chunk with its length, type and CRC
+static void MakeChunk(const char *type, const unsigned char *data, size_t length,
+                      vector<unsigned char> &out)
+{
+    out.clear();
+    PutBigEndian(out, uint32_t(length));
+    out.insert(out.end(), type, type + 4);
+    out.insert(out.end(), data, data + length);
+    PutBigEndian(out, UpdateCrc(0, &out[4], length + 4));
+}
+
+bool WritePng(const string &fileName, int width, int height, int components,
+              const unsigned char *pixels, PngLevel level)
+{
+    static const unsigned char colourTypes[5] = { 0, 0, 4, 2, 6 };
+    if (width <= 0 || height <= 0 || components < 1 || components > 4)
+    {
+        cout << "PngWriter ERROR: Unsupported image layout for " << fileName << endl;
+        return false;
+    }
+
+    // bands of about 256 KB of filtered data, the band size depends only on
+    // the image so the file is the same whatever the thread count
+    int stride = width * components;
+    int bandRows = std::max(1, (256 * 1024) / (stride + 1));
+    int bands = (height + bandRows - 1) / bandRows;
+    int chainLength = level == PNG_STORE ? 0 : level == PNG_FAST ? 4 : 64;
+
+    vector< vector<unsigned char> > chunks(bands);
+    vector<uint32_t> adler(bands);
+    vector<size_t> filteredLength(bands);
+
+    ParallelFor(bands, 1, [&](int begin, int end)
+    {
+        vector<unsigned char> filtered, compressed;
+        for (int band = begin; band < end; ++band)
+        {
+            int first = band * bandRows, last = std::min(height, first + bandRows);
+            FilterBand(pixels, stride, components, first, last, level, filtered);
+            adler[band] = Adler32(&filtered[0], filtered.size());
+            filteredLength[band] = filtered.size();
+
+            // the first band carries the zlib header, deflate without a
+            // preset dictionary and a 32 KB window
+            compressed.clear();
+            if (band == 0)
+            {
+                compressed.push_back(0x78);
+                compressed.push_back(0x01);
+            }
+            Deflate(&filtered[0], filtered.size(), chainLength, compressed);
+            MakeChunk("IDAT", &compressed[0], compressed.size(), chunks[band]);
+        }
+    });
+
+    // close the stream with a final empty block and the joined checksum
+    uint32_t checksum = adler[0];
+    for (int band = 1; band < bands; ++band)
+        checksum = CombineAdler32(checksum, adler[band], filteredLength[band]);
+
+    vector<unsigned char> tail;
+    tail.push_back(0x01);
+    tail.push_back(0x00); tail.push_back(0x00);
+    tail.push_back(0xff); tail.push_back(0xff);
+    PutBigEndian(tail, checksum);
+
+    vector<unsigned char> header, tailChunk, endChunk;
+    PutBigEndian(header, uint32_t(width));
+    PutBigEndian(header, uint32_t(height));
+    header.push_back(8);
+    header.push_back(colourTypes[components]);
+    header.push_back(0);
+    header.push_back(0);
+    header.push_back(0);
+    vector<unsigned char> headerChunk;
+    MakeChunk("IHDR", &header[0], header.size(), headerChunk);
+    MakeChunk("IDAT", &tail[0], tail.size(), tailChunk);
+    MakeChunk("IEND", 0, 0, endChunk);
+
+    ofstream file(fileName.c_str(), ios::binary);
+    static const unsigned char signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+    file.write((const char *) signature, 8);
+    file.write((const char *) &headerChunk[0], headerChunk.size());
+    for (int band = 0; band < bands; ++band)
+        file.write((const char *) &chunks[band][0], chunks[band].size());
+    file.write((const char *) &tailChunk[0], tailChunk.size());
+    file.write((const char *) &endChunk[0], endChunk.size());
+
+    if (!file)
+    {
+        cout << "PngWriter ERROR: Failed to write " << fileName << endl;
+        return false;
+    }
+    return true;
+}
+
+// --------------------------------------------------------------------------
@@ -0,0 +1,26 @@
+// ==========================================================================
+// Parallel PNG Writing Support Code
+//  - filters and deflates bands of rows on separate threads, then joins the
+//    pieces into a single zlib stream split over several IDAT chunks
+// ==========================================================================
+#ifndef PNGWRITER_H
+#define PNGWRITER_H
+
+#include <string>
+
+// compression levels for WritePng():
+//  - STORE keeps the rows unfiltered and uncompressed, for throwaway frames
+//  - FAST filters each row against its left neighbour and looks for matches
+//    only briefly
+//  - DEFAULT picks the best filter per row and searches matches longer
+enum PngLevel { PNG_STORE, PNG_FAST, PNG_DEFAULT };
+
+// write width x height pixels of 8 bit data to a PNG file:
+//  - components is 1 (grey), 2 (grey, alpha), 3 (RGB) or 4 (RGBA)
+//  - rows are stored top to bottom, tightly packed
+// returns true if the file was written
+bool WritePng(const std::string &fileName, int width, int height, int components,
+              const unsigned char *pixels, PngLevel level = PNG_DEFAULT);
+
+// --------------------------------------------------------------------------
+#endif // PNGWRITER_H
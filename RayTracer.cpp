@@ -0,0 +1,424 @@
+// ==========================================================================
+// CPU Ray Tracer
+//
+// A line for line port of the full pass of fragment.glsl, including its
+// quirks (the sphere root scaling, the half vector taken from the world
+// origin rather than the eye), so CPU renders match the window.
+// ==========================================================================
+
+#include "RayTracer.h"
+#include "Sampler.h"
+#include "TraceStats.h"
+#include "Timeline.h"
+
+#include <glm/common.hpp>
+#include <glm/geometric.hpp>
+#include <algorithm>
+#include <vector>
+#include <cmath>
+
+using namespace glm;
+
+static const float PI = 3.14159265359f;
+
+// --------------------------------------------------------------------------
+// Intersection tests, each returns -1 when the ray misses
+
+static float ClosePlane(vec3 origin, vec3 D, vec3 N, vec3 Q)
+{
+    float numerator = dot(N, Q - origin);
+    float denominator = dot(D, N);
+    if (denominator == 0)
+        return -1.f;
+    return numerator / denominator;
+}
+
+static float CloseSphere(vec3 origin, vec3 D, vec3 centre, float radius)
+{
+    float a = dot(D, D);
+    float b = 2 * (dot(origin, D) - dot(centre, D));
+    float c = (-2 * dot(origin, centre)) + dot(origin, origin) + dot(centre, centre)
+              - (radius * radius);
+
+    float discrim = (b * b) - (4 * a * c);
+    if (discrim < 0)
+        return -1.f;
+
+    float t1 = (-b + std::sqrt(discrim)) / 2 * a;
+    float t2 = (-b - std::sqrt(discrim)) / 2 * a;
+    return t1 < t2 ? t1 : t2;
+}
+
+// a triangle that gets past its plane test adds a second test to tests
+static float CloseTriangle(vec3 origin, vec3 D, vec3 P1, vec3 e1, vec3 e2, vec4 N, int *tests)
+{
+    vec3 normal(N);
+    float denominator = dot(normal, D);
+    if (denominator == 0)
+    {
+        TRACE_STAT(STAT_TRIANGLE_PLANE_REJECTS);
+        return -1.f;
+    }
+
+    float tPlane = (N.w - dot(normal, origin)) / denominator;
+    if (tPlane <= 0)
+    {
+        TRACE_STAT(STAT_TRIANGLE_PLANE_REJECTS);
+        return -1.f;
+    }
+
+    if (tests)
+        ++*tests;
+    vec3 s = origin - P1;
+    vec3 p = cross(D, e2);
+    vec3 q = cross(s, e1);
+    float invDet = 1 / dot(e1, p);
+
+    float t = dot(e2, q) * invDet;
+    float u = dot(s, p) * invDet;
+    float v = dot(D, q) * invDet;
+    float plus = u + v;
+
+    if (t > 0 && u > 0 && u < 1 && v > 0 && v < 1 && plus > 0 && plus < 1)
+        return t;
+    return -1.f;
+}
+
+// --------------------------------------------------------------------------
+
+RayTracer::RayTracer(const SceneBlock &scene, vec3 eye)
+    : m_scene(scene), m_eye(eye)
+{
+}
+
+vec3 RayTracer::Direction(vec2 coordinates) const
+{
+    float focal = 1 / std::tan(PI / 6);
+    return normalize(vec3(coordinates.x, coordinates.y, -focal));
+}
+
+Hit RayTracer::ClosestHit(vec3 origin, vec3 direction, int *tests) const
+{
+    const SceneBlock &s = m_scene;
+    Hit hit = { 1000000.f, KIND_NONE, 0, vec3(0.f), false };
+
+    TRACE_STAT_ADD(STAT_PLANE_TESTS, s.planeCount);
+    TRACE_STAT_ADD(STAT_SPHERE_TESTS, s.sphereCount);
+    TRACE_STAT_ADD(STAT_TRIANGLE_TESTS, s.triangleCount);
+    if (tests)
+        *tests += s.planeCount + s.sphereCount + s.triangleCount;
+
+    for (int a = 0; a < s.planeCount; ++a)
+    {
+        vec3 normal(s.planeVert[2*a]), point(s.planeVert[2*a+1]);
+        float t = ClosePlane(origin, direction, normal, point);
+        if (t > 0 && t < hit.t)
+        {
+            hit.t = t;
+            hit.kind = KIND_PLANE;
+            hit.index = a;
+            hit.normal = normal;
+            hit.backdrop = point == vec3(0.f, 0.f, -20.f);
+        }
+    }
+
+    for (int c = 0; c < s.sphereCount; ++c)
+    {
+        vec3 centre(s.sphereVert[c]);
+        float t = CloseSphere(origin, direction, centre, s.sphereVert[c].w);
+        if (t > 0 && t < hit.t)
+        {
+            hit.t = t;
+            hit.kind = KIND_SPHERE;
+            hit.index = c;
+            hit.normal = normalize(origin + t * direction - centre);
+        }
+    }
+
+    for (int e = 0; e < s.triangleCount; ++e)
+    {
+        float t = CloseTriangle(origin, direction, vec3(s.triangleVert[e]),
+                                vec3(s.triangleEdge1[e]), vec3(s.triangleEdge2[e]),
+                                s.triangleNormal[e], tests);
+        if (t > 0 && t < hit.t)
+        {
+            hit.t = t;
+            hit.kind = KIND_TRIANGLE;
+            hit.index = e;
+            hit.normal = vec3(s.triangleNormal[e]);
+        }
+    }
+
+    return hit;
+}
+
+bool RayTracer::Shadowed(vec3 point, int *tests) const
+{
+    const SceneBlock &s = m_scene;
+    vec3 shadowRay = vec3(s.light) - point;
+    float shadowLength = std::sqrt(dot(shadowRay, shadowRay));
+    shadowRay = normalize(shadowRay);
+    TRACE_STAT(STAT_SHADOW_RAYS);
+
+    // tests are counted up to the first blocker found
+    for (int i = 0; i < s.planeCount; ++i)
+    {
+        float t = ClosePlane(point, shadowRay, vec3(s.planeVert[2*i]), vec3(s.planeVert[2*i+1]));
+        if (t > 0.001f && t < shadowLength)
+        {
+            TRACE_STAT_ADD(STAT_PLANE_TESTS, i + 1);
+            TRACE_STAT(STAT_SHADOW_BLOCKED);
+            if (tests)
+                *tests += i + 1;
+            return true;
+        }
+    }
+    TRACE_STAT_ADD(STAT_PLANE_TESTS, s.planeCount);
+    if (tests)
+        *tests += s.planeCount;
+
+    for (int i = 0; i < s.sphereCount; ++i)
+    {
+        float t = CloseSphere(point, shadowRay, vec3(s.sphereVert[i]), s.sphereVert[i].w);
+        if (t > 0.001f && t < shadowLength)
+        {
+            TRACE_STAT_ADD(STAT_SPHERE_TESTS, i + 1);
+            TRACE_STAT(STAT_SHADOW_BLOCKED);
+            if (tests)
+                *tests += i + 1;
+            return true;
+        }
+    }
+    TRACE_STAT_ADD(STAT_SPHERE_TESTS, s.sphereCount);
+    if (tests)
+        *tests += s.sphereCount;
+
+    for (int i = 0; i < s.triangleCount; ++i)
+    {
+        float t = CloseTriangle(point, shadowRay, vec3(s.triangleVert[i]),
+                                vec3(s.triangleEdge1[i]), vec3(s.triangleEdge2[i]),
+                                s.triangleNormal[i], tests);
+        if (t > 0.001f && t < shadowLength)
+        {
+            TRACE_STAT_ADD(STAT_TRIANGLE_TESTS, i + 1);
+            TRACE_STAT(STAT_SHADOW_BLOCKED);
+            if (tests)
+                *tests += i + 1;
+            return true;
+        }
+    }
+    TRACE_STAT_ADD(STAT_TRIANGLE_TESTS, s.triangleCount);
+    if (tests)
+        *tests += s.triangleCount;
+    return false;
+}
+
+vec3 RayTracer::Shade(vec3 point, const Hit &hit, bool *shadowed, int *tests) const
+{
+    const SceneBlock &s = m_scene;
+    if (hit.kind == KIND_NONE)
+        return vec3(0.f);
+
+    vec3 colour;
+    vec4 material;
+    if (hit.kind == KIND_PLANE)
+    {
+        colour = vec3(s.planeColor[hit.index]);
+        material = s.planeLight[hit.index];
+    }
+    else if (hit.kind == KIND_SPHERE)
+    {
+        colour = vec3(s.sphereColor[hit.index]);
+        material = s.sphereLight[hit.index];
+    }
+    else
+    {
+        colour = vec3(s.triangleColor[hit.index]);
+        material = s.triangleLight[hit.index];
+    }
+
+    float cA = material.x, cL = material.y, cP = material.z, p = material.w;
+
+    vec3 l = normalize(vec3(s.light) - point);
+    vec3 h = normalize(normalize(-point) + l);
+
+    float specular = dot(h, hit.normal);
+    if (hit.kind == KIND_TRIANGLE)
+        specular = std::sqrt(specular);
+
+    // std::max(0, x) returns 0 for NaN, the same as GLSL's max(0.0, x)
+    colour = colour * (cA + cL * std::max(0.f, dot(hit.normal, l)))
+             + cP * colour * std::max(0.f, std::pow(specular, p));
+
+    bool blocked = !hit.backdrop && Shadowed(point, tests);
+    if (shadowed)
+        *shadowed = blocked;
+    if (blocked)
+        colour -= 0.3f;
+    return colour;
+}
+
+vec3 RayTracer::Trace(vec2 coordinates) const
+{
+    Hit hit;
+    bool shadowed;
+    return Trace(coordinates, hit, shadowed);
+}
+
+vec3 RayTracer::Trace(vec2 coordinates, Hit &hit, bool &shadowed, int *tests) const
+{
+    vec3 direction = Direction(coordinates);
+    hit = ClosestHit(m_eye, direction, tests);
+
+#ifdef TRACE_STATS
+    static const TraceStat hitStats[4] = { STAT_MISSES, STAT_PLANE_HITS, STAT_SPHERE_HITS,
+                                           STAT_TRIANGLE_HITS };
+    TRACE_STAT(STAT_PRIMARY_RAYS);
+    TRACE_STAT(hitStats[hit.kind + 1]);
+#endif
+    shadowed = false;
+    return Shade(m_eye + hit.t * direction, hit, &shadowed, tests);
+}
+
+// mean of samples rays through points of the pixel spread by its Sampler,
+// which is seeded by the pixel's place in the image so tiles of any size
+// give the same colour
+static vec3 Supersample(const RayTracer &tracer, int x, int y, int width, int height, int samples)
+{
+    vec3 sum(0.f);
+    for (int s = 0; s < samples; ++s)
+    {
+        Sampler sampler(uint32_t(y) * uint32_t(width) + uint32_t(x), uint32_t(s));
+        vec2 offset = sampler.Get2D();
+        vec2 coordinates((x + offset.x) / width * 2 - 1, (y + offset.y) / height * 2 - 1);
+        sum += tracer.Trace(coordinates);
+    }
+    return sum / float(samples);
+}
+
+void RayTracer::RenderTile(int x, int y, int tileWidth, int tileHeight,
+                           int width, int height, vec3 *colours, int samples) const
+{
+    TimelineScope scope("trace tile", "x", x, "y", y);
+    for (int j = 0; j < tileHeight; ++j)
+        for (int i = 0; i < tileWidth; ++i)
+        {
+            vec3 &colour = colours[size_t(j) * tileWidth + i];
+            if (samples > 1)
+                colour = Supersample(*this, x + i, y + j, width, height, samples);
+            else
+                colour = Trace(vec2((x + i + 0.5f) / width * 2 - 1, (y + j + 0.5f) / height * 2 - 1));
+        }
+}
+
+// --------------------------------------------------------------------------
+// Adaptive anti-aliasing
+
+// how far apart neighbouring pixel centres may be before both are
+// supersampled: depth relative to the nearer hit, colour in any channel
+static const float AA_DEPTH_THRESHOLD = 0.1f;
+static const float AA_COLOUR_THRESHOLD = 0.1f;
+
+// what the single ray through a pixel centre found
+struct BaseSample
+{
+    vec3    colour;
+    float   t;
+    int     kind, index;
+    bool    shadowed;
+};
+
+static bool Differs(const BaseSample &a, const BaseSample &b)
+{
+    vec3 difference = abs(a.colour - b.colour);
+    return a.kind != b.kind || a.index != b.index || a.shadowed != b.shadowed ||
+           std::abs(a.t - b.t) > AA_DEPTH_THRESHOLD * std::min(a.t, b.t) ||
+           std::max(difference.r, std::max(difference.g, difference.b)) > AA_COLOUR_THRESHOLD;
+}
+
+int RayTracer::RenderAdaptiveTile(int x, int y, int tileWidth, int tileHeight,
+                                  int width, int height, vec3 *colours, int maxSamples) const
+{
+    TimelineScope scope("trace tile", "x", x, "y", y);
+
+    // one ray through each pixel centre, and through the pixels around the
+    // tile so edge pixels are compared with the same neighbours whatever
+    // the tiling; beyond the image the edge pixels stand in
+    int baseWidth = tileWidth + 2, baseHeight = tileHeight + 2;
+    std::vector<BaseSample> base(size_t(baseWidth) * baseHeight);
+    for (int j = 0; j < baseHeight; ++j)
+        for (int i = 0; i < baseWidth; ++i)
+        {
+            int px = std::min(std::max(x + i - 1, 0), width - 1);
+            int py = std::min(std::max(y + j - 1, 0), height - 1);
+            vec2 coordinates((px + 0.5f) / width * 2 - 1, (py + 0.5f) / height * 2 - 1);
+
+            Hit hit;
+            BaseSample &sample = base[size_t(j) * baseWidth + i];
+            sample.colour = Trace(coordinates, hit, sample.shadowed);
+            sample.t = hit.t;
+            sample.kind = hit.kind;
+            sample.index = hit.index;
+        }
+    int rays = baseWidth * baseHeight;
+
+    for (int j = 0; j < tileHeight; ++j)
+        for (int i = 0; i < tileWidth; ++i)
+        {
+            const BaseSample *centre = &base[size_t(j + 1) * baseWidth + i + 1];
+            vec3 &colour = colours[size_t(j) * tileWidth + i];
+            colour = centre->colour;
+            if (maxSamples <= 1 || !(Differs(*centre, centre[-1]) || Differs(*centre, centre[1]) ||
+                            Differs(*centre, centre[-baseWidth]) || Differs(*centre, centre[baseWidth])))
+                continue;
+
+            // an edge or shadow boundary runs through the pixel
+            colour = Supersample(*this, x + i, y + j, width, height, maxSamples);
+            rays += maxSamples;
+        }
+    return rays;
+}
+
+// --------------------------------------------------------------------------
+
+int RayTracer::TraceCost(vec2 coordinates) const
+{
+    // counted along the way like the shader's tests, so every build has it
+    Hit hit;
+    bool shadowed;
+    int tests = 0;
+    Trace(coordinates, hit, shadowed, &tests);
+    return tests;
+}
+
+int RayTracer::MaxCost() const
+{
+    return 2 * (m_scene.planeCount + m_scene.sphereCount + 2 * m_scene.triangleCount);
+}
+
+void RayTracer::RenderCostTile(int x, int y, int tileWidth, int tileHeight,
+                               int width, int height, vec3 *colours, int maxCost) const
+{
+    TimelineScope scope("trace tile", "x", x, "y", y);
+    for (int j = 0; j < tileHeight; ++j)
+        for (int i = 0; i < tileWidth; ++i)
+        {
+            vec2 coordinates((x + i + 0.5f) / width * 2 - 1, (y + j + 0.5f) / height * 2 - 1);
+            float cost = float(TraceCost(coordinates)) / std::max(1, maxCost);
+            colours[size_t(j) * tileWidth + i] = HeatmapColour(cost);
+        }
+}
+
+// --------------------------------------------------------------------------
+
+vec3 HeatmapColour(float cost)
+{
+    // blue through cyan, green and yellow to red, fading in from black
+    float t = clamp(cost, 0.f, 1.f);
+    vec3 colour(clamp(1.5f - std::abs(4 * t - 3), 0.f, 1.f),
+                clamp(1.5f - std::abs(4 * t - 2), 0.f, 1.f),
+                clamp(1.5f - std::abs(4 * t - 1), 0.f, 1.f));
+    return colour * std::min(1.f, 8 * t);
+}
+
+// --------------------------------------------------------------------------
@@ -0,0 +1,104 @@
+// ==========================================================================
+// CPU Ray Tracer
+//  - traces the same scenes as fragment.glsl on the CPU, reading the packed
+//    SceneBlock the shader gets, for renders that don't fit a window
+// ==========================================================================
+#ifndef RAYTRACER_H
+#define RAYTRACER_H
+
+#include <glm/vec2.hpp>
+#include <glm/vec3.hpp>
+#include "Scene.h"
+
+// primitive kinds, matching the KIND_ defines in fragment.glsl
+enum PrimitiveKind { KIND_NONE = -1, KIND_PLANE, KIND_SPHERE, KIND_TRIANGLE };
+
+// closest intersection along a ray
+struct Hit
+{
+    float     t;
+    int       kind;
+    int       index;
+    glm::vec3 normal;
+
+    // the hit is on the scene 3 back wall, which casts no shadows onto it
+    bool      backdrop;
+};
+
+// --------------------------------------------------------------------------
+// This class shades pixels exactly as the full pass of fragment.glsl does:
+// Phong lighting with a single hard shadow ray per hit.
+
+class RayTracer
+{
+    SceneBlock  m_scene;
+    glm::vec3   m_eye;
+
+public:
+    RayTracer(const SceneBlock &scene, glm::vec3 eye);
+
+    const SceneBlock &Scene() const { return m_scene; }
+    glm::vec3 Eye() const { return m_eye; }
+
+    // move the camera, the scene stays as it is
+    void SetEye(glm::vec3 eye) { m_eye = eye; }
+
+    // primary ray direction through a point of the image plane, which spans
+    // [-1,1] on both axes like the shader's Coordinates
+    glm::vec3 Direction(glm::vec2 coordinates) const;
+
+    // closest primitive along a ray, t is 1000000 when nothing was hit;
+    // these routines add the intersection tests they make to tests if given,
+    // a triangle that gets past its plane test counting twice
+    Hit ClosestHit(glm::vec3 origin, glm::vec3 direction, int *tests = 0) const;
+
+    // true if something lies between the point and the light
+    bool Shadowed(glm::vec3 point, int *tests = 0) const;
+
+    // colour of a primary hit at point, optionally saying whether the light
+    // was blocked
+    glm::vec3 Shade(glm::vec3 point, const Hit &hit, bool *shadowed = 0, int *tests = 0) const;
+
+    // colour seen through a point of the image plane
+    glm::vec3 Trace(glm::vec2 coordinates) const;
+
+    // the same, also giving the primary hit and whether it is in shadow
+    glm::vec3 Trace(glm::vec2 coordinates, Hit &hit, bool &shadowed, int *tests = 0) const;
+
+    // colours of the pixel centres of a tile of a width x height image:
+    //  - (x,y) is the bottom-left pixel of the tile, (0,0) is the
+    //    bottom-left pixel of the image
+    //  - colours receives the tile row by row from its bottom row up
+    //  - with more than one sample, each pixel averages that many rays
+    //    through the points of its Sampler
+    void RenderTile(int x, int y, int tileWidth, int tileHeight,
+                    int width, int height, glm::vec3 *colours, int samples = 1) const;
+
+    // anti-aliased tile laid out as in RenderTile(), tracing one ray per
+    // pixel and then maxSamples rays as in RenderTile() only for pixels
+    // whose primitive, depth, shadow or colour differs from a neighbour's;
+    // returns the number of rays traced
+    int RenderAdaptiveTile(int x, int y, int tileWidth, int tileHeight,
+                           int width, int height, glm::vec3 *colours, int maxSamples) const;
+
+    // intersection tests made by the primary ray through a point of the
+    // image plane and by its shadow ray, a triangle that gets past its plane
+    // test counting twice
+    int TraceCost(glm::vec2 coordinates) const;
+
+    // most tests one pixel can take, both rays testing every primitive
+    int MaxCost() const;
+
+    // false colour heatmap of TraceCost() at the pixel centres of a tile,
+    // laid out as in RenderTile(), from black for no tests up to red for
+    // maxCost or more
+    void RenderCostTile(int x, int y, int tileWidth, int tileHeight,
+                        int width, int height, glm::vec3 *colours, int maxCost) const;
+};
+
+// colour of a cost between 0 and 1 on the heatmap scale, the same ramp as
+// heatColour() in fragment.glsl
+glm::vec3 HeatmapColour(float cost);
+
+// --------------------------------------------------------------------------
+#endif // RAYTRACER_H
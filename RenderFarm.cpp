@@ -0,0 +1,355 @@
+// ==========================================================================
+// Render Farm Support Code
+//
+// The coordinator sends a JOB when a worker connects, then one TILE at a
+// time; the worker answers each TILE with a RESULT holding the tile's
+// colours, bottom row first. A worker that stalls part way through a
+// message is treated as dead: it is killed and its tile handed out again.
+// ==========================================================================
+
+#include "RenderFarm.h"
+#include "RayTracer.h"
+#include "MappedImage.h"
+#include "LocalSocket.h"
+
+#include <iostream>
+#include <deque>
+#include <chrono>
+#include <algorithm>
+#include <cstring>
+#include <stdint.h>
+
+#ifndef _WIN32
+	#include <unistd.h>
+	#include <poll.h>
+	#include <signal.h>
+	#include <sys/socket.h>
+	#include <sys/wait.h>
+#endif
+
+using namespace std;
+using namespace glm;
+
+enum MessageType { MSG_JOB = 1, MSG_TILE, MSG_RESULT, MSG_QUIT };
+
+// longest a worker may stop sending or reading part way through a message
+static const int WORKER_TIMEOUT_MS = 10000;
+
+// a tile as sent in MSG_TILE, and in front of the colours of MSG_RESULT
+struct TileMessage
+{
+    int32_t index, x, y, width, height;
+};
+
+RenderFarm::RenderFarm(const string &program, int workers)
+    : m_program(program), m_workers(std::max(workers, 1))
+{
+}
+
+size_t RenderFarm::MaxTilePixels()
+{
+    return (MAX_MESSAGE_PAYLOAD - sizeof(TileMessage)) / sizeof(vec3);
+}
+
+#ifdef _WIN32
+
+// --------------------------------------------------------------------------
+
+bool RenderFarm::Render(const FarmJob &, MappedImage &, vector<unsigned char> &,
+                        const function<bool(int)> &, const volatile sig_atomic_t *)
+{
+    cout << "RenderFarm ERROR: Worker processes need Unix domain sockets" << endl;
+    return false;
+}
+
+int RunFarmWorker(const string &)
+{
+    cout << "RenderFarm ERROR: Worker processes need Unix domain sockets" << endl;
+    return 1;
+}
+
+#else
+
+// --------------------------------------------------------------------------
+// Worker
+
+int RunFarmWorker(const string &socketName)
+{
+    int server = ConnectLocal(socketName);
+    if (server < 0)
+    {
+        cout << "RenderFarm ERROR: Worker could not connect to " << socketName << endl;
+        return 1;
+    }
+
+    uint32_t type;
+    vector<unsigned char> payload;
+    if (!ReceiveMessage(server, type, payload) || type != MSG_JOB || payload.size() != sizeof(FarmJob))
+    {
+        CloseLocal(server);
+        return 1;
+    }
+    FarmJob job;
+    memcpy(&job, &payload[0], sizeof(job));
+    RayTracer tracer(job.scene, job.eye);
+
+    vector<vec3> colours;
+    while (ReceiveMessage(server, type, payload) && type == MSG_TILE &&
+           payload.size() == sizeof(TileMessage))
+    {
+        TileMessage tile;
+        memcpy(&tile, &payload[0], sizeof(tile));
+        colours.resize(size_t(tile.width) * tile.height);
+        if (job.heatmapScale > 0)
+            tracer.RenderCostTile(tile.x, tile.y, tile.width, tile.height, job.width, job.height,
+                                  &colours[0], job.heatmapScale);
+        else if (job.aaSamples > 1)
+            tracer.RenderAdaptiveTile(tile.x, tile.y, tile.width, tile.height, job.width, job.height,
+                                      &colours[0], job.aaSamples);
+        else
+            tracer.RenderTile(tile.x, tile.y, tile.width, tile.height, job.width, job.height,
+                              &colours[0]);
+
+        if (!SendMessage(server, MSG_RESULT, &tile, sizeof(tile),
+                         &colours[0], colours.size() * sizeof(vec3)))
+            break;
+    }
+
+    CloseLocal(server);
+    return 0;
+}
+
+// --------------------------------------------------------------------------
+// Coordinator
+
+typedef chrono::steady_clock Clock;
+
+// a connected worker, its process if known and the tile it is rendering,
+// -1 when idle
+struct Connection
+{
+    int                 socket;
+    pid_t               pid;
+    int                 tile;
+    Clock::time_point   started;
+};
+
+bool RenderFarm::Render(const FarmJob &job, MappedImage &image, vector<unsigned char> &tileDone,
+                        const function<bool(int)> &bandFinished,
+                        const volatile sig_atomic_t *stop)
+{
+    int tilesAcross = (job.width + job.tileSize - 1) / job.tileSize;
+    int tilesDown = (job.height + job.tileSize - 1) / job.tileSize;
+    int tileCount = tilesAcross * tilesDown;
+
+    // tiles left to hand out, how many workers have each one and how many
+    // tiles of each band are still missing
+    deque<int> pending;
+    vector<int> assigned(tileCount, 0);
+    vector<int> bandRemaining(tilesDown, 0);
+    for (int i = 0; i < tileCount; ++i)
+        if (!tileDone[i])
+        {
+            pending.push_back(i);
+            ++bandRemaining[i / tilesAcross];
+        }
+    int remaining = int(pending.size());
+    if (remaining == 0)
+        return true;
+
+    string socketName = "/tmp/raytracer-farm-" + to_string(getpid()) + ".sock";
+    int listener = ListenLocal(socketName, m_workers);
+    if (listener < 0)
+    {
+        cout << "RenderFarm ERROR: Could not listen on " << socketName << endl;
+        return false;
+    }
+
+    // each worker may be replaced twice before the farm gives up
+    vector<pid_t> children;
+    int spawnBudget = 3 * m_workers;
+    vector<Connection> connections;
+
+    double tileSeconds = 0;
+    int tilesTimed = 0;
+    bool stopped = false;
+
+    while (remaining > 0 && !stopped && !*stop)
+    {
+        // collect workers that exited and start replacements
+        int status;
+        pid_t pid;
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+            children.erase(std::remove(children.begin(), children.end(), pid), children.end());
+
+        while (int(children.size()) < m_workers && spawnBudget > 0)
+        {
+            --spawnBudget;
+            pid = fork();
+            if (pid == 0)
+            {
+                execlp(m_program.c_str(), m_program.c_str(), "--worker", socketName.c_str(), (char *) 0);
+                _exit(127);
+            }
+            if (pid > 0)
+                children.push_back(pid);
+        }
+        if (children.empty())
+        {
+            cout << "RenderFarm ERROR: Every worker process failed" << endl;
+            break;
+        }
+
+        // tiles out for much longer than usual are given to idle workers
+        // too once nothing else is left, in case their worker is stuck
+        double average = tilesTimed ? tileSeconds / tilesTimed : 0;
+        double overdue = std::max(1.0, 8 * average);
+        Clock::time_point now = Clock::now();
+
+        for (size_t c = 0; c < connections.size(); ++c)
+        {
+            Connection &worker = connections[c];
+            if (worker.tile >= 0)
+                continue;
+
+            int tile = -1;
+            while (!pending.empty() && tile < 0)
+            {
+                tile = pending.front();
+                pending.pop_front();
+                if (tileDone[tile]) tile = -1;
+            }
+            for (size_t o = 0; tile < 0 && o < connections.size(); ++o)
+            {
+                const Connection &other = connections[o];
+                if (other.tile >= 0 && assigned[other.tile] == 1 &&
+                    chrono::duration<double>(now - other.started).count() > overdue)
+                    tile = other.tile;
+            }
+            if (tile < 0)
+                break;
+
+            TileMessage message;
+            message.index = tile;
+            message.x = (tile % tilesAcross) * job.tileSize;
+            message.y = (tile / tilesAcross) * job.tileSize;
+            message.width = std::min(job.tileSize, job.width - message.x);
+            message.height = std::min(job.tileSize, job.height - message.y);
+
+            worker.tile = tile;
+            worker.started = now;
+            ++assigned[tile];
+            if (!SendMessage(worker.socket, MSG_TILE, &message, sizeof(message)))
+                shutdown(worker.socket, SHUT_RDWR);
+        }
+
+        vector<pollfd> polls(1 + connections.size());
+        polls[0].fd = listener;
+        polls[0].events = POLLIN;
+        for (size_t c = 0; c < connections.size(); ++c)
+        {
+            polls[1 + c].fd = connections[c].socket;
+            polls[1 + c].events = POLLIN;
+        }
+        if (poll(&polls[0], polls.size(), 100) <= 0)
+            continue;
+
+        // read results, a worker whose socket fails or closes has died
+        for (size_t c = connections.size(); c-- > 0; )
+        {
+            if (!polls[1 + c].revents)
+                continue;
+
+            Connection &worker = connections[c];
+            uint32_t type;
+            vector<unsigned char> payload;
+            TileMessage tile;
+            bool alive = ReceiveMessage(worker.socket, type, payload) && type == MSG_RESULT &&
+                         payload.size() >= sizeof(tile);
+            if (alive)
+            {
+                memcpy(&tile, &payload[0], sizeof(tile));
+                alive = tile.index == worker.tile &&
+                        payload.size() == sizeof(tile) + size_t(tile.width) * tile.height * sizeof(vec3);
+            }
+
+            if (!alive)
+            {
+                if (worker.tile >= 0 && --assigned[worker.tile] == 0 && !tileDone[worker.tile])
+                    pending.push_front(worker.tile);
+
+                // a worker that timed out may still be running but stuck,
+                // stop it so a replacement is started
+                if (worker.pid > 0 &&
+                    std::find(children.begin(), children.end(), worker.pid) != children.end())
+                    kill(worker.pid, SIGKILL);
+                CloseLocal(worker.socket);
+                connections.erase(connections.begin() + c);
+                continue;
+            }
+
+            --assigned[tile.index];
+            worker.tile = -1;
+            tileSeconds += chrono::duration<double>(Clock::now() - worker.started).count();
+            ++tilesTimed;
+
+            // the first result for a tile wins
+            if (tileDone[tile.index])
+                continue;
+            image.WriteTile(tile.x, tile.y, tile.width, tile.height,
+                            (const vec3 *) &payload[sizeof(tile)]);
+            tileDone[tile.index] = 1;
+            --remaining;
+
+            int band = tile.index / tilesAcross;
+            if (--bandRemaining[band] == 0 && !bandFinished(band))
+                stopped = true;
+        }
+
+        // new workers get the job straight away
+        if (polls[0].revents & POLLIN)
+        {
+            int socket = AcceptLocal(listener);
+            if (socket >= 0)
+            {
+                Connection worker = { socket, pid_t(LocalPeerProcess(socket)), -1, Clock::now() };
+                if (SetLocalTimeouts(socket, WORKER_TIMEOUT_MS, WORKER_TIMEOUT_MS) &&
+                    SendMessage(socket, MSG_JOB, &job, sizeof(job)))
+                    connections.push_back(worker);
+                else
+                    CloseLocal(socket);
+            }
+        }
+    }
+
+    // let the workers finish, and stop any that are stuck
+    for (size_t c = 0; c < connections.size(); ++c)
+    {
+        SendMessage(connections[c].socket, MSG_QUIT, 0, 0);
+        CloseLocal(connections[c].socket);
+    }
+    CloseLocal(listener);
+    unlink(socketName.c_str());
+
+    Clock::time_point deadline = Clock::now() + chrono::seconds(2);
+    while (!children.empty())
+    {
+        pid_t pid = waitpid(-1, 0, WNOHANG);
+        if (pid > 0)
+            children.erase(std::remove(children.begin(), children.end(), pid), children.end());
+        else if (Clock::now() > deadline)
+        {
+            for (size_t i = 0; i < children.size(); ++i)
+                kill(children[i], SIGKILL);
+            deadline = Clock::now() + chrono::hours(1);
+        }
+        else
+            usleep(10000);
+    }
+
+    return remaining == 0;
+}
+
+#endif
+
+// --------------------------------------------------------------------------
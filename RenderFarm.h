@@ -0,0 +1,76 @@
+// ==========================================================================
+// Render Farm Support Code
+//  - a coordinator that hands the tiles of a frame to worker processes over
+//    a Unix domain socket and stitches their results into the output image,
+//    and the worker loop on the other end
+// ==========================================================================
+#ifndef RENDERFARM_H
+#define RENDERFARM_H
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <csignal>
+#include <glm/vec3.hpp>
+#include "Scene.h"
+
+class MappedImage;
+
+// everything a worker needs to render tiles of a frame, sent to each worker
+// when it connects so workers never read scene files themselves
+struct FarmJob
+{
+    SceneBlock  scene;
+    glm::vec3   eye;
+    int         width, height;
+    int         tileSize;
+
+    // tests shown as red by a heatmap of intersection tests, see
+    // RayTracer::RenderCostTile(), or 0 for the shaded scene
+    int         heatmapScale;
+
+    // most rays per pixel of adaptive anti-aliasing, see
+    // RayTracer::RenderAdaptiveTile(), 1 for a single ray
+    int         aaSamples;
+};
+
+// --------------------------------------------------------------------------
+// Coordinator side. Workers are started by running program with
+// "--worker SOCKET" and connect back to the coordinator's socket.
+//  - tiles of a worker that dies go back in the queue and a replacement
+//    worker is started
+//  - once the queue is empty, tiles that have been out far longer than
+//    tiles usually take are handed to idle workers as well, the first
+//    result to arrive is kept
+
+class RenderFarm
+{
+    std::string m_program;
+    int         m_workers;
+
+public:
+    RenderFarm(const std::string &program, int workers);
+
+    // most pixels a tile may have, so its result fits in one message
+    static size_t MaxTilePixels();
+
+    // render every tile not yet set in tileDone (one flag per tile, row by
+    // row from the bottom-left tile) into image:
+    //  - bandFinished(band) is called once the last tile of a band of tiles
+    //    is written, and stops the render if it returns false
+    //  - the render also stops when *stop becomes non-zero
+    // returns true if every tile was rendered
+    bool Render(const FarmJob &job, MappedImage &image, std::vector<unsigned char> &tileDone,
+                const std::function<bool(int)> &bandFinished,
+                const volatile std::sig_atomic_t *stop);
+};
+
+// --------------------------------------------------------------------------
+// Worker side, connects to the coordinator's socket and renders the tiles
+// it is sent until it is told to stop or the coordinator goes away, returns
+// the process exit code
+
+int RunFarmWorker(const std::string &socketName);
+
+// --------------------------------------------------------------------------
+#endif // RENDERFARM_H
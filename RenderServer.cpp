@@ -0,0 +1,256 @@
+// ==========================================================================
+// Render Server Support Code
+//
+// A client sends RENDER messages holding a RenderRequest and gets back an
+// IMAGE message for each, the width and height followed by the colours
+// bottom row first, or an ERROR message with the reason as text. A client
+// may send any number of requests on one connection. The server waits on
+// the listener and every client at once and serves one request from each
+// client that has one in turn, each job using every thread of the pool;
+// clients that stay idle, or stall part way through a message in either
+// direction, are dropped so they can't hold up the others.
+// ==========================================================================
+
+#include "RenderServer.h"
+#include "RayTracer.h"
+#include "FrameWriter.h"
+#include "LocalSocket.h"
+#include "Parallel.h"
+
+#include <iostream>
+#include <map>
+#include <vector>
+#include <chrono>
+#include <cstring>
+
+#ifndef _WIN32
+	#include <poll.h>
+#endif
+
+using namespace std;
+using namespace glm;
+
+enum ServerMessage { MSG_RENDER = 16, MSG_IMAGE, MSG_ERROR };
+
+// in front of the colours of an IMAGE message
+struct ImageHeader
+{
+    int32_t width, height;
+};
+
+// longest IMAGE message, and the largest image it may carry
+static const uint32_t MAX_IMAGE_PAYLOAD = 0x7fffffff;
+static const size_t MAX_IMAGE_BYTES = MAX_IMAGE_PAYLOAD - sizeof(ImageHeader);
+
+typedef chrono::steady_clock Clock;
+
+// a connection that sends no request for this long is closed
+static const int CLIENT_IDLE_SECONDS = 60;
+
+// longest a client may stall while sending a request or reading a reply
+static const int REQUEST_TIMEOUT_MS = 5000;
+static const int REPLY_TIMEOUT_MS = 10000;
+
+#ifdef _WIN32
+
+// --------------------------------------------------------------------------
+
+int RunRenderServer(const string &, const SceneLoader &, const volatile sig_atomic_t *)
+{
+    cout << "RenderServer ERROR: The server needs Unix domain sockets" << endl;
+    return 1;
+}
+
+#else
+
+// --------------------------------------------------------------------------
+// Server
+
+// packed scene and starting camera of a scene id
+struct LoadedScene
+{
+    SceneBlock  block;
+    vec3        eye;
+};
+
+struct ServerClient
+{
+    int                 socket;
+    Clock::time_point   lastRequest;
+};
+
+static bool SendError(int client, const string &message)
+{
+    cout << "RenderServer: " << message << endl;
+    return SendMessage(client, MSG_ERROR, message.c_str(), message.size());
+}
+
+// render one request and send back the image, returns false if the client
+// has gone away
+static bool ServeRequest(int client, const RenderRequest &request, const SceneLoader &loadScene,
+                         map<int, LoadedScene> &scenes, ThreadPool &pool)
+{
+    if (request.width <= 0 || request.height <= 0 || request.samples < 1 ||
+        size_t(request.width) * request.height * sizeof(vec3) > MAX_IMAGE_BYTES)
+        return SendError(client, "Invalid image size or sample count");
+
+    Clock::time_point start = Clock::now();
+
+    // scenes are packed once and kept for every later job
+    map<int, LoadedScene>::iterator scene = scenes.find(request.scene);
+    if (scene == scenes.end())
+    {
+        LoadedScene loaded;
+        if (!loadScene(request.scene, loaded.block, loaded.eye))
+            return SendError(client, "Unknown scene " + to_string(request.scene));
+        scene = scenes.insert(make_pair(request.scene, loaded)).first;
+        cout << "RenderServer: Loaded scene " << request.scene << endl;
+    }
+
+    vec3 eye = request.useEye ? vec3(request.eye[0], request.eye[1], request.eye[2])
+                              : scene->second.eye;
+    RayTracer tracer(scene->second.block, eye);
+
+    int width = request.width, height = request.height;
+    vector<vec3> pixels(size_t(width) * height);
+    pool.ParallelFor(height, 4, [&](int begin, int end)
+    {
+        tracer.RenderTile(0, begin, width, end - begin, width, height,
+                          &pixels[size_t(begin) * width], request.samples);
+    });
+
+    ImageHeader header = { width, height };
+    bool sent = SendMessage(client, MSG_IMAGE, &header, sizeof(header),
+                            &pixels[0], pixels.size() * sizeof(vec3), MAX_IMAGE_PAYLOAD);
+
+    cout << "RenderServer: Scene " << request.scene << " at " << width << "x" << height
+         << ", " << request.samples << " samples in "
+         << chrono::duration<double, milli>(Clock::now() - start).count() << " ms" << endl;
+    return sent;
+}
+
+int RunRenderServer(const string &socketName, const SceneLoader &loadScene,
+                    const volatile sig_atomic_t *stop)
+{
+    int listener = ListenLocal(socketName, 16);
+    if (listener < 0)
+    {
+        cout << "RenderServer ERROR: Could not listen on " << socketName << endl;
+        return 1;
+    }
+    cout << "RenderServer: Listening on " << socketName << endl;
+
+    map<int, LoadedScene> scenes;
+    ThreadPool pool;
+
+    vector<ServerClient> clients;
+
+    // waits are short so a stop request is noticed promptly
+    while (!*stop)
+    {
+        vector<pollfd> polls(1 + clients.size());
+        polls[0].fd = listener;
+        polls[0].events = POLLIN;
+        for (size_t c = 0; c < clients.size(); ++c)
+        {
+            polls[1 + c].fd = clients[c].socket;
+            polls[1 + c].events = POLLIN;
+        }
+        int ready = poll(&polls[0], polls.size(), 200);
+
+        // one request from each client with one waiting, then the next round
+        // of polling, so a client with a batch of jobs doesn't starve others
+        Clock::time_point now = Clock::now();
+        vector<ServerClient> kept;
+        for (size_t c = 0; c < clients.size(); ++c)
+        {
+            ServerClient client = clients[c];
+            bool alive = now - client.lastRequest < chrono::seconds(CLIENT_IDLE_SECONDS);
+            if (ready > 0 && polls[1 + c].revents && !*stop)
+            {
+                uint32_t type;
+                vector<unsigned char> payload;
+                alive = ReceiveMessage(client.socket, type, payload) && type == MSG_RENDER &&
+                        payload.size() == sizeof(RenderRequest);
+                if (alive)
+                {
+                    RenderRequest job;
+                    memcpy(&job, &payload[0], sizeof(job));
+                    alive = ServeRequest(client.socket, job, loadScene, scenes, pool);
+                    client.lastRequest = Clock::now();
+                }
+            }
+
+            if (alive)
+                kept.push_back(client);
+            else
+                CloseLocal(client.socket);
+        }
+        clients.swap(kept);
+
+        if (ready > 0 && (polls[0].revents & POLLIN))
+        {
+            ServerClient client = { AcceptLocal(listener), Clock::now() };
+            if (client.socket >= 0 &&
+                SetLocalTimeouts(client.socket, REQUEST_TIMEOUT_MS, REPLY_TIMEOUT_MS))
+                clients.push_back(client);
+            else
+                CloseLocal(client.socket);
+        }
+    }
+
+    for (size_t c = 0; c < clients.size(); ++c)
+        CloseLocal(clients[c].socket);
+    CloseLocal(listener);
+    unlink(socketName.c_str());
+    cout << "RenderServer: Stopped" << endl;
+    return 0;
+}
+
+#endif
+
+// --------------------------------------------------------------------------
+// Client
+
+int SubmitRender(const string &socketName, const RenderRequest &request, const string &fileName)
+{
+    int server = ConnectLocal(socketName);
+    if (server < 0)
+    {
+        cout << "RenderServer ERROR: No server listening on " << socketName << endl;
+        return 1;
+    }
+
+    Clock::time_point start = Clock::now();
+    uint32_t type = 0;
+    vector<unsigned char> payload;
+    bool received = SendMessage(server, MSG_RENDER, &request, sizeof(request)) &&
+                    ReceiveMessage(server, type, payload, MAX_IMAGE_PAYLOAD);
+    CloseLocal(server);
+
+    if (!received)
+    {
+        cout << "RenderServer ERROR: Lost the connection to " << socketName << endl;
+        return 1;
+    }
+    if (type == MSG_ERROR)
+    {
+        cout << "RenderServer ERROR: " << string(payload.begin(), payload.end()) << endl;
+        return 1;
+    }
+
+    ImageHeader header;
+    if (type != MSG_IMAGE || payload.size() < sizeof(header))
+        return 1;
+    memcpy(&header, &payload[0], sizeof(header));
+    if (payload.size() != sizeof(header) + size_t(header.width) * header.height * sizeof(vec3))
+        return 1;
+
+    cout << "Rendered " << header.width << "x" << header.height << " in "
+         << chrono::duration<double, milli>(Clock::now() - start).count() << " ms" << endl;
+
+    return SaveFrame(fileName, header.width, header.height,
+                     (const vec3 *) &payload[sizeof(header)]) ? 0 : 1;
+}
+
+// --------------------------------------------------------------------------
@@ -0,0 +1,46 @@
+// ==========================================================================
+// Render Server Support Code
+//  - a long running process that keeps packed scenes and its threads
+//    between jobs, taking render requests over a Unix domain socket and
+//    answering with the rendered pixels, and the client that submits them
+// ==========================================================================
+#ifndef RENDERSERVER_H
+#define RENDERSERVER_H
+
+#include <string>
+#include <functional>
+#include <csignal>
+#include <stdint.h>
+#include <glm/vec3.hpp>
+#include "Scene.h"
+
+// one render job, sent as is over the socket
+struct RenderRequest
+{
+    int32_t     scene;
+    int32_t     width, height;
+    int32_t     samples;
+
+    // camera position, the scene's starting position unless useEye is set
+    int32_t     useEye;
+    float       eye[3];
+};
+
+// fills in the packed scene and starting camera position of a scene id,
+// returns false for an unknown scene
+typedef std::function<bool(int scene, SceneBlock &block, glm::vec3 &eye)> SceneLoader;
+
+// serve render requests on socketName until *stop becomes non-zero, scenes
+// are packed with loadScene the first time they are asked for and kept,
+// returns the process exit code
+int RunRenderServer(const std::string &socketName, const SceneLoader &loadScene,
+                    const volatile std::sig_atomic_t *stop);
+
+// send a request to a server and save the image it returns to fileName,
+// which may be a .png, .ppm, .pfm or .exr file, returns the process exit
+// code
+int SubmitRender(const std::string &socketName, const RenderRequest &request,
+                 const std::string &fileName);
+
+// --------------------------------------------------------------------------
+#endif // RENDERSERVER_H
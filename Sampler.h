@@ -0,0 +1,111 @@
+// ==========================================================================
+// Sampler Support Code
+//  - low discrepancy sample points in [0,1) from the first two dimensions
+//    of the Sobol sequence, Owen scrambled with the hash of Burley 2020
+//    ("Practical Hash-based Owen Scrambling")
+//  - every pair of dimensions a sample uses gets its own scramble and its
+//    own shuffle of the sequence, so pairs don't correlate with each other
+//  - points depend only on the pixel, the sample index and the dimension,
+//    never on which thread asks for them or in what order
+// ==========================================================================
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <stdint.h>
+#include <glm/vec2.hpp>
+
+inline uint32_t ReverseBits(uint32_t x)
+{
+    x = (x << 16) | (x >> 16);
+    x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+    x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+    x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+    x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+    return x;
+}
+
+// hash of the bits of x that only lets each bit depend on the bits below
+// it, which reversed is a random nested permutation of the intervals of
+// [0,1): an Owen scramble
+inline uint32_t LaineKarrasPermutation(uint32_t x, uint32_t seed)
+{
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return x;
+}
+
+inline uint32_t OwenScramble(uint32_t x, uint32_t seed)
+{
+    return ReverseBits(LaineKarrasPermutation(ReverseBits(x), seed));
+}
+
+// seeds for different pixels and dimensions from one another
+inline uint32_t HashCombine(uint32_t seed, uint32_t value)
+{
+    return seed ^ (value + 0x9e3779b9u + (seed << 6) + (seed >> 2));
+}
+
+// the first two Sobol dimensions as 32 bit fractions; the second is the
+// generator matrix of x + 1 applied a bit at a time, masked rather than
+// branched on
+inline uint32_t Sobol0(uint32_t index)
+{
+    return ReverseBits(index);
+}
+
+inline uint32_t Sobol1(uint32_t index)
+{
+    uint32_t x = 0, v = 0x80000000u;
+    for (int bit = 0; bit < 32; ++bit)
+    {
+        x ^= (0u - ((index >> bit) & 1u)) & v;
+        v ^= v >> 1;
+    }
+    return x;
+}
+
+// fraction to a float below 1, keeping the 24 bits a float can hold
+inline float ToUnit(uint32_t x)
+{
+    return (x >> 8) * (1.f / 16777216.f);
+}
+
+// --------------------------------------------------------------------------
+// Hands out the dimensions of one sample in turn. Samples 0..2^k-1 of a
+// pixel are a scrambled (0,k,2) net in each pair of dimensions, so any
+// power of two count is well stratified and others are close to it.
+
+class Sampler
+{
+    uint32_t    m_seed;
+    uint32_t    m_index;
+    uint32_t    m_dimension;
+
+    // a seed for the next dimension, different for every pixel
+    uint32_t NextSeed() { return HashCombine(m_seed, m_dimension++); }
+
+public:
+    // sample index of a pixel, identified by any number unique in the image
+    Sampler(uint32_t pixel, uint32_t index)
+        : m_seed(HashCombine(0x2545f491u, pixel)), m_index(index), m_dimension(0) {}
+
+    float Get1D()
+    {
+        uint32_t shuffled = OwenScramble(m_index, NextSeed());
+        return ToUnit(OwenScramble(Sobol0(shuffled), NextSeed()));
+    }
+
+    glm::vec2 Get2D()
+    {
+        uint32_t shuffled = OwenScramble(m_index, NextSeed());
+        uint32_t x = OwenScramble(Sobol0(shuffled), NextSeed());
+        uint32_t y = OwenScramble(Sobol1(shuffled), NextSeed());
+        return glm::vec2(ToUnit(x), ToUnit(y));
+    }
+};
+
+// --------------------------------------------------------------------------
+#endif // SAMPLER_H
@@ -0,0 +1,40 @@
+// ==========================================================================
+// Scene Data Layout
+//  - the packed scene shared by the fragment shader's Scene uniform block
+//    and the CPU ray tracer, so both read exactly the same numbers
+// ==========================================================================
+#ifndef SCENE_H
+#define SCENE_H
+
+#include <glm/vec4.hpp>
+
+// array sizes of the Scene block, these match the defines in fragment.glsl
+const int MAX_PLANES = 4;
+const int MAX_SPHERES = 4;
+const int MAX_TRIANGLES = 64;
+
+// std140 layout of the Scene block, one vec4 per point or colour
+struct SceneBlock
+{
+	glm::vec4 light;
+	int       planeCount, sphereCount, triangleCount, padding;
+
+	glm::vec4 planeVert[2*MAX_PLANES];
+	glm::vec4 sphereVert[MAX_SPHERES];
+	glm::vec4 triangleVert[MAX_TRIANGLES];
+
+	glm::vec4 triangleEdge1[MAX_TRIANGLES];
+	glm::vec4 triangleEdge2[MAX_TRIANGLES];
+	glm::vec4 triangleNormal[MAX_TRIANGLES];
+
+	glm::vec4 planeColor[MAX_PLANES];
+	glm::vec4 sphereColor[MAX_SPHERES];
+	glm::vec4 triangleColor[MAX_TRIANGLES];
+
+	glm::vec4 planeLight[MAX_PLANES];
+	glm::vec4 sphereLight[MAX_SPHERES];
+	glm::vec4 triangleLight[MAX_TRIANGLES];
+};
+
+// --------------------------------------------------------------------------
+#endif // SCENE_H
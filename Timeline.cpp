@@ -0,0 +1,213 @@
+// ==========================================================================
+// Timeline Support Code
+//
+// Each thread appends finished events to its own list, registered the first
+// time it records something, so recording takes no locks. Lists of threads
+// that exit are kept by the registry until the timeline is saved.
+// ==========================================================================
+
+#include "Timeline.h"
+
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+
+using namespace std;
+
+typedef chrono::steady_clock Clock;
+
+struct TimelineEvent
+{
+    const char  *name;
+    const char  *argNames[2];
+    int         args[2];
+    int64_t     begin, end;
+};
+
+struct ThreadTimeline
+{
+    int                     id;
+    string                  name;
+    vector<TimelineEvent>   events;
+};
+
+// events of the threads that are running and of those that have exited
+struct TimelineRegistry
+{
+    mutex                       lock;
+    vector<ThreadTimeline *>    live;
+    vector<ThreadTimeline>      retired;
+    int                         nextId;
+
+    TimelineRegistry() : nextId(1) {}
+};
+
+static atomic<bool> recording(false);
+static Clock::time_point timelineStart;
+
+static TimelineRegistry &Registry()
+{
+    static TimelineRegistry registry;
+    return registry;
+}
+
+struct ThreadEntry
+{
+    ThreadTimeline  timeline;
+
+    ThreadEntry()
+    {
+        TimelineRegistry &registry = Registry();
+        lock_guard<mutex> guard(registry.lock);
+        timeline.id = registry.nextId++;
+        registry.live.push_back(&timeline);
+    }
+
+    ~ThreadEntry()
+    {
+        TimelineRegistry &registry = Registry();
+        lock_guard<mutex> guard(registry.lock);
+        registry.live.erase(std::remove(registry.live.begin(), registry.live.end(), &timeline),
+                            registry.live.end());
+        if (!timeline.events.empty())
+            registry.retired.push_back(std::move(timeline));
+    }
+};
+
+static ThreadTimeline &ThisThread()
+{
+    static thread_local ThreadEntry entry;
+    return entry.timeline;
+}
+
+static int64_t Now()
+{
+    return chrono::duration_cast<chrono::nanoseconds>(Clock::now() - timelineStart).count();
+}
+
+// --------------------------------------------------------------------------
+
+void StartTimeline()
+{
+    timelineStart = Clock::now();
+    SetTimelineThreadName("main");
+    recording.store(true, memory_order_release);
+}
+
+bool TimelineActive()
+{
+    return recording.load(memory_order_acquire);
+}
+
+void SetTimelineThreadName(const char *name)
+{
+    ThisThread().name = name;
+}
+
+// a JSON event with the fields every event has, the caller adds the rest
+static void BeginEvent(ostream &out, const char *name, const char *phase, int thread)
+{
+    out << "    {\"name\": \"" << name << "\", \"ph\": \"" << phase
+        << "\", \"pid\": 1, \"tid\": " << thread;
+}
+
+static void WriteThread(ostream &out, const ThreadTimeline &timeline, bool &first)
+{
+    out << (first ? "" : ",\n");
+    first = false;
+    BeginEvent(out, "thread_name", "M", timeline.id);
+    out << ", \"args\": {\"name\": \"";
+    if (timeline.name.empty())
+        out << "thread " << timeline.id;
+    else
+        out << timeline.name;
+    out << "\"}}";
+
+    // times in microseconds, as the format expects
+    for (size_t i = 0; i < timeline.events.size(); ++i)
+    {
+        const TimelineEvent &event = timeline.events[i];
+        out << ",\n";
+        BeginEvent(out, event.name, "X", timeline.id);
+        out << ", \"ts\": " << event.begin / 1000.0
+            << ", \"dur\": " << (event.end - event.begin) / 1000.0;
+        if (event.argNames[0])
+        {
+            out << ", \"args\": {\"" << event.argNames[0] << "\": " << event.args[0];
+            if (event.argNames[1])
+                out << ", \"" << event.argNames[1] << "\": " << event.args[1];
+            out << "}";
+        }
+        out << "}";
+    }
+}
+
+bool SaveTimeline(const string &fileName)
+{
+    recording.store(false, memory_order_release);
+
+    ofstream file(fileName.c_str());
+    file << fixed << setprecision(3);
+    file << "{\n  \"displayTimeUnit\": \"ms\",\n  \"traceEvents\": [\n";
+
+    size_t events = 0;
+    {
+        TimelineRegistry &registry = Registry();
+        lock_guard<mutex> guard(registry.lock);
+        bool first = true;
+        for (size_t i = 0; i < registry.retired.size(); ++i)
+        {
+            WriteThread(file, registry.retired[i], first);
+            events += registry.retired[i].events.size();
+        }
+        for (size_t i = 0; i < registry.live.size(); ++i)
+        {
+            WriteThread(file, *registry.live[i], first);
+            events += registry.live[i]->events.size();
+            registry.live[i]->events.clear();
+        }
+        registry.retired.clear();
+    }
+    file << "\n  ]\n}\n";
+
+    if (!file)
+    {
+        cout << "Timeline ERROR: Failed to write " << fileName << endl;
+        return false;
+    }
+    cout << "Saved " << events << " timeline events to " << fileName << endl;
+    return true;
+}
+
+// --------------------------------------------------------------------------
+
+TimelineScope::TimelineScope(const char *name, const char *argName, int arg,
+                             const char *argName2, int arg2)
+    : m_name(name), m_begin(-1)
+{
+    if (!TimelineActive())
+        return;
+
+    m_argNames[0] = argName;
+    m_argNames[1] = argName ? argName2 : 0;
+    m_args[0] = arg;
+    m_args[1] = arg2;
+    m_begin = Now();
+}
+
+TimelineScope::~TimelineScope()
+{
+    if (m_begin < 0 || !TimelineActive())
+        return;
+
+    TimelineEvent event = { m_name, { m_argNames[0], m_argNames[1] },
+                            { m_args[0], m_args[1] }, m_begin, Now() };
+    ThisThread().events.push_back(event);
+}
+
+// --------------------------------------------------------------------------
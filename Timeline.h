@@ -0,0 +1,51 @@
+// ==========================================================================
+// Timeline Support Code
+//  - records when the stages of a frame begin and end on each thread (scene
+//    loading, tiles, shading passes, image conversion and saving) and saves
+//    them as Chrome trace event JSON, for chrome://tracing or Perfetto
+//  - nothing is recorded until StartTimeline() is called, until then a
+//    TimelineScope costs one check of a flag
+// ==========================================================================
+#ifndef TIMELINE_H
+#define TIMELINE_H
+
+#include <string>
+#include <stdint.h>
+
+// start recording, event times are measured from this call, which also
+// names the calling thread "main"
+void StartTimeline();
+
+// true between StartTimeline() and SaveTimeline()
+bool TimelineActive();
+
+// name shown for the calling thread in the viewer, threads without one are
+// shown as "thread N"
+void SetTimelineThreadName(const char *name);
+
+// stop recording and save the events of every thread, including threads
+// that have exited; call once no other thread is recording, returns false
+// if the file can't be written
+bool SaveTimeline(const std::string &fileName);
+
+// --------------------------------------------------------------------------
+// Records its own lifetime as one event on the calling thread. The name and
+// argument names must be string literals, only the pointers are kept.
+
+class TimelineScope
+{
+    const char  *m_name;
+    const char  *m_argNames[2];
+    int         m_args[2];
+
+    // nanoseconds since StartTimeline(), -1 when not recording
+    int64_t     m_begin;
+
+public:
+    explicit TimelineScope(const char *name, const char *argName = 0, int arg = 0,
+                           const char *argName2 = 0, int arg2 = 0);
+    ~TimelineScope();
+};
+
+// --------------------------------------------------------------------------
+#endif // TIMELINE_H
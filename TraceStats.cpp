@@ -0,0 +1,187 @@
+// ==========================================================================
+// Trace Statistics Support Code
+//
+// Each thread counts into its own TraceStats, so counting needs no locks or
+// atomic operations. The mutex is only taken when a thread first counts
+// something, when it exits, and when the counters are collected.
+// ==========================================================================
+
+#include "TraceStats.h"
+
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <mutex>
+#include <vector>
+#include <algorithm>
+
+using namespace std;
+
+static const char *statNames[STAT_COUNT] =
+{
+    "primary_rays", "shadow_rays",
+    "plane_tests", "sphere_tests", "triangle_tests",
+    "plane_hits", "sphere_hits", "triangle_hits", "misses",
+    "triangle_plane_rejects", "shadow_blocked"
+};
+
+// --------------------------------------------------------------------------
+
+TraceStats::TraceStats()
+{
+    std::fill(counts, counts + STAT_COUNT, 0);
+}
+
+TraceStats &TraceStats::operator+=(const TraceStats &other)
+{
+    for (int i = 0; i < STAT_COUNT; ++i)
+        counts[i] += other.counts[i];
+    return *this;
+}
+
+const char *TraceStatName(TraceStat stat)
+{
+    return stat >= 0 && stat < STAT_COUNT ? statNames[stat] : "";
+}
+
+// counters of the threads that are running, and the totals of those that
+// have exited
+struct StatsRegistry
+{
+    mutex                   lock;
+    vector<TraceStats *>    live;
+    TraceStats              retired;
+};
+
+static StatsRegistry &Registry()
+{
+    static StatsRegistry registry;
+    return registry;
+}
+
+struct ThreadStats
+{
+    TraceStats  stats;
+
+    ThreadStats()
+    {
+        StatsRegistry &registry = Registry();
+        lock_guard<mutex> guard(registry.lock);
+        registry.live.push_back(&stats);
+    }
+
+    ~ThreadStats()
+    {
+        StatsRegistry &registry = Registry();
+        lock_guard<mutex> guard(registry.lock);
+        registry.retired += stats;
+        registry.live.erase(std::remove(registry.live.begin(), registry.live.end(), &stats),
+                            registry.live.end());
+    }
+};
+
+TraceStats &ThreadTraceStats()
+{
+    static thread_local ThreadStats thread;
+    return thread.stats;
+}
+
+TraceStats CollectTraceStats(bool reset)
+{
+    StatsRegistry &registry = Registry();
+    lock_guard<mutex> guard(registry.lock);
+
+    TraceStats total = registry.retired;
+    for (size_t i = 0; i < registry.live.size(); ++i)
+        total += *registry.live[i];
+
+    if (reset)
+    {
+        registry.retired = TraceStats();
+        for (size_t i = 0; i < registry.live.size(); ++i)
+            *registry.live[i] = TraceStats();
+    }
+    return total;
+}
+
+// --------------------------------------------------------------------------
+// Reports
+
+static double PerRay(const TraceStats &stats, uint64_t count)
+{
+    uint64_t rays = stats.counts[STAT_PRIMARY_RAYS] + stats.counts[STAT_SHADOW_RAYS];
+    return rays ? double(count) / rays : 0.0;
+}
+
+static uint64_t Tests(const TraceStats &stats)
+{
+    return stats.counts[STAT_PLANE_TESTS] + stats.counts[STAT_SPHERE_TESTS] +
+           stats.counts[STAT_TRIANGLE_TESTS];
+}
+
+void PrintTraceStats(ostream &out, const TraceStats &stats, double seconds)
+{
+    const uint64_t *c = stats.counts;
+    uint64_t rays = c[STAT_PRIMARY_RAYS] + c[STAT_SHADOW_RAYS];
+
+    out << "Trace statistics, " << fixed << setprecision(3) << seconds << " s" << endl
+        << "  rays           " << c[STAT_PRIMARY_RAYS] << " primary, " << c[STAT_SHADOW_RAYS]
+        << " shadow, " << setprecision(2) << (seconds > 0 ? rays / seconds / 1e6 : 0.0)
+        << " Mrays/s" << endl
+        << "  tests          " << c[STAT_PLANE_TESTS] << " plane, " << c[STAT_SPHERE_TESTS]
+        << " sphere, " << c[STAT_TRIANGLE_TESTS] << " triangle, "
+        << PerRay(stats, Tests(stats)) << " per ray" << endl
+        << "  primary hits   " << c[STAT_PLANE_HITS] << " plane, " << c[STAT_SPHERE_HITS]
+        << " sphere, " << c[STAT_TRIANGLE_HITS] << " triangle, " << c[STAT_MISSES]
+        << " missed" << endl
+        << "  early exits    " << c[STAT_TRIANGLE_PLANE_REJECTS] << " triangle plane rejects, "
+        << c[STAT_SHADOW_BLOCKED] << " blocked shadow rays" << endl;
+    out.unsetf(ios::floatfield);
+    out << setprecision(6);
+}
+
+void WriteTraceStatsJson(ostream &out, const TraceStats &stats, double seconds, int indent)
+{
+    string pad(indent, ' ');
+    uint64_t rays = stats.counts[STAT_PRIMARY_RAYS] + stats.counts[STAT_SHADOW_RAYS];
+
+    out << "{" << endl
+        << pad << "  \"seconds\": " << seconds << "," << endl
+        << pad << "  \"counters\": {" << endl;
+    for (int i = 0; i < STAT_COUNT; ++i)
+        out << pad << "    \"" << statNames[i] << "\": " << stats.counts[i]
+            << (i + 1 < STAT_COUNT ? "," : "") << endl;
+    out << pad << "  }," << endl
+        << pad << "  \"tests_per_ray\": " << PerRay(stats, Tests(stats)) << "," << endl
+        << pad << "  \"rays_per_second\": " << (seconds > 0 ? rays / seconds : 0.0) << endl
+        << pad << "}";
+}
+
+bool SaveTraceStats(const string &fileName, const vector<TraceStats> &frames,
+                    const vector<double> &seconds)
+{
+    ofstream file(fileName.c_str());
+    TraceStats total;
+    double totalSeconds = 0;
+
+    file << "{" << endl << "  \"frames\": [";
+    for (size_t i = 0; i < frames.size(); ++i)
+    {
+        file << (i ? ", " : "") << endl << "    ";
+        WriteTraceStatsJson(file, frames[i], seconds[i], 4);
+        total += frames[i];
+        totalSeconds += seconds[i];
+    }
+    file << endl << "  ]," << endl << "  \"total\": ";
+    WriteTraceStatsJson(file, total, totalSeconds, 2);
+    file << endl << "}" << endl;
+
+    if (!file)
+    {
+        cout << "TraceStats ERROR: Failed to write " << fileName << endl;
+        return false;
+    }
+    return true;
+}
+
+// --------------------------------------------------------------------------
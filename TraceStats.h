@@ -0,0 +1,87 @@
+// ==========================================================================
+// Trace Statistics Support Code
+//  - per thread counters of rays and intersection tests made by the CPU
+//    ray tracer, summed at the end of a frame, printed and saved as JSON
+//  - built only with TRACE_STATS defined, otherwise the counting macros
+//    compile to nothing
+// ==========================================================================
+#ifndef TRACESTATS_H
+#define TRACESTATS_H
+
+#include <string>
+#include <vector>
+#include <iosfwd>
+#include <stdint.h>
+
+enum TraceStat
+{
+    STAT_PRIMARY_RAYS,
+    STAT_SHADOW_RAYS,
+
+    // intersection tests by primitive type
+    STAT_PLANE_TESTS,
+    STAT_SPHERE_TESTS,
+    STAT_TRIANGLE_TESTS,
+
+    // closest primary hits by primitive type, and rays that hit nothing
+    STAT_PLANE_HITS,
+    STAT_SPHERE_HITS,
+    STAT_TRIANGLE_HITS,
+    STAT_MISSES,
+
+    // early exits: triangle tests turned away by the plane test before the
+    // barycentric one, and shadow rays stopped by the first blocker found
+    STAT_TRIANGLE_PLANE_REJECTS,
+    STAT_SHADOW_BLOCKED,
+
+    STAT_COUNT
+};
+
+// totals of every counter
+struct TraceStats
+{
+    uint64_t    counts[STAT_COUNT];
+
+    TraceStats();
+    TraceStats &operator+=(const TraceStats &other);
+};
+
+// the calling thread's own counters, no other thread writes to them
+TraceStats &ThreadTraceStats();
+
+// sum of the counters of every thread, including threads that have exited,
+// optionally setting them all back to zero; call between frames, while no
+// thread is tracing
+TraceStats CollectTraceStats(bool reset);
+
+// readable report of a frame's counters, with averages per ray
+void PrintTraceStats(std::ostream &out, const TraceStats &stats, double seconds);
+
+// the counters as a JSON object, indented by indent spaces
+void WriteTraceStatsJson(std::ostream &out, const TraceStats &stats, double seconds,
+                         int indent = 0);
+
+// save the counters of each frame and their total to a JSON file, with the
+// time each frame took, returns false if the file can't be written
+bool SaveTraceStats(const std::string &fileName, const std::vector<TraceStats> &frames,
+                    const std::vector<double> &seconds);
+
+// name of a counter as used in the JSON output
+const char *TraceStatName(TraceStat stat);
+
+// whether the counting macros were compiled in
+#ifdef TRACE_STATS
+	const bool TRACE_STATS_ENABLED = true;
+#else
+	const bool TRACE_STATS_ENABLED = false;
+#endif
+
+#ifdef TRACE_STATS
+	#define TRACE_STAT_ADD(stat, n) (ThreadTraceStats().counts[stat] += (n))
+#else
+	#define TRACE_STAT_ADD(stat, n) ((void) 0)
+#endif
+#define TRACE_STAT(stat) TRACE_STAT_ADD(stat, 1)
+
+// --------------------------------------------------------------------------
+#endif // TRACESTATS_H
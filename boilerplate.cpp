@@ -17,9 +17,38 @@
 #include <algorithm>
 #include <string>
 #include <iterator>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <sstream>
+#include <map>
+#include <chrono>
+#include <csignal>
 #include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtc/type_ptr.hpp>
 #include "ImageBuffer.h"
+#include "Scene.h"
+#include "RayTracer.h"
+#include "MappedImage.h"
+#include "Parallel.h"
+#include "Checkpoint.h"
+#include "RenderFarm.h"
+#include "RenderServer.h"
+#include "FrameWriter.h"
+#include "Animation.h"
+#include "TraceStats.h"
+#include "Timeline.h"
+#include "InputReplay.h"
+#include "PathTracer.h"
+#include "Denoiser.h"
+#include "Deflate.h"
 #include <math.h>
+#ifdef _WIN32
+	#include <direct.h>
+#else
+	#include <sys/stat.h>
+#endif
 
 // Specify that we want the OpenGL core profile before including GLFW headers
 #ifndef LAB_LINUX
@@ -43,9 +72,33 @@ void QueryGLVersion();
 bool CheckGLErrors();
 
 string LoadSource(const string &filename);
+string InsertDefines(const string &source, const string &defines);
 GLuint CompileShader(GLenum shaderType, const string &source);
 GLuint LinkProgram(GLuint vertexShader, GLuint fragmentShader);
 
+string ProgramCacheFile(const string &source);
+GLuint LoadProgramBinary(const string &filename);
+void SaveProgramBinary(GLuint program, const string &filename);
+
+//The bundled glad stops at OpenGL 4.0, so glad builds look up the 4.1
+//program binary entry points themselves once the context exists
+#ifndef GL_VERSION_4_1
+#define GL_PROGRAM_BINARY_RETRIEVABLE_HINT 0x8257
+#define GL_PROGRAM_BINARY_LENGTH 0x8741
+typedef void (APIENTRYP PFNGLGETPROGRAMBINARYPROC)(GLuint program, GLsizei bufSize, GLsizei *length,
+                                                   GLenum *binaryFormat, void *binary);
+typedef void (APIENTRYP PFNGLPROGRAMBINARYPROC)(GLuint program, GLenum binaryFormat,
+                                                const void *binary, GLsizei length);
+typedef void (APIENTRYP PFNGLPROGRAMPARAMETERIPROC)(GLuint program, GLenum pname, GLint value);
+PFNGLGETPROGRAMBINARYPROC glGetProgramBinary = 0;
+PFNGLPROGRAMBINARYPROC glProgramBinary = 0;
+PFNGLPROGRAMPARAMETERIPROC glProgramParameteri = 0;
+#endif
+
+//Set once the context is current, the cache is skipped without them
+bool programBinarySupported = false;
+void LoadProgramBinaryFunctions();
+
 // --------------------------------------------------------------------------
 // Functions to set up OpenGL shader programs for rendering
 
@@ -56,27 +109,72 @@ struct MyShader
 	GLuint  fragment;
 	GLuint  program;
 
+	// uniform locations, resolved once after linking (-1 if unused)
+	GLint   renderPassLocation;
+	GLint   traceTrianglesLocation;
+
 	// initialize shader and program names to zero (OpenGL reserved value)
-	MyShader() : vertex(0), fragment(0), program(0)
+	MyShader() : vertex(0), fragment(0), program(0),
+	             renderPassLocation(-1), traceTrianglesLocation(-1)
 	{}
 };
 
-// load, compile, and link shaders, returning true if successful
-bool InitializeShaders(MyShader *shader)
+// uniform buffer binding points of the Scene and Camera blocks
+const GLuint SCENE_BINDING = 0;
+const GLuint CAMERA_BINDING = 1;
+
+// load, compile, and link shaders, returning true if successful; defines
+// are added to the fragment shader to build a specialized variant
+bool InitializeShaders(MyShader *shader, const string &vertexFile = "vertex.glsl",
+                       const string &fragmentFile = "fragment.glsl",
+                       const string &defines = "")
 {
 	// load shader source from files
-	string vertexSource = LoadSource("vertex.glsl");
+	string vertexSource = LoadSource(vertexFile);
 	
-	string fragmentSource = LoadSource("fragment.glsl");	
+	string fragmentSource = LoadSource(fragmentFile);	
 			
 	if (vertexSource.empty() || fragmentSource.empty()) return false;
 
-	// compile shader source into shader objects
-	shader->vertex = CompileShader(GL_VERTEX_SHADER, vertexSource);
-	shader->fragment = CompileShader(GL_FRAGMENT_SHADER, fragmentSource);
+	fragmentSource = InsertDefines(fragmentSource, defines);
+
+	// reuse the program binary from an earlier run with the same sources
+	string cacheFile = ProgramCacheFile(vertexSource + fragmentSource);
+	shader->program = LoadProgramBinary(cacheFile);
 
-	// link shader program
-	shader->program = LinkProgram(shader->vertex, shader->fragment);
+	if (!shader->program)
+	{
+		// compile shader source into shader objects
+		shader->vertex = CompileShader(GL_VERTEX_SHADER, vertexSource);
+		shader->fragment = CompileShader(GL_FRAGMENT_SHADER, fragmentSource);
+
+		// link shader program
+		shader->program = LinkProgram(shader->vertex, shader->fragment);
+		SaveProgramBinary(shader->program, cacheFile);
+	}
+
+	// look up uniforms once, so later updates don't search by name
+	shader->renderPassLocation = glGetUniformLocation(shader->program, "renderPass");
+	shader->traceTrianglesLocation = glGetUniformLocation(shader->program, "traceTriangles");
+
+	// attach the uniform blocks to the buffers bound at fixed points
+	GLuint sceneBlock = glGetUniformBlockIndex(shader->program, "Scene");
+	if (sceneBlock != GL_INVALID_INDEX)
+		glUniformBlockBinding(shader->program, sceneBlock, SCENE_BINDING);
+	GLuint cameraBlock = glGetUniformBlockIndex(shader->program, "Camera");
+	if (cameraBlock != GL_INVALID_INDEX)
+		glUniformBlockBinding(shader->program, cameraBlock, CAMERA_BINDING);
+
+	// G-buffer samplers always read texture units 0 to 2
+	const char *samplers[] = { "hitPosition", "hitNormal", "hitMaterial" };
+	glUseProgram(shader->program);
+	for (int i = 0; i < 3; ++i)
+	{
+		GLint loc = glGetUniformLocation(shader->program, samplers[i]);
+		if (loc != -1)
+			glUniform1i(loc, i);
+	}
+	glUseProgram(0);
 
 	// check for OpenGL errors and return false if error occurred
 	return !CheckGLErrors();
@@ -175,18 +273,236 @@ void DestroyGeometry(MyGeometry *geometry)
 	glDeleteBuffers(1, &geometry->colourBuffer);
 }
 
+// scene triangles in a vertex buffer, for rasterizing primary visibility
+struct MyTriangles
+{
+	// OpenGL names for array buffer objects, vertex array object
+	GLuint  vertexBuffer;
+	GLuint  normalBuffer;
+	GLuint  vertexArray;
+	GLsizei elementCount;
+
+	// initialize object names to zero (OpenGL reserved value)
+	MyTriangles() : vertexBuffer(0), normalBuffer(0), vertexArray(0), elementCount(0)
+	{}
+};
+
+// fill buffers with the scene triangles (nine floats each) and their face
+// normals, returning true if successful
+bool InitializeTriangles(MyTriangles *triangles, const vector<float> &vertices)
+{
+	// flat normals, wound the same way as the ray tracer's cross(side1,side2)
+	vector<float> normals(vertices.size());
+	for (size_t i = 0; i + 9 <= vertices.size(); i += 9)
+	{
+		glm::vec3 p1(vertices[i], vertices[i+1], vertices[i+2]);
+		glm::vec3 p2(vertices[i+3], vertices[i+4], vertices[i+5]);
+		glm::vec3 p3(vertices[i+6], vertices[i+7], vertices[i+8]);
+		glm::vec3 n = glm::normalize(glm::cross(p2 - p1, p3 - p1));
+
+		for (int k = 0; k < 3; ++k)
+		{
+			normals[i + 3*k] = n.x;
+			normals[i + 3*k + 1] = n.y;
+			normals[i + 3*k + 2] = n.z;
+		}
+	}
+	triangles->elementCount = vertices.size() / 3;
+
+	// these vertex attribute indices correspond to those specified for the
+	// input variables in the raster vertex shader
+	const GLuint VERTEX_INDEX = 0;
+	const GLuint NORMAL_INDEX = 1;
+
+	// buffers are reused when the scene changes
+	if (!triangles->vertexArray)
+	{
+		glGenBuffers(1, &triangles->vertexBuffer);
+		glGenBuffers(1, &triangles->normalBuffer);
+		glGenVertexArrays(1, &triangles->vertexArray);
+	}
+
+	glBindBuffer(GL_ARRAY_BUFFER, triangles->vertexBuffer);
+	glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(float), vertices.data(), GL_STATIC_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, triangles->normalBuffer);
+	glBufferData(GL_ARRAY_BUFFER, normals.size() * sizeof(float), normals.data(), GL_STATIC_DRAW);
+
+	// associate the position and normal arrays with the vertex array object
+	glBindVertexArray(triangles->vertexArray);
+	glBindBuffer(GL_ARRAY_BUFFER, triangles->vertexBuffer);
+	glVertexAttribPointer(VERTEX_INDEX, 3, GL_FLOAT, GL_FALSE, 0, 0);
+	glEnableVertexAttribArray(VERTEX_INDEX);
+	glBindBuffer(GL_ARRAY_BUFFER, triangles->normalBuffer);
+	glVertexAttribPointer(NORMAL_INDEX, 3, GL_FLOAT, GL_FALSE, 0, 0);
+	glEnableVertexAttribArray(NORMAL_INDEX);
+
+	// unbind our buffers, resetting to default state
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindVertexArray(0);
+
+	// check for OpenGL errors and return false if error occurred
+	return !CheckGLErrors();
+}
+
+// deallocate scene triangle objects
+void DestroyTriangles(MyTriangles *triangles)
+{
+	glBindVertexArray(0);
+	glDeleteVertexArrays(1, &triangles->vertexArray);
+	glDeleteBuffers(1, &triangles->vertexBuffer);
+	glDeleteBuffers(1, &triangles->normalBuffer);
+}
+
 // --------------------------------------------------------------------------
-// Rendering function that draws our scene to the frame buffer
+// Functions to set up a G-buffer that stores the primary hit for each pixel,
+// so lighting changes can be shaded again without retracing visibility
 
-void RenderScene(MyGeometry *geometry, MyShader *shader)
+// render pass selectors, these match the PASS_ defines in fragment.glsl
+enum RenderPass { PASS_FULL = 0, PASS_PRIMARY = 1, PASS_SHADE = 2, PASS_HEATMAP = 3 };
+
+struct MyGBuffer
 {
-	// clear screen to a dark grey colour
-	//glClearColor(0.2f, 0.2f, 0.2f, 1.0f);
-	glClear(GL_COLOR_BUFFER_BIT);
+	// OpenGL names for the framebuffer object and its attachments: hit
+	// position, hit normal, and primitive/material ids, plus a depth buffer
+	// for merging rasterized triangles
+	GLuint  framebuffer;
+	GLuint  textures[3];
+	GLuint  depthbuffer;
+	GLsizei width, height;
+
+	// set when the stored primary hits match the current camera and scene
+	bool    current;
+
+	// initialize object names to zero (OpenGL reserved value)
+	MyGBuffer() : framebuffer(0), depthbuffer(0), width(0), height(0), current(false)
+	{
+		textures[0] = textures[1] = textures[2] = 0;
+	}
+};
+
+// create G-buffer textures matching the viewport, returning true if successful
+bool InitializeGBuffer(MyGBuffer *gbuffer)
+{
+	// retrieve the current viewport size
+	GLint viewport[4];
+	glGetIntegerv(GL_VIEWPORT, viewport);
+	gbuffer->width = viewport[2];
+	gbuffer->height = viewport[3];
+
+	// full float attachments so shading a stored hit matches a full trace
+	glGenTextures(3, gbuffer->textures);
+	for (int i = 0; i < 3; ++i)
+	{
+		glBindTexture(GL_TEXTURE_RECTANGLE, gbuffer->textures[i]);
+		glTexImage2D(GL_TEXTURE_RECTANGLE, 0, GL_RGBA32F, gbuffer->width,
+		             gbuffer->height, 0, GL_RGBA, GL_FLOAT, 0);
+		glTexParameteri(GL_TEXTURE_RECTANGLE, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_RECTANGLE, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	}
+	glBindTexture(GL_TEXTURE_RECTANGLE, 0);
+
+	glGenRenderbuffers(1, &gbuffer->depthbuffer);
+	glBindRenderbuffer(GL_RENDERBUFFER, gbuffer->depthbuffer);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, gbuffer->width, gbuffer->height);
+	glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+	// attach them to the colour outputs written by the primary pass
+	const GLenum drawBuffers[] = {
+		GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1, GL_COLOR_ATTACHMENT2
+	};
+	glGenFramebuffers(1, &gbuffer->framebuffer);
+	glBindFramebuffer(GL_FRAMEBUFFER, gbuffer->framebuffer);
+	for (int i = 0; i < 3; ++i)
+		glFramebufferTexture(GL_FRAMEBUFFER, drawBuffers[i], gbuffer->textures[i], 0);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, gbuffer->depthbuffer);
+	glDrawBuffers(3, drawBuffers);
+
+	// check framebuffer status
+	GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+	if (status != GL_FRAMEBUFFER_COMPLETE)
+		cout << "G-buffer ERROR: Framebuffer object not complete!" << endl;
+
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+	return status == GL_FRAMEBUFFER_COMPLETE && !CheckGLErrors();
+}
+
+// deallocate G-buffer objects
+void DestroyGBuffer(MyGBuffer *gbuffer)
+{
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glDeleteFramebuffers(1, &gbuffer->framebuffer);
+	glDeleteTextures(3, gbuffer->textures);
+	glDeleteRenderbuffers(1, &gbuffer->depthbuffer);
+	gbuffer->framebuffer = 0;
+	gbuffer->current = false;
+}
+
+// --------------------------------------------------------------------------
+// Functions to set up uniform buffers for the Scene and Camera blocks
+
+// the Scene block layout, SceneBlock, is shared with the CPU ray tracer
+// through Scene.h
+
+// std140 layout of the Camera block
+struct CameraBlock
+{
+	glm::vec4 eye;
+	glm::mat4 viewProjection;
+};
+
+struct MyUniformBuffers
+{
+	// OpenGL names for the buffers backing the Scene and Camera blocks
+	GLuint  sceneBuffer;
+	GLuint  cameraBuffer;
+
+	// initialize object names to zero (OpenGL reserved value)
+	MyUniformBuffers() : sceneBuffer(0), cameraBuffer(0)
+	{}
+};
+
+// create the uniform buffers and attach them to their binding points,
+// returning true if successful
+bool InitializeUniformBuffers(MyUniformBuffers *uniforms)
+{
+	glGenBuffers(1, &uniforms->sceneBuffer);
+	glBindBuffer(GL_UNIFORM_BUFFER, uniforms->sceneBuffer);
+	glBufferData(GL_UNIFORM_BUFFER, sizeof(SceneBlock), 0, GL_DYNAMIC_DRAW);
+	glBindBufferBase(GL_UNIFORM_BUFFER, SCENE_BINDING, uniforms->sceneBuffer);
+
+	glGenBuffers(1, &uniforms->cameraBuffer);
+	glBindBuffer(GL_UNIFORM_BUFFER, uniforms->cameraBuffer);
+	glBufferData(GL_UNIFORM_BUFFER, sizeof(CameraBlock), 0, GL_DYNAMIC_DRAW);
+	glBindBufferBase(GL_UNIFORM_BUFFER, CAMERA_BINDING, uniforms->cameraBuffer);
+
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+
+	// check for OpenGL errors and return false if error occurred
+	return !CheckGLErrors();
+}
+
+// deallocate uniform buffers
+void DestroyUniformBuffers(MyUniformBuffers *uniforms)
+{
+	glDeleteBuffers(1, &uniforms->sceneBuffer);
+	glDeleteBuffers(1, &uniforms->cameraBuffer);
+}
+
+// --------------------------------------------------------------------------
+// Rendering functions that draw our scene to the frame buffer
+
+// draws the full screen quad with the fragment shader in the given pass
+void DrawPass(MyGeometry *geometry, MyShader *shader, RenderPass pass)
+{
+	static const char *passNames[4] = { "full pass", "primary pass", "shading pass", "heatmap pass" };
+	TimelineScope scope(passNames[pass]);
 
 	// bind our shader program and the vertex array object containing our
 	// scene geometry, then tell OpenGL to draw our geometry
 	glUseProgram(shader->program);
+	glUniform1i(shader->renderPassLocation, pass);
+
 	glBindVertexArray(geometry->vertexArray);
 	glDrawArrays(GL_TRIANGLES, 0, geometry->elementCount);
 
@@ -194,10 +510,133 @@ void RenderScene(MyGeometry *geometry, MyShader *shader)
 	glBindVertexArray(0);
 	glUseProgram(0);
 
+	// wait for the GPU while recording a timeline, so the event covers the
+	// pass and not just its submission
+	if (TimelineActive())
+		glFinish();
+}
+
+// shades the stored primary hits to the screen, tracing only shadow rays
+void RelightScene(MyGeometry *geometry, MyShader *shader, MyGBuffer *gbuffer)
+{
+	glClear(GL_COLOR_BUFFER_BIT);
+
+	// bind the G-buffer attachments to the samplers of the shading pass
+	for (int i = 0; i < 3; ++i)
+	{
+		glActiveTexture(GL_TEXTURE0 + i);
+		glBindTexture(GL_TEXTURE_RECTANGLE, gbuffer->textures[i]);
+	}
+
+	DrawPass(geometry, shader, PASS_SHADE);
+
+	for (int i = 2; i >= 0; --i)
+	{
+		glActiveTexture(GL_TEXTURE0 + i);
+		glBindTexture(GL_TEXTURE_RECTANGLE, 0);
+	}
+
+	// check for an report any OpenGL errors
+	CheckGLErrors();
+}
+
+void RenderScene(MyGeometry *geometry, MyShader *shader, MyGBuffer *gbuffer)
+{
+	// without a G-buffer trace and shade every pixel in a single pass
+	if (!gbuffer->framebuffer)
+	{
+		// clear screen to a dark grey colour
+		//glClearColor(0.2f, 0.2f, 0.2f, 1.0f);
+		glClear(GL_COLOR_BUFFER_BIT);
+
+		DrawPass(geometry, shader, PASS_FULL);
+
+		// check for an report any OpenGL errors
+		CheckGLErrors();
+		return;
+	}
+
+	// trace primary visibility into the G-buffer, then shade it
+	glBindFramebuffer(GL_FRAMEBUFFER, gbuffer->framebuffer);
+	DrawPass(geometry, shader, PASS_PRIMARY);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	gbuffer->current = true;
+
+	RelightScene(geometry, shader, gbuffer);
+}
+
+// draws the number of intersection tests the full pass makes for each pixel
+// as a false colour heatmap, which leaves the G-buffer out of date
+void RenderHeatmap(MyGeometry *geometry, MyShader *shader, MyGBuffer *gbuffer)
+{
+	glClear(GL_COLOR_BUFFER_BIT);
+	DrawPass(geometry, shader, PASS_HEATMAP);
+	gbuffer->current = false;
+
 	// check for an report any OpenGL errors
 	CheckGLErrors();
 }
 
+// copies what was just drawn into an image buffer and saves it to a file
+bool SaveScreen(const string &fileName)
+{
+	ImageBuffer image;
+	if (!image.Initialize())
+		return false;
+
+	vector<glm::vec3> colours(size_t(image.Width()) * image.Height());
+	glReadPixels(0, 0, image.Width(), image.Height(), GL_RGB, GL_FLOAT, &colours[0]);
+	image.SetTile(0, 0, image.Width(), image.Height(), &colours[0]);
+
+	bool saved = image.SaveToFile(fileName);
+	image.Destroy();
+	return saved;
+}
+
+// rasterizes the scene triangles into the G-buffer and traces only planes
+// and spheres for primary visibility, then shades it like RenderScene
+void RasterizeScene(MyGeometry *geometry, MyTriangles *triangles, MyShader *shader,
+                    MyShader *rasterShader, MyGBuffer *gbuffer)
+{
+	glBindFramebuffer(GL_FRAMEBUFFER, gbuffer->framebuffer);
+	glClear(GL_DEPTH_BUFFER_BIT);
+	glEnable(GL_DEPTH_TEST);
+
+	// trace planes and spheres for every pixel, writing their hit depth
+	glUseProgram(shader->program);
+	glUniform1i(shader->traceTrianglesLocation, GL_FALSE);
+
+	glDepthFunc(GL_ALWAYS);
+	DrawPass(geometry, shader, PASS_PRIMARY);
+
+	// rasterize triangles in front of those hits, keeping the traced
+	// backdrop flag in the alpha channel of the normal attachment
+	glUseProgram(rasterShader->program);
+	glDepthFunc(GL_LESS);
+	glColorMaski(1, GL_TRUE, GL_TRUE, GL_TRUE, GL_FALSE);
+	{
+		TimelineScope scope("raster pass");
+		glBindVertexArray(triangles->vertexArray);
+		glDrawArrays(GL_TRIANGLES, 0, triangles->elementCount);
+		if (TimelineActive())
+			glFinish();
+	}
+
+	// reset state to default
+	glBindVertexArray(0);
+	glColorMaski(1, GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+	glDisable(GL_DEPTH_TEST);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	gbuffer->current = true;
+
+	// the traced primary pass includes triangles again by default
+	glUseProgram(shader->program);
+	glUniform1i(shader->traceTrianglesLocation, GL_TRUE);
+	glUseProgram(0);
+
+	RelightScene(geometry, shader, gbuffer);
+}
+
 // --------------------------------------------------------------------------
 // GLFW callback functions
 vector<float> light;
@@ -214,7 +653,95 @@ vector<float> triangleVertices;
 vector<float> triangleColors;
 vector<float> triangleLight;
 
-void scene1Vertices(MyShader shader)
+//Pack the scene vectors into the layout of the Scene block, the only build
+//step a scene has before tracing
+void PackScene(SceneBlock *scene)
+{
+	TimelineScope timeline("pack scene");
+	SceneBlock &block = *scene;
+	block = SceneBlock();
+	
+	block.light = glm::vec4(light[0], light[1], light[2], 1);
+	block.planeCount = std::min<int>(planeVertices.size()/6, MAX_PLANES);
+	block.sphereCount = std::min<int>(sphereVertices.size()/4, MAX_SPHERES);
+	block.triangleCount = std::min<int>(triangleVertices.size()/9, MAX_TRIANGLES);
+	
+	if(block.triangleCount*9 < int(triangleVertices.size()))
+		cout << "Scene has more than " << MAX_TRIANGLES << " triangles, extra ones are ignored" << endl;
+	
+	for(int i = 0; i < block.planeCount; i++)
+	{
+		const float *v = &planeVertices[6*i];
+		block.planeVert[2*i] = glm::vec4(v[0], v[1], v[2], 0);
+		block.planeVert[2*i+1] = glm::vec4(v[3], v[4], v[5], 1);
+		block.planeColor[i] = glm::vec4(planeColors[3*i], planeColors[3*i+1], planeColors[3*i+2], 1);
+		block.planeLight[i] = glm::make_vec4(&planeLight[4*i]);
+	}
+	
+	for(int i = 0; i < block.sphereCount; i++)
+	{
+		block.sphereVert[i] = glm::make_vec4(&sphereVertices[4*i]);
+		block.sphereColor[i] = glm::vec4(sphereColors[3*i], sphereColors[3*i+1], sphereColors[3*i+2], 1);
+		block.sphereLight[i] = glm::make_vec4(&sphereLight[4*i]);
+	}
+	
+	for(int i = 0; i < block.triangleCount; i++)
+	{
+		//Keep the first corner and precompute the edges and plane the
+		//intersection test needs, so the shader does not redo it per ray
+		glm::vec3 p1 = glm::make_vec3(&triangleVertices[9*i]);
+		glm::vec3 e1 = glm::make_vec3(&triangleVertices[9*i + 3]) - p1;
+		glm::vec3 e2 = glm::make_vec3(&triangleVertices[9*i + 6]) - p1;
+		glm::vec3 n = glm::normalize(glm::cross(e1, e2));
+		
+		block.triangleVert[i] = glm::vec4(p1, 1);
+		block.triangleEdge1[i] = glm::vec4(e1, 0);
+		block.triangleEdge2[i] = glm::vec4(e2, 0);
+		block.triangleNormal[i] = glm::vec4(n, glm::dot(n, p1));
+		block.triangleColor[i] = glm::vec4(triangleColors[3*i], triangleColors[3*i+1], triangleColors[3*i+2], 1);
+		block.triangleLight[i] = glm::make_vec4(&triangleLight[4*i]);
+	}
+}
+
+//Pack the scene vectors into the Scene block and upload it in one call
+void UploadScene(MyUniformBuffers *uniforms)
+{
+	SceneBlock block;
+	PackScene(&block);
+	
+	glBindBuffer(GL_UNIFORM_BUFFER, uniforms->sceneBuffer);
+	glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(block), &block);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+}
+
+//Upload only the light position of the Scene block
+void UploadLight(MyUniformBuffers *uniforms)
+{
+	glm::vec4 position(light[0], light[1], light[2], 1);
+	
+	glBindBuffer(GL_UNIFORM_BUFFER, uniforms->sceneBuffer);
+	glBufferSubData(GL_UNIFORM_BUFFER, offsetof(SceneBlock, light), sizeof(position), &position);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+}
+
+//Upload the camera position and the matching raster projection
+void UploadCamera(MyUniformBuffers *uniforms)
+{
+	CameraBlock block;
+	block.eye = glm::vec4(x, y, z, 1);
+	
+	//Same pinhole camera as the ray tracer: 60 degree field of view, square
+	//image plane, looking down -z
+	glm::mat4 projection = glm::perspective(float(M_PI)/3.f, 1.f, 0.01f, 1000.f);
+	glm::mat4 view = glm::translate(glm::mat4(1.f), -glm::vec3(block.eye));
+	block.viewProjection = projection*view;
+	
+	glBindBuffer(GL_UNIFORM_BUFFER, uniforms->cameraBuffer);
+	glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(block), &block);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+}
+
+void scene1Vertices()
 {
 	//clear values when switching scenes
 	light.clear();
@@ -343,52 +870,10 @@ void scene1Vertices(MyShader shader)
 	triangleLight.push_back(0.2f);triangleLight.push_back(0.5f);triangleLight.push_back(0);triangleLight.push_back(0);
 	
 	
-	 //Copy vertex/color information into uniform arrays
-     glUseProgram(shader.program);
-     
-      GLint loc0 = glGetUniformLocation(shader.program, "light");
-      if(loc0 != -1)	
-		glUniform1fv(loc0, light.size(), light.data());
-     
-      GLint loc1 = glGetUniformLocation(shader.program, "planeVert");
-      if(loc1 != -1)
-		glUniform1fv(loc1, planeVertices.size(), planeVertices.data()); 
-		
-      GLint loc2 = glGetUniformLocation(shader.program, "planeColor");
-      if(loc2 != -1)	
-		glUniform1fv(loc2, planeColors.size(), planeColors.data());
-		
-	  GLint loc3 = glGetUniformLocation(shader.program, "triangleVert");
-      if(loc3 != -1)	
-		glUniform1fv(loc3, triangleVertices.size(), triangleVertices.data());
-		
-	  GLint loc4 = glGetUniformLocation(shader.program, "triangleColor");
-      if(loc4 != -1)	
-		glUniform1fv(loc4, triangleColors.size(), triangleColors.data());
-		
-	  GLint loc5 = glGetUniformLocation(shader.program, "sphereVert");
-      if(loc5 != -1)	
-		glUniform1fv(loc5, sphereVertices.size(), sphereVertices.data());
-		
-	  GLint loc6 = glGetUniformLocation(shader.program, "sphereColor");
-      if(loc6 != -1)	
-		glUniform1fv(loc6, sphereColors.size(), sphereColors.data());
-		
-	  GLint loc7 = glGetUniformLocation(shader.program, "planeLight");
-      if(loc7 != -1)	
-		glUniform1fv(loc7, planeLight.size(), planeLight.data());	
-		
-	  GLint loc8 = glGetUniformLocation(shader.program, "sphereLight");
-      if(loc8 != -1)	
-		glUniform1fv(loc8, sphereLight.size(), sphereLight.data());	
-		
-	  GLint loc9 = glGetUniformLocation(shader.program, "triangleLight");
-      if(loc9 != -1)	
-		glUniform1fv(loc9, triangleLight.size(), triangleLight.data());	
 }
 
 
-void scene2Vertices(MyShader shader)
+void scene2Vertices()
 {
 	//clear values when switching scenes
 	light.clear();
@@ -672,49 +1157,6 @@ void scene2Vertices(MyShader shader)
 			triangleColors.push_back(1.0f);triangleColors.push_back(0.0f);triangleColors.push_back(0.0f);	
 						triangleLight.push_back(0.3f);triangleLight.push_back(0.5f);triangleLight.push_back(1);triangleLight.push_back(50);						
 																		
-	 //Copy vertex/color information into uniform arrays
-     glUseProgram(shader.program);
-     
-      GLint loc0 = glGetUniformLocation(shader.program, "light");
-      if(loc0 != -1)	
-		glUniform1fv(loc0, light.size(), light.data());
-     
-      GLint loc1 = glGetUniformLocation(shader.program, "planeVert");
-      if(loc1 != -1)
-		glUniform1fv(loc1, planeVertices.size(), planeVertices.data()); 
-		
-      GLint loc2 = glGetUniformLocation(shader.program, "planeColor");
-      if(loc2 != -1)	
-		glUniform1fv(loc2, planeColors.size(), planeColors.data());
-		
-	  GLint loc3 = glGetUniformLocation(shader.program, "triangleVert");
-      if(loc3 != -1)	
-		glUniform1fv(loc3, triangleVertices.size(), triangleVertices.data());
-		
-	  GLint loc4 = glGetUniformLocation(shader.program, "triangleColor");
-      if(loc4 != -1)	
-		glUniform1fv(loc4, triangleColors.size(), triangleColors.data());
-		
-	  GLint loc5 = glGetUniformLocation(shader.program, "sphereVert");
-      if(loc5 != -1)	
-		glUniform1fv(loc5, sphereVertices.size(), sphereVertices.data());
-		
-	  GLint loc6 = glGetUniformLocation(shader.program, "sphereColor");
-      if(loc6 != -1)	
-		glUniform1fv(loc6, sphereColors.size(), sphereColors.data());
-		
-	  GLint loc7 = glGetUniformLocation(shader.program, "planeLight");
-      if(loc7 != -1)	
-		glUniform1fv(loc7, planeLight.size(), planeLight.data());	
-		
-	  GLint loc8 = glGetUniformLocation(shader.program, "sphereLight");
-      if(loc8 != -1)	
-		glUniform1fv(loc8, sphereLight.size(), sphereLight.data());	
-		
-	  GLint loc9 = glGetUniformLocation(shader.program, "triangleLight");
-      if(loc9 != -1)	
-		glUniform1fv(loc9, triangleLight.size(), triangleLight.data());	
-	
 }
 
 void push_tri(float X, float Y, float Z){
@@ -748,7 +1190,7 @@ void push_tri(float X, float Y, float Z){
 }
 
 
-void scene3Vertices(MyShader shader)
+void scene3Vertices()
 {
 	//clear values when switching scenes
 	light.clear();
@@ -807,52 +1249,82 @@ void scene3Vertices(MyShader shader)
 	push_tri(2.5f,0,0);
 
 	
-	//Copy vertex/color information into uniform arrays
-     glUseProgram(shader.program);
-     
-      GLint loc0 = glGetUniformLocation(shader.program, "light");
-      if(loc0 != -1)	
-		glUniform1fv(loc0, light.size(), light.data());
-     
-      GLint loc1 = glGetUniformLocation(shader.program, "planeVert");
-      if(loc1 != -1)
-		glUniform1fv(loc1, planeVertices.size(), planeVertices.data()); 
-		
-      GLint loc2 = glGetUniformLocation(shader.program, "planeColor");
-      if(loc2 != -1)	
-		glUniform1fv(loc2, planeColors.size(), planeColors.data());
-		
-	  GLint loc3 = glGetUniformLocation(shader.program, "triangleVert");
-      if(loc3 != -1)	
-		glUniform1fv(loc3, triangleVertices.size(), triangleVertices.data());
-		
-	  GLint loc4 = glGetUniformLocation(shader.program, "triangleColor");
-	  if(loc4 != -1)	
-		glUniform1fv(loc4, triangleColors.size(), triangleColors.data());
-		
-	  GLint loc5 = glGetUniformLocation(shader.program, "sphereVert");
-      if(loc5 != -1)	
-		glUniform1fv(loc5, sphereVertices.size(), sphereVertices.data());
-		
-	  GLint loc6 = glGetUniformLocation(shader.program, "sphereColor");
-      if(loc6 != -1)	
-		glUniform1fv(loc6, sphereColors.size(), sphereColors.data());
-		
-	  GLint loc7 = glGetUniformLocation(shader.program, "planeLight");
-      if(loc7 != -1)	
-		glUniform1fv(loc7, planeLight.size(), planeLight.data());	
-		
-	  GLint loc8 = glGetUniformLocation(shader.program, "sphereLight");
-      if(loc8 != -1)	
-		glUniform1fv(loc8, sphereLight.size(), sphereLight.data());	
-		
-	  GLint loc9 = glGetUniformLocation(shader.program, "triangleLight");
-      if(loc9 != -1)	
-		glUniform1fv(loc9, triangleLight.size(), triangleLight.data());	
+}
+
+//Fill the scene vectors for scene 1, 2 or 3 and put the camera at its start
+void LoadScene(int scene)
+{
+	TimelineScope timeline("load scene", "scene", scene);
+	x = 0.f;
+	y = 0.f;
+	z = 0.f;
+	
+	if(scene == 1)
+		scene1Vertices();
+	else if(scene == 2)
+		scene2Vertices();
+	else
+	{
+		x = -0.1f;
+		z = -1.0f;
+		scene3Vertices();
+	}
 }
 
 MyShader shader;
 MyGeometry geometry;
+MyGBuffer gbuffer;
+MyUniformBuffers uniforms;
+
+//Programs specialized to each scene's primitive counts, keyed on the
+//defines they were built with; the generic shader is the fallback
+map<string, MyShader> sceneShaders;
+MyShader *activeShader = &shader;
+
+//Switch to the program for the current scene, building it the first time
+//these primitive counts are seen
+void SelectSceneShader()
+{
+	ostringstream defines;
+	defines << "#define SCENE_PLANES " << std::min<int>(planeVertices.size()/6, MAX_PLANES) << "\n"
+	        << "#define SCENE_SPHERES " << std::min<int>(sphereVertices.size()/4, MAX_SPHERES) << "\n"
+	        << "#define SCENE_TRIANGLES " << std::min<int>(triangleVertices.size()/9, MAX_TRIANGLES) << "\n";
+	
+	map<string, MyShader>::iterator variant = sceneShaders.find(defines.str());
+	if(variant == sceneShaders.end())
+	{
+		MyShader specialized;
+		if(!InitializeShaders(&specialized, "vertex.glsl", "fragment.glsl", defines.str()))
+		{
+			cout << "Program failed to specialize shaders, using generic ones" << endl;
+			DestroyShaders(&specialized);
+			activeShader = &shader;
+			return;
+		}
+		variant = sceneShaders.insert(make_pair(defines.str(), specialized)).first;
+	}
+	
+	activeShader = &variant->second;
+}
+
+//Rasterize triangles for primary visibility instead of tracing them
+bool rasterPrimary = false;
+MyShader rasterShader;
+MyTriangles triangles;
+
+//Show the intersection test heatmap instead of the shaded scene
+bool showHeatmap = false;
+
+//Draws the current scene from the current camera position
+void DrawScene()
+{
+	if(showHeatmap)
+		RenderHeatmap(&geometry, activeShader, &gbuffer);
+	else if(!rasterPrimary || !gbuffer.framebuffer || !rasterShader.program)
+		RenderScene(&geometry, activeShader, &gbuffer);
+	else
+		RasterizeScene(&geometry, &triangles, activeShader, &rasterShader, &gbuffer);
+}
 
 // reports GLFW errors
 void ErrorCallback(int error, const char* description)
@@ -861,210 +1333,716 @@ void ErrorCallback(int error, const char* description)
 	cout << description << endl;
 }
 
-// handles keyboard input events
-void KeyCallback(GLFWwindow* window, int key, int scancode, int action, int mods)
+//What a key event changed, so the window knows what to redraw
+enum KeyChange { CHANGE_NONE, CHANGE_CAMERA, CHANGE_LIGHT, CHANGE_SCENE };
+
+//Applies a key event to the camera, light and scene, for the window and
+//for input replay
+KeyChange ApplyKey(int key, int action)
 {
-	if (key == GLFW_KEY_ESCAPE && action == GLFW_PRESS)
-		glfwSetWindowShouldClose(window, GL_TRUE);
-		
-	//Go forward	
-	else if(key == GLFW_KEY_W)
-	{
+	//Go forward
+	if(key == GLFW_KEY_W)
 		z = z - 0.5f;
-		
-		glUseProgram(shader.program);
-		GLint loc = glGetUniformLocation(shader.program, "z");
-		if(loc != -1)
-			glUniform1f(loc, z);
-			
-		RenderScene(&geometry, &shader);
-	}
 	
 	//Go backward
 	else if(key == GLFW_KEY_S)
-	{
 		z = z + 0.5f;
-		
-		glUseProgram(shader.program);
-		GLint loc = glGetUniformLocation(shader.program, "z");
-		
-		if(loc != -1)
-			glUniform1f(loc, z);
-			
-		RenderScene(&geometry, &shader);
-	}
 	
 	//Go left
 	else if(key == GLFW_KEY_A)
-	{
 		x = x - 0.5f;
-		
-		glUseProgram(shader.program);
-		GLint loc = glGetUniformLocation(shader.program, "x");
-		
-		if(loc != -1)
-			glUniform1f(loc, x);
-			
-		RenderScene(&geometry, &shader);
-	}
 	
 	//Go right
 	else if(key == GLFW_KEY_D)
-	{
 		x = x + 0.5f;
-		
-		glUseProgram(shader.program);
-		GLint loc = glGetUniformLocation(shader.program, "x");
-		
-		if(loc != -1)
-			glUniform1f(loc, x);
-			
-		RenderScene(&geometry, &shader);
-	}
 	
 	//Go up
 	else if(key == GLFW_KEY_O)
-	{
 		y = y + 0.5f;
-		
-		glUseProgram(shader.program);
-		GLint loc = glGetUniformLocation(shader.program, "y");
-		
-		if(loc != -1)
-			glUniform1f(loc, y);
-			
-		RenderScene(&geometry, &shader);
-	}
 	
 	//Go down
 	else if(key == GLFW_KEY_P)
-	{
 		y = y - 0.5f;
+	
+	//Move the light with the arrow keys and page up/down
+	else if(light.size() == 3 && (key == GLFW_KEY_LEFT || key == GLFW_KEY_RIGHT ||
+		key == GLFW_KEY_UP || key == GLFW_KEY_DOWN ||
+		key == GLFW_KEY_PAGE_UP || key == GLFW_KEY_PAGE_DOWN))
+	{
+		if(key == GLFW_KEY_LEFT)
+			light[0] = light[0] - 0.5f;
+		else if(key == GLFW_KEY_RIGHT)
+			light[0] = light[0] + 0.5f;
+		else if(key == GLFW_KEY_UP)
+			light[1] = light[1] + 0.5f;
+		else if(key == GLFW_KEY_DOWN)
+			light[1] = light[1] - 0.5f;
+		else if(key == GLFW_KEY_PAGE_UP)
+			light[2] = light[2] - 0.5f;
+		else
+			light[2] = light[2] + 0.5f;
 		
-		glUseProgram(shader.program);
-		GLint loc = glGetUniformLocation(shader.program, "y");
-		
-		if(loc != -1)
-			glUniform1f(loc, y);
-			
-		RenderScene(&geometry, &shader);
-	}	
-	
-	//Choose scene 1
-	else if (key == GLFW_KEY_1 && action == GLFW_PRESS)
-	{	
-		x = 0.f;
-		y = 0.f;
-		z = 0.f;
-
-		//Set array sizes in fragment shader
-	  glUseProgram(shader.program);
-	  
-	  GLint loc1 = glGetUniformLocation(shader.program, "pV");
-      if(loc1 != -1)
-		glUniform1i(loc1, 6); 
-		
-	  GLint loc2 = glGetUniformLocation(shader.program, "tV");
-      if(loc2 != -1)	
-		glUniform1i(loc2, 108);
-		
-	  GLint loc3 = glGetUniformLocation(shader.program, "sV");
-      if(loc3 != -1)	
-		glUniform1i(loc3, 4);
-		
-	  GLint loc4 = glGetUniformLocation(shader.program, "x");
-		if(loc4 != -1)
-			glUniform1f(loc4, x);
-			
-	  GLint loc5 = glGetUniformLocation(shader.program, "z");
-		if(loc5 != -1)
-			glUniform1f(loc5, z);	
-			
-	  GLint loc6 = glGetUniformLocation(shader.program, "y");
-		if(loc6 != -1)
-			glUniform1f(loc6, y);	
-			
-		scene1Vertices(shader);
-		RenderScene(&geometry, &shader);
+		return CHANGE_LIGHT;
 	}
 	
-	//Choose scene 2
-	else if (key == GLFW_KEY_2 && action == GLFW_PRESS)
+	//Choose scene 1, 2 or 3
+	else if((key == GLFW_KEY_1 || key == GLFW_KEY_2 || key == GLFW_KEY_3) && action == GLFW_PRESS)
 	{
-		x = 0.f;
-		y = 0.f;
-		z = 0.f;
-			
-		//Set array sizes in fragment shader	
-      glUseProgram(shader.program);
-      
-      GLint loc1 = glGetUniformLocation(shader.program, "pV");
-      if(loc1 != -1)
-		glUniform1i(loc1, 12); 
+		LoadScene(key - GLFW_KEY_1 + 1);
+		return CHANGE_SCENE;
+	}
+	
+	else
+		return CHANGE_NONE;
+	
+	//Only the camera keys get here
+	return CHANGE_CAMERA;
+}
+
+//Key events are written here when the window is started with --record
+InputRecorder inputRecorder;
+
+// handles keyboard input events
+void KeyCallback(GLFWwindow* window, int key, int scancode, int action, int mods)
+{
+	inputRecorder.Record(key, scancode, action, mods);
+	
+	if (key == GLFW_KEY_ESCAPE && action == GLFW_PRESS)
+		glfwSetWindowShouldClose(window, GL_TRUE);
+	
+	//Switch between traced and rasterized primary visibility
+	else if (key == GLFW_KEY_R && action == GLFW_PRESS)
+	{
+		rasterPrimary = !rasterPrimary;
+		cout << (rasterPrimary ? "Rasterizing" : "Tracing") << " primary visibility" << endl;
 		
-	  GLint loc2 = glGetUniformLocation(shader.program, "tV");
-      if(loc2 != -1)	
-		glUniform1i(loc2, 288);
+		DrawScene();
+	}
+	
+	//Switch the intersection test heatmap on and off, saving it when shown
+	else if (key == GLFW_KEY_H && action == GLFW_PRESS)
+	{
+		showHeatmap = !showHeatmap;
+		DrawScene();
 		
-	  GLint loc3 = glGetUniformLocation(shader.program, "sV");
-      if(loc3 != -1)	
-		glUniform1i(loc3, 12);
+		if(showHeatmap)
+			SaveScreen("heatmap.png");
+	}
+	
+	else switch(ApplyKey(key, action))
+	{
+	case CHANGE_CAMERA:
+		UploadCamera(&uniforms);
+		DrawScene();
+		break;
+	
+	case CHANGE_LIGHT:
+		UploadLight(&uniforms);
 		
-	  GLint loc4 = glGetUniformLocation(shader.program, "x");
-		if(loc4 != -1)
-			glUniform1f(loc4, x);
-			
-	  GLint loc5 = glGetUniformLocation(shader.program, "z");
-		if(loc5 != -1)
-			glUniform1f(loc5, z);	
+		//Primary hits are unchanged, so only shade the G-buffer again
+		if(gbuffer.current)
+			RelightScene(&geometry, activeShader, &gbuffer);
+		else
+			DrawScene();
+		break;
+	
+	case CHANGE_SCENE:
+		UploadCamera(&uniforms);
+		UploadScene(&uniforms);
+		SelectSceneShader();
+		InitializeTriangles(&triangles, triangleVertices);
+		DrawScene();
+		break;
+	
+	default:
+		break;
+	}
+}
 
-	  GLint loc6 = glGetUniformLocation(shader.program, "y");
-		if(loc6 != -1)
-			glUniform1f(loc6, y);	
-			
-		scene2Vertices(shader);
-		RenderScene(&geometry, &shader);
+// ==========================================================================
+// HEADLESS RENDERING
+
+//Set by SIGINT or SIGTERM, the render checkpoints and stops after its band
+volatile sig_atomic_t stopRendering = 0;
+
+void StopRenderingHandler(int)
+{
+	stopRendering = 1;
+}
+
+//Render a scene on the CPU straight into an image file of any size, without
+//opening a window:
+//  --render SCENE WIDTHxHEIGHT FILE [--tile N] [--checkpoint SECONDS]
+//           [--workers N] [--stats JSONFILE] [--heatmap TESTS]
+//           [--timeline JSONFILE] [--aa N]
+//Tiles are written into the memory-mapped file at their final place and each
+//band of tiles is released once finished, so memory use stays at about one
+//band of the image however large the file is
+//
+//Progress is saved to FILE.checkpoint every SECONDS (60 by default, 0 turns
+//it off) and when the render is interrupted; running the same command again
+//finishes the tiles that are left and gives the same file as an
+//uninterrupted render
+//
+//With --workers the tiles are rendered by N worker processes instead of
+//threads, see RenderFarm.h. Builds with TRACE_STATS print ray and
+//intersection test counts at the end, and --stats saves them as JSON.
+//--heatmap renders how many intersection tests each pixel takes instead,
+//in false colour up to red at TESTS, or at the most a pixel can take when
+//TESTS is 0; every build counts them. --timeline saves when each
+//stage and tile ran on each thread as Chrome trace events, see Timeline.h.
+//--aa supersamples pixels on edges and shadow boundaries with up to N rays
+int RenderHeadless(int argc, char *argv[])
+{
+	int scene = 0, width = 0, height = 0, tile = 64, interval = 60, workers = 0, heatmap = -1;
+	int aaSamples = 1;
+	string fileName, statsName, timelineName;
+	bool valid = argc >= 5 && (argc - 5)%2 == 0;
+	
+	if(valid)
+	{
+		scene = atoi(argv[2]);
+		if(sscanf(argv[3], "%dx%d", &width, &height) != 2)
+			width = height = 0;
+		fileName = argv[4];
+	}
+	for(int i = 5; valid && i + 1 < argc; i += 2)
+	{
+		string option = argv[i];
+		if(option == "--tile")
+			tile = atoi(argv[i + 1]);
+		else if(option == "--checkpoint")
+			interval = atoi(argv[i + 1]);
+		else if(option == "--workers")
+			workers = atoi(argv[i + 1]);
+		else if(option == "--stats")
+			statsName = argv[i + 1];
+		else if(option == "--heatmap")
+			heatmap = std::max(0, atoi(argv[i + 1]));
+		else if(option == "--timeline")
+			timelineName = argv[i + 1];
+		else if(option == "--aa")
+			aaSamples = atoi(argv[i + 1]);
+		else
+			valid = false;
 	}
 	
-	//Choose scene 3
-	else if (key == GLFW_KEY_3 && action == GLFW_PRESS)
+	if(!valid || scene < 1 || scene > 3 || width <= 0 || height <= 0 || tile <= 0 ||
+	   interval < 0 || workers < 0 || aaSamples < 1 || !MappedImage::IsMappedFileName(fileName))
 	{
-		x = -0.1f;
-		y = 0.f;
-		z = -1.0f;
-			
-		//Set array sizes in fragment shader	
-      glUseProgram(shader.program);
-      
-      GLint loc1 = glGetUniformLocation(shader.program, "pV");
-      if(loc1 != -1)
-		glUniform1i(loc1, 12); 
-		
-	  GLint loc2 = glGetUniformLocation(shader.program, "tV");
-      if(loc2 != -1)	
-		glUniform1i(loc2, 360);
-		
-	  GLint loc3 = glGetUniformLocation(shader.program, "sV");
-      if(loc3 != -1)	
-		glUniform1i(loc3, 8);
+		cout << "Usage: " << argv[0] << " --render SCENE WIDTHxHEIGHT FILE [--tile N] [--checkpoint SECONDS]"
+		     << " [--workers N] [--stats JSONFILE] [--heatmap TESTS] [--timeline JSONFILE] [--aa N]" << endl
+		     << "  SCENE is 1, 2 or 3, FILE ends in .ppm, .pfm or .exr" << endl;
+		return -1;
+	}
+	
+	//A worker sends each tile back as one message
+	if(workers > 0 && size_t(std::min(tile, width))*std::min(tile, height) > RenderFarm::MaxTilePixels())
+	{
+		cout << "--tile " << tile << " is too large for --workers, a tile may have at most "
+		     << RenderFarm::MaxTilePixels() << " pixels" << endl;
+		return -1;
+	}
+	
+	if(!timelineName.empty())
+		StartTimeline();
+	
+	LoadScene(scene);
+	SceneBlock block;
+	PackScene(&block);
+	glm::vec3 eye(x, y, z);
+	RayTracer tracer(block, eye);
+	if(heatmap == 0)
+		heatmap = tracer.MaxCost();
+	
+	int tilesAcross = (width + tile - 1)/tile;
+	int tilesDown = (height + tile - 1)/tile;
+	
+	RenderCheckpoint progress;
+	progress.scene = scene;
+	progress.width = width;
+	progress.height = height;
+	progress.tileSize = tile;
+	progress.sceneHash = UpdateCrc(UpdateCrc(0, (const unsigned char *) &block, sizeof(block)),
+	                               (const unsigned char *) &eye, sizeof(eye));
+	if(heatmap > 0)
+		progress.sceneHash = UpdateCrc(progress.sceneHash, (const unsigned char *) &heatmap, sizeof(heatmap));
+	if(aaSamples > 1)
+		progress.sceneHash = UpdateCrc(progress.sceneHash, (const unsigned char *) &aaSamples, sizeof(aaSamples));
+	progress.tileDone.assign(size_t(tilesAcross)*tilesDown, 0);
+	
+	//Carry on from a checkpoint of the same render if there is one
+	string checkpointName = fileName + ".checkpoint";
+	RenderCheckpoint saved;
+	MappedImage image;
+	if(interval > 0 && LoadCheckpoint(checkpointName, saved) && saved.Matches(progress) &&
+	   image.Reopen(fileName, width, height))
+	{
+		progress = saved;
+		cout << "Resuming from " << checkpointName << ", "
+		     << std::count(progress.tileDone.begin(), progress.tileDone.end(), 1) << " of "
+		     << progress.tileDone.size() << " tiles done" << endl;
+	}
+	else if(!image.Create(fileName, width, height))
+		return -1;
+	
+	if(interval > 0)
+	{
+		signal(SIGINT, StopRenderingHandler);
+		signal(SIGTERM, StopRenderingHandler);
+	}
+	chrono::steady_clock::time_point lastCheckpoint = chrono::steady_clock::now();
+	
+	int bandsLeft = 0;
+	for(int band = 0; band < tilesDown; band++)
+		if(std::count(progress.tileDone.begin() + size_t(band)*tilesAcross,
+		              progress.tileDone.begin() + size_t(band + 1)*tilesAcross, 1) < tilesAcross)
+			bandsLeft++;
+	
+	//Called once every tile of a band is written: hands its pages back and
+	//checkpoints when one is due, returns false to stop the render. Tiles
+	//only count as done in a checkpoint once they are on disk
+	auto bandFinished = [&](int band) -> bool
+	{
+		image.Release(band*tile, std::min(height, (band + 1)*tile));
+		bandsLeft--;
+		cout << "\rRendered " << (100*(tilesDown - bandsLeft))/tilesDown << "%" << flush;
 		
-	  GLint loc4 = glGetUniformLocation(shader.program, "x");
-		if(loc4 != -1)
-			glUniform1f(loc4, x);
-			
-	  GLint loc5 = glGetUniformLocation(shader.program, "z");
-		if(loc5 != -1)
-			glUniform1f(loc5, z);	
+		if(interval > 0 && bandsLeft > 0 &&
+		   chrono::steady_clock::now() - lastCheckpoint >= chrono::seconds(interval))
+		{
+			if(image.Flush())
+				SaveCheckpoint(checkpointName, progress);
+			lastCheckpoint = chrono::steady_clock::now();
+		}
+		return !stopRendering;
+	};
+	
+	chrono::steady_clock::time_point renderStart = chrono::steady_clock::now();
+	CollectTraceStats(true);
+	
+	bool complete = true;
+	if(workers > 0)
+	{
+		//Tiles go out to worker processes and come back in any order
+		FarmJob job = { block, eye, width, height, tile, std::max(0, heatmap), aaSamples };
+		RenderFarm farm(argv[0], workers);
+		complete = farm.Render(job, image, progress.tileDone, bandFinished, &stopRendering);
+	}
+	else
+	{
+		//One band of tiles at a time from the bottom, the tiles of a band
+		//are shared between threads
+		for(int band = 0; complete && band < tilesDown; band++)
+		{
+			int y0 = band*tile;
+			int rows = std::min(tile, height - y0);
+			unsigned char *done = &progress.tileDone[size_t(band)*tilesAcross];
+			if(std::count(done, done + tilesAcross, 1) == tilesAcross)
+				continue;
 			
-	  GLint loc6 = glGetUniformLocation(shader.program, "y");
-		if(loc6 != -1)
-			glUniform1f(loc6, y);	
+			ParallelFor(tilesAcross, 1, [&](int begin, int end)
+			{
+				vector<glm::vec3> colours(size_t(tile)*tile);
+				for(int i = begin; i < end; i++)
+				{
+					if(done[i])
+						continue;
+					int x0 = i*tile;
+					int columns = std::min(tile, width - x0);
+					if(heatmap > 0)
+						tracer.RenderCostTile(x0, y0, columns, rows, width, height, &colours[0], heatmap);
+					else if(aaSamples > 1)
+						tracer.RenderAdaptiveTile(x0, y0, columns, rows, width, height, &colours[0], aaSamples);
+					else
+						tracer.RenderTile(x0, y0, columns, rows, width, height, &colours[0]);
+					image.WriteTile(x0, y0, columns, rows, &colours[0]);
+					done[i] = 1;
+				}
+			});
 			
-		scene3Vertices(shader);
-		RenderScene(&geometry, &shader);
-	}		
-		
+			complete = bandFinished(band);
+		}
+	}
+	cout << endl;
+	
+	//Keep what was rendered for the next run
+	if(!complete || bandsLeft > 0)
+	{
+		if(interval > 0 && image.Flush())
+			SaveCheckpoint(checkpointName, progress);
+		image.Close();
+		if(!timelineName.empty())
+			SaveTimeline(timelineName);
+		if(stopRendering)
+			cout << "Render interrupted, run the same command again to resume" << endl;
+		else
+			cout << "Render of " << fileName << " failed" << endl;
+		return stopRendering ? 1 : -1;
+	}
+	
+	if(!image.Close())
+	{
+		cout << "Failed to write " << fileName << endl;
+		return -1;
+	}
+	remove(checkpointName.c_str());
+	cout << "Saved " << width << "x" << height << " render to " << fileName << endl;
+	if(!timelineName.empty())
+		SaveTimeline(timelineName);
+	
+	//Worker processes keep their own counters
+	double seconds = chrono::duration<double>(chrono::steady_clock::now() - renderStart).count();
+	if(TRACE_STATS_ENABLED && workers == 0)
+	{
+		TraceStats stats = CollectTraceStats(true);
+		PrintTraceStats(cout, stats, seconds);
+		if(!statsName.empty())
+			SaveTraceStats(statsName, vector<TraceStats>(1, stats), vector<double>(1, seconds));
+	}
+	else if(!statsName.empty())
+		cout << "Trace statistics are only counted by builds with TRACE_STATS (make STATS=1) and without --workers" << endl;
+	return 0;
+}
+
+//Packed scene and starting camera of scene 1, 2 or 3 for the render server
+bool LoadSceneBlock(int scene, SceneBlock &block, glm::vec3 &eye)
+{
+	if(scene < 1 || scene > 3)
+		return false;
+	
+	LoadScene(scene);
+	PackScene(&block);
+	eye = glm::vec3(x, y, z);
+	return true;
+}
+
+//Keep scenes and threads loaded and render jobs sent to a socket:
+//  --serve SOCKET
+int ServeRenders(const string &socketName)
+{
+	signal(SIGINT, StopRenderingHandler);
+	signal(SIGTERM, StopRenderingHandler);
+	return RunRenderServer(socketName, LoadSceneBlock, &stopRendering);
+}
+
+//Send a job to a running server and save the image it sends back:
+//  --submit SOCKET SCENE WIDTHxHEIGHT FILE [--samples N] [--eye X,Y,Z]
+int SubmitToServer(int argc, char *argv[])
+{
+	RenderRequest request = RenderRequest();
+	request.samples = 1;
+	bool valid = argc >= 6 && (argc - 6)%2 == 0;
+	
+	if(valid)
+	{
+		request.scene = atoi(argv[3]);
+		valid = sscanf(argv[4], "%dx%d", &request.width, &request.height) == 2;
+	}
+	for(int i = 6; valid && i + 1 < argc; i += 2)
+	{
+		string option = argv[i];
+		if(option == "--samples")
+			request.samples = atoi(argv[i + 1]);
+		else if(option == "--eye")
+		{
+			request.useEye = 1;
+			valid = sscanf(argv[i + 1], "%f,%f,%f", &request.eye[0], &request.eye[1], &request.eye[2]) == 3;
+		}
+		else
+			valid = false;
+	}
+	
+	if(!valid || !IsFrameFileName(argv[5]))
+	{
+		cout << "Usage: " << argv[0] << " --submit SOCKET SCENE WIDTHxHEIGHT FILE"
+		     << " [--samples N] [--eye X,Y,Z]" << endl
+		     << "  FILE ends in .png, .ppm, .pfm or .exr" << endl;
+		return -1;
+	}
+	return SubmitRender(argv[2], request, argv[5]);
+}
+
+//Render frames of a scene along a camera path file:
+//  --animate SCENE WIDTHxHEIGHT PATHFILE PATTERN [--fps N] [--samples N]
+//            [--queue K] [--stats JSONFILE] [--timeline JSONFILE]
+//PATTERN names the frames, e.g. frames/shot_%04d.png, see Animation.h for
+//the path file; tracing runs up to K frames (2 by default) ahead of encoding
+int RenderCameraPath(int argc, char *argv[])
+{
+	int scene = 0;
+	AnimationSettings settings = { 0, 0, 1, 24.f, "", 2, "" };
+	string pathName, timelineName;
+	bool valid = argc >= 6 && (argc - 6)%2 == 0;
+	
+	if(valid)
+	{
+		scene = atoi(argv[2]);
+		valid = sscanf(argv[3], "%dx%d", &settings.width, &settings.height) == 2;
+		pathName = argv[4];
+		settings.framePattern = argv[5];
+	}
+	for(int i = 6; valid && i + 1 < argc; i += 2)
+	{
+		string option = argv[i];
+		if(option == "--fps")
+			settings.framesPerSecond = float(atof(argv[i + 1]));
+		else if(option == "--samples")
+			settings.samples = atoi(argv[i + 1]);
+		else if(option == "--queue")
+			settings.queueLength = atoi(argv[i + 1]);
+		else if(option == "--stats")
+			settings.statsFile = argv[i + 1];
+		else if(option == "--timeline")
+			timelineName = argv[i + 1];
+		else
+			valid = false;
+	}
+	
+	//The pattern needs exactly one integer conversion for the frame number
+	size_t percent = settings.framePattern.find('%');
+	size_t conversion = settings.framePattern.find_first_not_of("0123456789", percent + 1);
+	valid = valid && percent != string::npos && conversion != string::npos &&
+	        settings.framePattern[conversion] == 'd' &&
+	        settings.framePattern.find('%', percent + 1) == string::npos;
+	
+	if(valid && !timelineName.empty())
+		StartTimeline();
+	
+	SceneBlock block;
+	glm::vec3 eye;
+	if(!valid || !LoadSceneBlock(scene, block, eye) || settings.width <= 0 || settings.height <= 0 ||
+	   settings.samples < 1 || settings.framesPerSecond <= 0 || settings.queueLength < 1 ||
+	   !IsFrameFileName(settings.framePattern))
+	{
+		cout << "Usage: " << argv[0] << " --animate SCENE WIDTHxHEIGHT PATHFILE PATTERN"
+		     << " [--fps N] [--samples N] [--queue K] [--stats JSONFILE] [--timeline JSONFILE]" << endl
+		     << "  PATTERN is a frame file name with one %d, ending in .png, .ppm, .pfm or .exr" << endl;
+		return -1;
+	}
+	
+	CameraPath path;
+	if(!path.Load(pathName))
+		return -1;
+	
+	signal(SIGINT, StopRenderingHandler);
+	signal(SIGTERM, StopRenderingHandler);
+	int result = RenderAnimation(block, path, settings, &stopRendering);
+	if(!timelineName.empty())
+		SaveTimeline(timelineName);
+	return result;
+}
+
+//Path trace a scene progressively on the CPU:
+//  --pathtrace SCENE WIDTHxHEIGHT FILE [--samples N] [--seconds S]
+//              [--every K] [--eye X,Y,Z] [--error E] [--denoise D]
+//              [--checkpoint SECONDS]
+//Each pass adds a path to every pixel, up to N paths (64 by default) or
+//until S seconds have passed. With --error tiles whose relative error is
+//below E stop early. The image so far is saved to FILE every K passes and
+//at the end, also when stopped with Ctrl-C or SIGTERM, after D passes of
+//the denoiser if given
+//
+//The sums of the paths are saved to FILE.checkpoint every SECONDS (60 by
+//default, 0 turns it off) and when the render stops short of N paths;
+//running the same command again carries on and gives the same file as an
+//uninterrupted render
+int PathTraceScene(int argc, char *argv[])
+{
+	int scene = 0, width = 0, height = 0, samples = 64, every = 0, denoise = 0, interval = 60;
+	double seconds = 0, error = 0;
+	bool useEye = false;
+	glm::vec3 eye;
+	string fileName;
+	bool valid = argc >= 5 && (argc - 5)%2 == 0;
+	
+	if(valid)
+	{
+		scene = atoi(argv[2]);
+		valid = sscanf(argv[3], "%dx%d", &width, &height) == 2;
+		fileName = argv[4];
+	}
+	for(int i = 5; valid && i + 1 < argc; i += 2)
+	{
+		string option = argv[i];
+		if(option == "--samples")
+			samples = atoi(argv[i + 1]);
+		else if(option == "--seconds")
+			seconds = atof(argv[i + 1]);
+		else if(option == "--every")
+			every = atoi(argv[i + 1]);
+		else if(option == "--error")
+			error = atof(argv[i + 1]);
+		else if(option == "--denoise")
+			denoise = atoi(argv[i + 1]);
+		else if(option == "--checkpoint")
+			interval = atoi(argv[i + 1]);
+		else if(option == "--eye")
+		{
+			useEye = true;
+			valid = sscanf(argv[i + 1], "%f,%f,%f", &eye.x, &eye.y, &eye.z) == 3;
+		}
+		else
+			valid = false;
+	}
+	
+	SceneBlock block;
+	glm::vec3 sceneEye;
+	if(!valid || width <= 0 || height <= 0 || samples < 1 || seconds < 0 || every < 0 || error < 0 || denoise < 0 ||
+	   interval < 0 || !IsFrameFileName(fileName) || !LoadSceneBlock(scene, block, sceneEye))
+	{
+		cout << "Usage: " << argv[0] << " --pathtrace SCENE WIDTHxHEIGHT FILE [--samples N]"
+		     << " [--seconds S] [--every K] [--eye X,Y,Z] [--error E] [--denoise D]"
+		     << " [--checkpoint SECONDS]" << endl
+		     << "  SCENE is 1, 2 or 3, FILE ends in .png, .ppm, .pfm or .exr" << endl;
+		return -1;
+	}
+	
+	if(!useEye)
+		eye = sceneEye;
+	PathTracer tracer(block, eye, width, height);
+	tracer.SetTargetError(float(error));
+	
+	//Carry on from a checkpoint of the same render if there is one, the
+	//error target decides which tiles are still traced so it must match too
+	float targetError = float(error);
+	RenderCheckpoint progress;
+	progress.scene = scene;
+	progress.width = width;
+	progress.height = height;
+	progress.tileSize = PathTracer::TILE_SIZE;
+	progress.sceneHash = UpdateCrc(UpdateCrc(UpdateCrc(0, (const unsigned char *) &block, sizeof(block)),
+	                                         (const unsigned char *) &eye, sizeof(eye)),
+	                               (const unsigned char *) &targetError, sizeof(targetError));
+	progress.path.tilePasses.resize(tracer.Tiles());
+	
+	string checkpointName = fileName + ".checkpoint";
+	RenderCheckpoint saved;
+	if(interval > 0 && LoadCheckpoint(checkpointName, saved) && saved.Matches(progress) &&
+	   tracer.RestoreState(saved.path))
+		cout << "Resuming from " << checkpointName << ", " << tracer.Passes() << " passes done" << endl;
+	chrono::steady_clock::time_point lastCheckpoint = chrono::steady_clock::now();
+	
+	//The state after whole passes only, so a resumed render repeats none
+	auto checkpoint = [&]()
+	{
+		tracer.SaveState(progress.path);
+		SaveCheckpoint(checkpointName, progress);
+		lastCheckpoint = chrono::steady_clock::now();
+	};
+	
+	ThreadPool pool;
+	vector<glm::vec3> colours;
+	DenoiseFeatures features;
+	
+	//The mean of the paths so far, denoised if asked for
+	auto resolve = [&]()
+	{
+		tracer.Resolve(colours);
+		if(denoise > 0)
+		{
+			tracer.ResolveFeatures(features);
+			Denoise(pool, width, height, features, colours, denoise);
+		}
+	};
+	
+	signal(SIGINT, StopRenderingHandler);
+	signal(SIGTERM, StopRenderingHandler);
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	double elapsed = 0;
+	
+	while(tracer.Passes() < samples && tracer.ActiveTiles() > 0 && !stopRendering &&
+	      (seconds == 0 || elapsed < seconds))
+	{
+		tracer.RenderPass(pool);
+		elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		cout << "\rPass " << tracer.Passes() << " of " << samples << ", " << elapsed << " s";
+		if(error > 0)
+			cout << ", " << tracer.ActiveTiles() << " of " << tracer.Tiles() << " tiles left  ";
+		cout << flush;
 		
+		if(every > 0 && tracer.Passes()%every == 0 && tracer.Passes() < samples)
+		{
+			resolve();
+			SaveFrame(fileName, width, height, &colours[0]);
+		}
+		if(interval > 0 && chrono::steady_clock::now() - lastCheckpoint >= chrono::seconds(interval))
+			checkpoint();
+	}
+	cout << endl;
+	
+	bool complete = tracer.Passes() >= samples || tracer.ActiveTiles() == 0;
+	if(interval > 0 && !complete)
+	{
+		checkpoint();
+		cout << "Run the same command again to carry on from " << tracer.Passes() << " passes" << endl;
+	}
+	
+	resolve();
+	if(!SaveFrame(fileName, width, height, &colours[0]))
+		return -1;
+	if(complete)
+		remove(checkpointName.c_str());
+	if(error > 0)
+		cout << tracer.Tiles() - tracer.ActiveTiles() << " of " << tracer.Tiles()
+		     << " tiles converged, " << tracer.MeanPasses() << " paths per pixel on average" << endl;
+	cout << "Saved " << tracer.Passes() << " paths per pixel to " << fileName << " in "
+	     << elapsed << " s" << endl;
+	return 0;
+}
+
+//Applies a recorded key event as the window would, the scene and camera
+//are only packed once a scene has been loaded
+bool ApplyReplayEvent(const InputEvent &event, SceneBlock &block, glm::vec3 &eye)
+{
+	if(ApplyKey(event.key, event.action) == CHANGE_NONE || light.size() != 3)
+		return false;
+	
+	PackScene(&block);
+	eye = glm::vec3(x, y, z);
+	return true;
+}
+
+//Replay key events recorded with --record on the CPU and report the latency
+//to the first and the refined frame of each:
+//  --replay EVENTFILE WIDTHxHEIGHT [--samples N] [--preview SCALE]
+//           [--pace recorded|immediate] [--output FILE]
+int ReplayRecording(int argc, char *argv[])
+{
+	ReplaySettings settings = { 0, 0, 4, 4, true, "" };
+	bool valid = argc >= 4 && (argc - 4)%2 == 0;
+	
+	if(valid)
+		valid = sscanf(argv[3], "%dx%d", &settings.width, &settings.height) == 2;
+	for(int i = 4; valid && i + 1 < argc; i += 2)
+	{
+		string option = argv[i], value = argv[i + 1];
+		if(option == "--samples")
+			settings.samples = atoi(argv[i + 1]);
+		else if(option == "--preview")
+			settings.previewScale = atoi(argv[i + 1]);
+		else if(option == "--pace" && (value == "recorded" || value == "immediate"))
+			settings.recordedPace = value == "recorded";
+		else if(option == "--output")
+			settings.outputFile = value;
+		else
+			valid = false;
+	}
+	
+	if(!valid || settings.width <= 0 || settings.height <= 0 || settings.samples < 1 ||
+	   settings.previewScale < 1 ||
+	   (!settings.outputFile.empty() && !IsFrameFileName(settings.outputFile)))
+	{
+		cout << "Usage: " << argv[0] << " --replay EVENTFILE WIDTHxHEIGHT [--samples N]"
+		     << " [--preview SCALE] [--pace recorded|immediate] [--output FILE]" << endl
+		     << "  EVENTFILE is recorded by running the window with --record EVENTFILE" << endl;
+		return -1;
+	}
+	
+	vector<InputEvent> events;
+	if(!LoadInputEvents(argv[2], events))
+		return -1;
+	return ReplayInput(events, ApplyReplayEvent, settings);
 }
 
 // ==========================================================================
@@ -1072,6 +2050,36 @@ void KeyCallback(GLFWwindow* window, int key, int scancode, int action, int mods
 
 int main(int argc, char *argv[])
 {
+	// render to a file on the CPU instead of opening a window
+	if (argc > 1 && string(argv[1]) == "--render")
+		return RenderHeadless(argc, argv);
+	if (argc == 3 && string(argv[1]) == "--worker")
+		return RunFarmWorker(argv[2]);
+	if (argc == 3 && string(argv[1]) == "--serve")
+		return ServeRenders(argv[2]);
+	if (argc > 1 && string(argv[1]) == "--submit")
+		return SubmitToServer(argc, argv);
+	if (argc > 1 && string(argv[1]) == "--animate")
+		return RenderCameraPath(argc, argv);
+	if (argc > 1 && string(argv[1]) == "--replay")
+		return ReplayRecording(argc, argv);
+	if (argc > 1 && string(argv[1]) == "--pathtrace")
+		return PathTraceScene(argc, argv);
+
+	// record a timeline of the window's passes, saved when it closes, and
+	// the key events it receives
+	string timelineName;
+	for (int i = 1; i + 1 < argc; i += 2)
+	{
+		string option = argv[i];
+		if (option == "--timeline")
+			timelineName = argv[i + 1];
+		else if (option == "--record" && !inputRecorder.Open(argv[i + 1]))
+			return -1;
+	}
+	if (!timelineName.empty())
+		StartTimeline();
+
 	// initialize the GLFW windowing system
 	if (!glfwInit()) {
 		cout << "ERROR: GLFW failed to initialize, TERMINATING" << endl;
@@ -1104,6 +2112,7 @@ int main(int argc, char *argv[])
 		return -1;
 	}
 	#endif
+	LoadProgramBinaryFunctions();
 
 	// query and print out information about our OpenGL environment
 	QueryGLVersion();
@@ -1117,9 +2126,27 @@ int main(int argc, char *argv[])
 		// call function to create and fill buffers with geometry data
 	if (!InitializeGeometry(&geometry))
 		cout << "Program failed to intialize geometry!" << endl;
+
+	// primary hits are kept in a G-buffer so light edits only redo shading,
+	// without one every change traces the whole scene again
+	if (!InitializeGBuffer(&gbuffer))
+	{
+		cout << "Program failed to initialize G-buffer, relighting disabled" << endl;
+		DestroyGBuffer(&gbuffer);
+	}
+	
+	// scene and camera data live in uniform buffers shared by all shaders
+	if (!InitializeUniformBuffers(&uniforms)) {
+		cout << "Program could not initialize uniform buffers, TERMINATING" << endl;
+		return -1;
+	}
+	
+	// triangles can be rasterized into the G-buffer instead of traced
+	if (!InitializeShaders(&rasterShader, "raster_vertex.glsl", "raster_fragment.glsl"))
+		cout << "Program failed to initialize raster shaders!" << endl;
 		
 	//scene1Vertices(shader);
-	//RenderScene(&geometry, &shader);
+	//DrawScene();
 
 	// run an event-triggered main loop
 	while (!glfwWindowShouldClose(window))
@@ -1129,11 +2156,21 @@ int main(int argc, char *argv[])
 	}
 
 	// clean up allocated resources before exit
+	DestroyTriangles(&triangles);
+	DestroyUniformBuffers(&uniforms);
+	DestroyGBuffer(&gbuffer);
 	DestroyGeometry(&geometry);
+	DestroyShaders(&rasterShader);
+	for (map<string, MyShader>::iterator variant = sceneShaders.begin();
+	     variant != sceneShaders.end(); ++variant)
+		DestroyShaders(&variant->second);
 	DestroyShaders(&shader);
 	glfwDestroyWindow(window);
 	glfwTerminate();
 
+	if (!timelineName.empty())
+		SaveTimeline(timelineName);
+
 	//cout << "Goodbye!" << endl;
 	return 0;
 }
@@ -1204,6 +2241,21 @@ string LoadSource(const string &filename)
 	return source;
 }
 
+// inserts preprocessor definitions into shader source, right after the
+// #version directive which has to stay on the first line
+string InsertDefines(const string &source, const string &defines)
+{
+	if (defines.empty())
+		return source;
+
+	size_t version = source.find("#version");
+	size_t line = (version == string::npos) ? 0 : source.find('\n', version);
+	if (line == string::npos)
+		return source + "\n" + defines;
+
+	return source.substr(0, line + 1) + defines + source.substr(line + 1);
+}
+
 // creates and returns a shader object compiled from the given source
 GLuint CompileShader(GLenum shaderType, const string &source)
 {
@@ -1242,6 +2294,10 @@ GLuint LinkProgram(GLuint vertexShader, GLuint fragmentShader)
 	if (vertexShader)   glAttachShader(programObject, vertexShader);
 	if (fragmentShader) glAttachShader(programObject, fragmentShader);
 
+	// ask the driver to keep the binary so it can be cached on disk
+	if (programBinarySupported)
+		glProgramParameteri(programObject, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+
 	// try linking the program with given attachments
 	glLinkProgram(programObject);
 
@@ -1260,3 +2316,132 @@ GLuint LinkProgram(GLuint vertexShader, GLuint fragmentShader)
 
 	return programObject;
 }
+
+// --------------------------------------------------------------------------
+// Program binary cache, so unchanged shaders are not recompiled at startup
+
+// header written in front of each cached program binary
+struct ProgramBinaryHeader
+{
+	unsigned int magic;
+	unsigned int format;
+	unsigned int length;
+};
+const unsigned int PROGRAM_BINARY_MAGIC = 0x42505452;	// "RTPB"
+const char *PROGRAM_CACHE_DIRECTORY = "shadercache";
+
+// headers declaring OpenGL 4.1 link the entry points directly, other builds
+// ask the context for them
+void LoadProgramBinaryFunctions()
+{
+	#ifndef GL_VERSION_4_1
+	glGetProgramBinary = (PFNGLGETPROGRAMBINARYPROC) glfwGetProcAddress("glGetProgramBinary");
+	glProgramBinary = (PFNGLPROGRAMBINARYPROC) glfwGetProcAddress("glProgramBinary");
+	glProgramParameteri = (PFNGLPROGRAMPARAMETERIPROC) glfwGetProcAddress("glProgramParameteri");
+	programBinarySupported = glGetProgramBinary && glProgramBinary && glProgramParameteri;
+	#else
+	programBinarySupported = true;
+	#endif
+	if (!programBinarySupported)
+		cout << "Program binaries not supported, shaders will not be cached" << endl;
+}
+
+// returns the cache file for a program built from the given source, keyed
+// on a hash of the source and the driver that will load the binary
+string ProgramCacheFile(const string &source)
+{
+	string key = source;
+	const GLenum strings[] = { GL_VENDOR, GL_RENDERER, GL_VERSION };
+	for (int i = 0; i < 3; ++i)
+	{
+		const GLubyte *value = glGetString(strings[i]);
+		if (value)
+			key += reinterpret_cast<const char *>(value);
+	}
+
+	// 64-bit FNV-1a
+	unsigned long long hash = 14695981039346656037ULL;
+	for (size_t i = 0; i < key.size(); ++i)
+	{
+		hash ^= (unsigned char)key[i];
+		hash *= 1099511628211ULL;
+	}
+
+	char name[32];
+	snprintf(name, sizeof(name), "%016llx.bin", hash);
+	return string(PROGRAM_CACHE_DIRECTORY) + "/" + name;
+}
+
+// creates a program from a cached binary, returning zero if there is no
+// usable binary (missing, or rejected after a driver update)
+GLuint LoadProgramBinary(const string &filename)
+{
+	if (!programBinarySupported)
+		return 0;
+
+	ifstream input(filename.c_str(), ios::binary);
+	if (!input)
+		return 0;
+
+	ProgramBinaryHeader header;
+	if (!input.read(reinterpret_cast<char *>(&header), sizeof(header)) ||
+	    header.magic != PROGRAM_BINARY_MAGIC || header.length == 0)
+		return 0;
+
+	vector<char> binary(header.length);
+	if (!input.read(&binary[0], binary.size()))
+		return 0;
+
+	GLuint programObject = glCreateProgram();
+	glProgramBinary(programObject, header.format, &binary[0], binary.size());
+
+	GLint status;
+	glGetProgramiv(programObject, GL_LINK_STATUS, &status);
+	if (status == GL_FALSE)
+	{
+		glDeleteProgram(programObject);
+		return 0;
+	}
+	return programObject;
+}
+
+// writes the binary of a successfully linked program to the cache
+void SaveProgramBinary(GLuint program, const string &filename)
+{
+	if (!programBinarySupported)
+		return;
+
+	GLint status, length = 0;
+	glGetProgramiv(program, GL_LINK_STATUS, &status);
+	if (status == GL_FALSE)
+		return;
+	glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+	if (length <= 0)
+		return;
+
+	ProgramBinaryHeader header;
+	vector<char> binary(length);
+	glGetProgramBinary(program, length, 0, &header.format, &binary[0]);
+	header.magic = PROGRAM_BINARY_MAGIC;
+	header.length = length;
+
+	#ifdef _WIN32
+	_mkdir(PROGRAM_CACHE_DIRECTORY);
+	#else
+	mkdir(PROGRAM_CACHE_DIRECTORY, 0755);
+	#endif
+
+	// write to a temporary name so a partial file is never loaded
+	string temporary = filename + ".tmp";
+	ofstream output(temporary.c_str(), ios::binary);
+	output.write(reinterpret_cast<const char *>(&header), sizeof(header));
+	output.write(&binary[0], binary.size());
+	output.close();
+
+	if (!output || rename(temporary.c_str(), filename.c_str()) != 0)
+	{
+		remove(temporary.c_str());
+		cout << "WARNING: Could not cache program binary " << filename << endl;
+	}
+}
+
@@ -13,36 +13,93 @@ in vec3 Colour;
 in vec2 Coordinates;
 
 //first output is mapped to the framebuffer's colour index by default
-out vec4 FragmentColour;
+//in the primary pass the three outputs fill the G-buffer attachments instead
+layout(location = 0) out vec4 FragmentColour;
+layout(location = 1) out vec4 HitNormal;
+layout(location = 2) out vec4 HitMaterial;
 
-float pi = 3.14159265359;
+//Render passes, see RenderScene() in the main program
+#define PASS_FULL 0
+#define PASS_PRIMARY 1
+#define PASS_SHADE 2
+#define PASS_HEATMAP 3
 
-//Initial origin position
-uniform float x = 0;
-uniform float y = 0;
-uniform float z = 0;
+//Primitive kinds stored in the G-buffer
+#define KIND_NONE -1
+#define KIND_PLANE 0
+#define KIND_SPHERE 1
+#define KIND_TRIANGLE 2
 
-//Sets of vertices
-uniform float[3] light;
-uniform float[12] planeVert;
-uniform float[6] planeColor;
+uniform int renderPass = PASS_FULL;
 
-uniform float[288] triangleVert;
-uniform float[96] triangleColor;
+//G-buffer of primary hits written by the primary pass
+uniform sampler2DRect hitPosition;
+uniform sampler2DRect hitNormal;
+uniform sampler2DRect hitMaterial;
 
-uniform float[12] sphereVert;
-uniform float[9] sphereColor;
+//Primary pass can leave triangles to the rasterizer (raster_fragment.glsl),
+//the traced hits then carry depth from the camera projection
+uniform bool traceTriangles = true;
 
-uniform float[8] planeLight;
-uniform float[12] sphereLight;
-uniform float[200]	triangleLight;
+float pi = 3.14159265359;
 
-//Scene 1
-uniform int pV = 6;
-uniform int tV = 108;
-uniform int sV = 4;
+//Camera origin position and projection, updated as the camera moves
+layout(std140) uniform Camera
+{
+	vec4 eye;
+	mat4 viewProjection;
+};
 
-vec3 lightVec = vec3(light[0],light[1],light[2]);
+//Array sizes, these match the SceneBlock structure in Scene.h
+#define MAX_PLANES 4
+#define MAX_SPHERES 4
+#define MAX_TRIANGLES 64
+
+//Sets of vertices, one vec4 per point or colour so the block packs tightly
+//under std140, uploaded in one piece when the scene changes
+layout(std140) uniform Scene
+{
+	vec4 light;
+	
+	//number of planes, spheres and triangles
+	int planeCount;
+	int sphereCount;
+	int triangleCount;
+	
+	//plane normal and point, sphere centre and radius, triangle first corner
+	vec4 planeVert[2*MAX_PLANES];
+	vec4 sphereVert[MAX_SPHERES];
+	vec4 triangleVert[MAX_TRIANGLES];
+	
+	//triangle edges from the first corner, unit normal with the plane
+	//constant dot(normal, corner) in w, worked out once per scene upload
+	vec4 triangleEdge1[MAX_TRIANGLES];
+	vec4 triangleEdge2[MAX_TRIANGLES];
+	vec4 triangleNormal[MAX_TRIANGLES];
+	
+	vec4 planeColor[MAX_PLANES];
+	vec4 sphereColor[MAX_SPHERES];
+	vec4 triangleColor[MAX_TRIANGLES];
+	
+	//ambient, diffuse, specular, phong exponent
+	vec4 planeLight[MAX_PLANES];
+	vec4 sphereLight[MAX_SPHERES];
+	vec4 triangleLight[MAX_TRIANGLES];
+};
+
+//Loop bounds, InitializeShaders() compiles them in as constants for each
+//scene so loops can be unrolled, otherwise they are read from the block
+#ifdef SCENE_PLANES
+	#define pV SCENE_PLANES
+	#define sV SCENE_SPHERES
+	#define tV SCENE_TRIANGLES
+#else
+	#define pV planeCount
+	#define sV sphereCount
+	#define tV triangleCount
+#endif
+
+vec3 lightVec = light.xyz;
 
 vec3 normalPlane = vec3(0,0,0);
 vec3 pointPlane = vec3(0,0,0);
@@ -51,17 +108,22 @@ vec3 centre = vec3(0,0,0);
 float radius = 0;
 
 vec3 point1 = vec3(0,0,0);
-vec3 point2 = vec3(0,0,0);
-vec3 point3 = vec3(0,0,0);
+vec3 edge1 = vec3(0,0,0);
+vec3 edge2 = vec3(0,0,0);
+vec4 planeTri = vec4(0,0,0,0);
+
+//Intersection tests made for the current pixel, shown by the heatmap pass
+int tests = 0;
 
 //Initialize focal length and origin
 float focal_length = 1/(tan(pi/6)); 
-vec3 Origin = vec3(x,y,z);
+vec3 Origin = eye.xyz;
 
 
 //Solve t for a plane intersection
 float closePlane(vec3 D, vec3 N, vec3 Q)
 {
+	tests++;
 	
 	//Solve for t
 	float numerator = dot(N,Q-Origin);
@@ -69,7 +131,7 @@ float closePlane(vec3 D, vec3 N, vec3 Q)
 	
 	//Check for divide by zero
 	if(denominator == 0)
-		return -1;
+		return -1.0;
 		
 	else
 	{
@@ -81,6 +143,7 @@ float closePlane(vec3 D, vec3 N, vec3 Q)
 //Solve t for a sphere intersection
 float closeSphere(vec3 Dir, vec3 Centre, float radius)
 {
+	tests++;
 	
 	float a = dot(Dir,Dir);
 	float b = 2*(dot(Origin,Dir) - dot(Centre,Dir));
@@ -90,7 +153,7 @@ float closeSphere(vec3 Dir, vec3 Centre, float radius)
 	
 	//Negative discriminant, not a real number
 	if(discrim < 0)
-		return -1;
+		return -1.0;
 	
 	//Otherwise...
 	else
@@ -109,39 +172,31 @@ float closeSphere(vec3 Dir, vec3 Centre, float radius)
 
 
 //Solve t for a triangle intersection
-float closeTriangle(vec3 D, vec3 P1, vec3 P2, vec3 P3)
+//P1 is the first corner, e1 and e2 the edges to the other two and N the
+//triangle's plane, rays that miss the plane or hit it behind the origin are
+//turned away before the barycentric test
+float closeTriangle(vec3 D, vec3 P1, vec3 e1, vec3 e2, vec4 N)
 {	
-	vec3 e1 = P2 - P1;
-	vec3 e2 = P3 - P1;
-	vec3 s = Origin-P1;
-	
-	mat3 dee;
-	mat3 see;
-	mat3 dse;
-	mat3 des; 
-	
-	dee[0] = -D;
-	dee[1] = e1;
-	dee[2] = e2;
-	
-	see[0] = s;
-	see[1] = e1;
-	see[2] = e2;
-	
-	dse[0] = -D;
-	dse[1] = s;
-	dse[2] = e2;
+	tests++;
+	float denominator = dot(N.xyz, D);
+	if(denominator == 0)
+		return -1.0;
 	
-	des[0] = -D;
-	des[1] = e1;
-	des[2] = s;
+	float tPlane = (N.w - dot(N.xyz, Origin))/denominator;
+	if(tPlane <= 0)
+		return -1.0;
 	
-	//Cramer's Rule
-	vec3 tuv = (1/determinant(dee))*(vec3(determinant(see),determinant(dse),determinant(des)));
+	//Moller-Trumbore, the same t, u, v as Cramer's rule on [-D, e1, e2],
+	//counted as a second test
+	tests++;
+	vec3 s = Origin-P1;
+	vec3 p = cross(D, e2);
+	vec3 q = cross(s, e1);
+	float invDet = 1/dot(e1, p);
 	
-	float t = tuv.x;
-	float u = tuv.y;
-	float v = tuv.z;
+	float t = dot(e2, q)*invDet;
+	float u = dot(s, p)*invDet;
+	float v = dot(D, q)*invDet;
 	float plus = u+v;
 	
 	//if t > 0 and u, v, and u+v are within the [0,1] range
@@ -149,15 +204,13 @@ float closeTriangle(vec3 D, vec3 P1, vec3 P2, vec3 P3)
 		return t;
 	
 	else
-		return -1;
+		return -1.0;
 }
 
-bool shadowCheck(vec3 Direction, float smallest_t)
+bool shadowCheck(vec3 pointHit)
 {
 			//test current point against objects to get shadow intersection
 		
-				//Get ray intersection point
-				vec3 pointHit = Origin + (smallest_t*Direction);
 				//Get shadow ray direction + length
 				vec3 shadowRay = lightVec - pointHit;
 				//Normalize shadow ray direction
@@ -169,10 +222,10 @@ bool shadowCheck(vec3 Direction, float smallest_t)
 				float s;
 				int j = 0;
 				
-				for(int i = 0; i < pV; i=i+6)	
+				for(int i = 0; i < pV; i++)	
 				{
-					normalPlane = vec3(planeVert[i], planeVert[i+1], planeVert[i+2]);
-					pointPlane = vec3(planeVert[i+3], planeVert[i+4], planeVert[i+5]);
+					normalPlane = planeVert[2*i].xyz;
+					pointPlane = planeVert[2*i+1].xyz;
 					
 					s = closePlane(shadowRay, normalPlane, pointPlane);
 					if(s > 0.001 && s < shadowLength)
@@ -180,11 +233,11 @@ bool shadowCheck(vec3 Direction, float smallest_t)
 				}
 				
 				j = 0;
-				for(int i = 0; i < sV; i=i+4)
+				for(int i = 0; i < sV; i++)
 				{
 					
-					centre = vec3(sphereVert[i], sphereVert[i+1], sphereVert[i+2]);
-					radius = sphereVert[i+3];	
+					centre = sphereVert[i].xyz;
+					radius = sphereVert[i].w;	
 					
 					s = closeSphere(shadowRay, centre, radius);
 					if(s > 0.001 && s < shadowLength)
@@ -193,13 +246,14 @@ bool shadowCheck(vec3 Direction, float smallest_t)
 				
 				j = 0;
 				
-				for(int i = 0; i < tV; i=i+9)
+				for(int i = 0; i < tV; i++)
 				{
-					point1 = vec3(triangleVert[i], triangleVert[i+1], triangleVert[i+2]);
-					point2 = vec3(triangleVert[i+3], triangleVert[i+4], triangleVert[i+5]);
-					point3 = vec3(triangleVert[i+6], triangleVert[i+7], triangleVert[i+8]);
+					point1 = triangleVert[i].xyz;
+					edge1 = triangleEdge1[i].xyz;
+					edge2 = triangleEdge2[i].xyz;
+					planeTri = triangleNormal[i];
 					
-					s = closeTriangle(shadowRay, point1, point2, point3);
+					s = closeTriangle(shadowRay, point1, edge1, edge2, planeTri);
 					if(s > 0.001 && s < shadowLength)
 						return true;
 				}
@@ -233,210 +287,205 @@ vec3 reflectCheck(vec3 Direction, vec3 Normal, float smallest_t)
 	
 				float s;
 				int bounce = 10;
-				int j = 0;
 				
 				
 				//while bounce < 10...
 				
-				for(int i = 0; i < pV; i=i+6)	
+				for(int i = 0; i < pV; i++)	
 				{
-					normalPlane = vec3(planeVert[i], planeVert[i+1], planeVert[i+2]);
-					pointPlane = vec3(planeVert[i+3], planeVert[i+4], planeVert[i+5]);
+					normalPlane = planeVert[2*i].xyz;
+					pointPlane = planeVert[2*i+1].xyz;
 					
 					s = closePlane(reflectRay, normalPlane, pointPlane);
 					if(s > 0.001 && s < reflectLength)
 						{
-							closestColor = vec3(planeColor[j], planeColor[j+1], planeColor[j+2]);
+							closestColor = planeColor[i].rgb;
 							return closestColor;
 						}
-					j = j+3;
 				}
 				
-				for(int i = 0; i < sV; i=i+4)
+				for(int i = 0; i < sV; i++)
 				{
 					
-					centre = vec3(sphereVert[i], sphereVert[i+1], sphereVert[i+2]);
-					radius = sphereVert[i+3];	
+					centre = sphereVert[i].xyz;
+					radius = sphereVert[i].w;	
 					
 					s = closeSphere(reflectRay, centre, radius);
 					if(s > 0.001 && s < reflectLength)
 						{
-							closestColor = vec3(sphereColor[j], sphereColor[j+1], sphereColor[j+2]);
+							closestColor = sphereColor[i].rgb;
 							return closestColor;
 						}
-					j = j+3;
 				}	
 				
-				for(int i = 0; i < tV; i=i+9)
+				for(int i = 0; i < tV; i++)
 				{
-					point1 = vec3(triangleVert[i], triangleVert[i+1], triangleVert[i+2]);
-					point2 = vec3(triangleVert[i+3], triangleVert[i+4], triangleVert[i+5]);
-					point3 = vec3(triangleVert[i+6], triangleVert[i+7], triangleVert[i+8]);
+					point1 = triangleVert[i].xyz;
+					edge1 = triangleEdge1[i].xyz;
+					edge2 = triangleEdge2[i].xyz;
+					planeTri = triangleNormal[i];
 					
-					s = closeTriangle(reflectRay, point1, point2, point3);
+					s = closeTriangle(reflectRay, point1, edge1, edge2, planeTri);
 					if(s > 0.001 && s < reflectLength)
 						{
-							closestColor = vec3(triangleColor[j], triangleColor[j+1], triangleColor[j+2]);
+							closestColor = triangleColor[i].rgb;
 							return closestColor;
 						}
-					j = j+3;
 				}
 	
 	return closestColor;
 	
 }
 
-vec3 closestShape(vec3 Direction)
+//Find the closest primitive along a ray from the origin
+//kind and index identify the primitive, its material uses the same index
+float closestHit(vec3 Direction, bool triangles, out int kind, out int index, out vec3 Normal, out bool backdrop)
 {
-	//Default color is black
-	vec3 closestColor = vec3(0,0,0);
 	float t = 0;
 	float smallest_t = 1000000;
-
-	bool shadow = false;
-	bool plane = false;
 	
-	vec3 Normal;
-	
-	int b = 0;
-	int d = 0;
-	int f = 0;
-	
-	int x = 0;
-	int y = 0;
-	int z = 0;
+	kind = KIND_NONE;
+	index = 0;
+	Normal = vec3(0,0,0);
+	backdrop = false;
 	
 		//test if plane is closest
-		for(int a = 0; a < pV; a = a+6)
+		for(int a = 0; a < pV; a++)
 		{
-			normalPlane = vec3(planeVert[a], planeVert[a+1], planeVert[a+2]);
-			pointPlane = vec3(planeVert[a+3], planeVert[a+4], planeVert[a+5]);
+			normalPlane = planeVert[2*a].xyz;
+			pointPlane = planeVert[2*a+1].xyz;
 			t = closePlane(Direction, normalPlane, pointPlane);
 			
 			//If t intersects and t is smaller than current smallest t, change the smallest t value
 			if(t > 0 && t < smallest_t)
 			{
-				//Get original color
 				smallest_t = t;
-				closestColor = vec3(planeColor[b], planeColor[b+1], planeColor[b+2]);	
-				
-				float cA = planeLight[x];
-				float cL = planeLight[x+1];
-				float cP = planeLight[x+2];
-				float p = planeLight[x+3];
-				
-				//Lighting equation
-				vec3 pointHit = Origin + (smallest_t*Direction);
-				vec3 l = lightVec - pointHit;
-				l = normalize(l);
-				
-				vec3 h = normalize(-pointHit)+l;
-				h = normalize(h);
-				
+				kind = KIND_PLANE;
+				index = a;
 				Normal = normalPlane;
 				
-				closestColor = closestColor*(cA + cL*max(0,dot(normalPlane,l))) + (cP*closestColor*max(0,pow(dot(h,normalPlane),p)));		
-				
-				//Set plane to true so shadow is not cast in scene 3
+				//Set backdrop to true so shadow is not cast in scene 3
 				if(pointPlane == vec3(0,0,-20.0f))
-					plane = true;
-					
+					backdrop = true;
 			}
-
-			b = b+3;
-			x = x+4;
 		}
 
 		//test if sphere is closest
-		for(int c = 0; c < sV; c = c+4)
+		for(int c = 0; c < sV; c++)
 		{
-			centre = vec3(sphereVert[c], sphereVert[c+1], sphereVert[c+2]);
-			radius = sphereVert[c+3];
+			centre = sphereVert[c].xyz;
+			radius = sphereVert[c].w;
 			t = closeSphere(Direction, centre, radius);
 
 			if(t > 0 && t < smallest_t)
 			{
-				//Get original color
 				smallest_t = t;
-				closestColor = vec3(sphereColor[d], sphereColor[d+1], sphereColor[d+2]);
+				kind = KIND_SPHERE;
+				index = c;
 				
-			    float cA = sphereLight[y];
-				float cL = sphereLight[y+1];
-				float cP = sphereLight[y+2];
-				float p = sphereLight[y+3];
-		
-				//Lighting equation
 				vec3 pointHit = Origin + (smallest_t*Direction);
-				vec3 l = lightVec - pointHit;
-				l = normalize(l);
-										
-				vec3 normalSphere = pointHit - centre;
-				normalSphere = normalize(normalSphere);
-				
-				vec3 h = normalize(-pointHit)+l;
-				h = normalize(h);
-	
-			    Normal = normalSphere;
-					
-				closestColor = closestColor*(cA + cL*max(0,dot(normalSphere,l))) + (cP*closestColor*max(0,pow(dot(h,normalSphere),p)));
+				Normal = normalize(pointHit - centre);
 			}
-			
-			d = d+3;
-			y = y+4;
 		}
 		
 		//test if triangle is closest
-		for(int e = 0; e < tV; e = e+9)
+		for(int e = 0; triangles && e < tV; e++)
 		{
-			point1 = vec3(triangleVert[e], triangleVert[e+1], triangleVert[e+2]);
-			point2 = vec3(triangleVert[e+3], triangleVert[e+4], triangleVert[e+5]);
-			point3 = vec3(triangleVert[e+6], triangleVert[e+7], triangleVert[e+8]);
-			t = closeTriangle(Direction, point1, point2, point3);
+			point1 = triangleVert[e].xyz;
+			edge1 = triangleEdge1[e].xyz;
+			edge2 = triangleEdge2[e].xyz;
+			planeTri = triangleNormal[e];
+			t = closeTriangle(Direction, point1, edge1, edge2, planeTri);
 
 			if(t > 0 && t < smallest_t)
 			{
-				//Get original color
-				smallest_t = t; 
-				closestColor = vec3(triangleColor[f], triangleColor[f+1], triangleColor[f+2]);
-				
-				//Get ambient color, light intensity, phong exponent
-			    float cA = triangleLight[z];
-				float cL = triangleLight[z+1];
-				float cP = triangleLight[z+2];
-				float p = triangleLight[z+3];
-				
-				//Lighting equation
-				vec3 pointHit = Origin + (smallest_t*Direction);
-				vec3 l = lightVec - pointHit;
-				l = normalize(l);				
-				
-				vec3 side1 = point2 - point1;
-				vec3 side2 = point3 - point1;
-				
-				vec3 h = normalize(-pointHit)+l;
-				h = normalize(h);
-				
-				vec3 normalTriangle = cross(side1,side2);
-				normalTriangle = normalize(normalTriangle);
-				
-				Normal = normalTriangle;
-					
-				closestColor = closestColor*(cA + cL*max(0,dot(normalTriangle,l))) + (cP*closestColor*max(0,pow(sqrt(dot(h,normalTriangle)),p)));
+				smallest_t = t;
+				kind = KIND_TRIANGLE;
+				index = e;
+				Normal = planeTri.xyz;
 			}
-
-			f = f+3;
-			z = z+4;
-		}					
+		}
 		
+	return smallest_t;
+}
+
+//Light a primary hit and darken it if the light is blocked
+vec3 shadeHit(vec3 pointHit, vec3 Normal, int kind, int index, bool backdrop)
+{
+	//Default color is black
+	vec3 closestColor = vec3(0,0,0);
+	if(kind == KIND_NONE)
+		return closestColor;
+	
+	//Get original color, ambient color, light intensity, phong exponent
+	vec4 material;
+	if(kind == KIND_PLANE)
+	{
+		closestColor = planeColor[index].rgb;
+		material = planeLight[index];
+	}
+	else if(kind == KIND_SPHERE)
+	{
+		closestColor = sphereColor[index].rgb;
+		material = sphereLight[index];
+	}
+	else
+	{
+		closestColor = triangleColor[index].rgb;
+		material = triangleLight[index];
+	}
+	
+	float cA = material.x;
+	float cL = material.y;
+	float cP = material.z;
+	float p = material.w;
+	
+	//Lighting equation
+	vec3 l = lightVec - pointHit;
+	l = normalize(l);
+	
+	vec3 h = normalize(-pointHit)+l;
+	h = normalize(h);
+	
+	float specular = dot(h,Normal);
+	if(kind == KIND_TRIANGLE)
+		specular = sqrt(specular);
+	
+	closestColor = closestColor*(cA + cL*max(0.0,dot(Normal,l))) + (cP*closestColor*max(0.0,pow(specular,p)));
+	
+	bool shadow = shadowCheck(pointHit);
+	if(shadow && backdrop == false)
+		closestColor = closestColor-0.3f;
+	
+	return closestColor;
+}
+
+//False colour of a cost between 0 and 1, blue through green and yellow to
+//red, fading in from black; matches HeatmapColour() in RayTracer.cpp
+vec3 heatColour(float cost)
+{
+	float t = clamp(cost, 0.0, 1.0);
+	vec3 colour = clamp(1.5 - abs(4*t - vec3(3,2,1)), 0.0, 1.0);
+	return colour*min(1.0, 8*t);
+}
+
+vec3 closestShape(vec3 Direction)
+{
+	int kind;
+	int index;
+	vec3 Normal;
+	bool backdrop;
+	
+	float smallest_t = closestHit(Direction, true, kind, index, Normal, backdrop);
+	vec3 pointHit = Origin + (smallest_t*Direction);
+	
 				//vec3 reflect = reflectCheck(Direction, Normal, smallest_t);
 				//reflect = reflect*0.01f;
 				//closestColor = closestColor + reflect;
 				
-				shadow = shadowCheck(Direction, smallest_t);	
-				if(shadow && plane == false)
-					closestColor = closestColor-0.3f;	
-				
-				Origin = vec3(x,y,z);
+	vec3 closestColor = shadeHit(pointHit, Normal, kind, index, backdrop);
+	
+				Origin = eye.xyz;
 	
 	return closestColor;
 }
@@ -444,12 +493,63 @@ vec3 closestShape(vec3 Direction)
 
 void main(void)
 {
+	//Depth only matters when rasterized triangles are merged with traced hits
+	gl_FragDepth = gl_FragCoord.z;
+	
+	//Relight the stored primary hit, primary visibility is unchanged
+	if(renderPass == PASS_SHADE)
+	{
+		ivec2 texel = ivec2(gl_FragCoord.xy);
+		vec4 position = texelFetch(hitPosition, texel);
+		vec4 normal = texelFetch(hitNormal, texel);
+		vec4 material = texelFetch(hitMaterial, texel);
+		
+		vec3 newColor = shadeHit(position.xyz, normal.xyz, int(material.x), int(material.z), normal.w > 0.5);
+		FragmentColour = vec4(newColor,0);
+		return;
+	}
+	
 	//Direction vector
 	vec3 Direction = vec3(Coordinates.x,Coordinates.y,-focal_length);
 	
 	//Normalize direction vector
 	Direction = normalize(Direction);
+	
+	//Store the closest hit in the G-buffer for later shading passes
+	if(renderPass == PASS_PRIMARY)
+	{
+		int kind;
+		int index;
+		vec3 Normal;
+		bool backdrop;
+		
+		float smallest_t = closestHit(Direction, traceTriangles, kind, index, Normal, backdrop);
+		vec3 pointHit = Origin + (smallest_t*Direction);
+		
+		//Misses go to the far plane so any rasterized triangle is in front
+		vec4 clip = viewProjection*vec4(pointHit,1);
+		if(kind == KIND_NONE)
+			gl_FragDepth = 1.0;
+		else
+			gl_FragDepth = clamp((clip.z/clip.w)*0.5 + 0.5, 0.0, 1.0);
+		
+		//position and t, normal and backdrop flag, kind and primitive/material index
+		FragmentColour = vec4(pointHit, smallest_t);
+		HitNormal = vec4(Normal, backdrop ? 1.0 : 0.0);
+		HitMaterial = vec4(kind, index, index, 0);
+		return;
+	}
 			
+	//Show how many intersection tests the full pass makes, scaled by the
+	//most one pixel can take
+	if(renderPass == PASS_HEATMAP)
+	{
+		closestShape(Direction);
+		float maxTests = 2*(pV + sV + 2*tV);
+		FragmentColour = vec4(heatColour(tests/max(maxTests, 1.0)), 0);
+		return;
+	}
+	
 	//Look at every shape, find smallest value of t
 	//Get color belonging to the closest shape
 	vec3 newColor = closestShape(Direction);
@@ -0,0 +1,42 @@
+// ==========================================================================
+// Fragment program for rasterized primary visibility
+//
+// Writes scene triangles into the same G-buffer layout as the primary pass
+// in fragment.glsl, which then shades them with shadow rays only.
+//
+// Author:  Shannon TJ 10101385
+
+// Date:    Fall 2016
+// ==========================================================================
+#version 410
+
+//Primitive kind of a triangle, matches KIND_TRIANGLE in fragment.glsl
+#define KIND_TRIANGLE 2
+
+in vec3 Position;
+flat in vec3 Normal;
+
+//Camera shared with fragment.glsl
+layout(std140) uniform Camera
+{
+	vec4 eye;
+	mat4 viewProjection;
+};
+
+//G-buffer attachments: position and t, normal and backdrop flag,
+//kind and primitive/material index
+layout(location = 0) out vec4 HitPosition;
+layout(location = 1) out vec4 HitNormal;
+layout(location = 2) out vec4 HitMaterial;
+
+void main(void)
+{
+	float t = distance(Position, eye.xyz);
+	
+	//Triangles are drawn in scene order, so the primitive id is the index
+	HitPosition = vec4(Position, t);
+	
+	//The backdrop flag is masked off and keeps the traced value
+	HitNormal = vec4(Normal, 0);
+	HitMaterial = vec4(KIND_TRIANGLE, gl_PrimitiveID, gl_PrimitiveID, 0);
+}
@@ -0,0 +1,33 @@
+// ==========================================================================
+// Vertex program for rasterized primary visibility
+//
+// Author:  Shannon TJ 10101385
+
+// Date:    Fall 2016
+// ==========================================================================
+#version 410
+
+// location indices for these attributes correspond to those specified in the
+// InitializeTriangles() function of the main program
+layout(location = 0) in vec3 VertexPosition;
+layout(location = 1) in vec3 VertexNormal;
+
+// same pinhole camera as the ray tracer, shared with fragment.glsl
+layout(std140) uniform Camera
+{
+    vec4 eye;
+    mat4 viewProjection;
+};
+
+// output to be interpolated between vertices and passed to the fragment stage
+out vec3 Position;
+flat out vec3 Normal;
+
+void main()
+{
+    // project the scene triangle, the world position is the primary hit
+    gl_Position = viewProjection * vec4(VertexPosition, 1.0);
+
+    Position = VertexPosition;
+    Normal = VertexNormal;
+}